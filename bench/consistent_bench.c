@@ -0,0 +1,341 @@
+/* vim: set sts=4 sw=4 expandtab: */
+/*
+ * Standalone benchmark of the consistent.h core, no Ruby involved.
+ * Prints JSON to stdout, so results of different releases could be diffed.
+ *
+ *   make -C bench run
+ *   bench/consistent_bench -s 10,1000 -p 160,500 -k 8,64 -n 200000
+ *   bench/consistent_bench -s 100000 -p 160 -t 32   # NUMA replicas pay off with threads on every socket
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/md5.h>
+
+#define CONSISTENT_IMPLEMENTATION
+#include "consistent.h"
+
+#define MAX_LIST (16)
+#define ALL_LOOKUPS_MAX_SERVERS (1000)
+
+typedef struct {
+    uint32_t count;
+    uint32_t vals[MAX_LIST];
+} List_t;
+
+typedef struct {
+    List_t   servers;
+    List_t   points;
+    List_t   key_lens;
+    uint32_t lookups;
+    uint32_t keys;
+    uint32_t threads;
+} Options_t;
+
+static void
+md5_points_hash(__unused__ void *_ctx, const char *serv, size_t len, uint32_t seed, uint32_t digest[4])
+{
+    MD5_CTX ctx;
+    uint64_t seedb = seed;
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, (unsigned char*)&seedb, sizeof(seedb));
+    MD5_Update(&ctx, (unsigned char*)serv, len);
+    MD5_Final((unsigned char*)digest, &ctx);
+}
+
+static const struct {
+    const char       *name;
+    CH_points_hash_t  hash;
+} points_hashes[] = {
+    { "murmur", NULL }, /* consistent.h default */
+    { "md5", md5_points_hash },
+};
+
+/* continuum read directly, or through per NUMA node copies on huge pages */
+static const struct {
+    const char *name;
+    int         replicated;
+} layouts[] = {
+    { "plain", 0 },
+    { "replicated", 1 },
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+parse_list(List_t *list, const char *arg)
+{
+    char *end;
+    list->count = 0;
+    while (*arg && list->count < MAX_LIST) {
+        list->vals[list->count++] = (uint32_t)strtoul(arg, &end, 10);
+        if (*end != ',')
+            break;
+        arg = end + 1;
+    }
+}
+
+static void
+server_name(char *buf, size_t size, uint32_t i)
+{
+    snprintf(buf, size, "10.%u.%u.%u:11211", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+}
+
+static ConsistentHash_ServerList_t *
+make_list(ConsistentHash_t *ring, uint32_t servers, uint32_t skip)
+{
+    ConsistentHash_ServerList_t *list = ConsistentHash_ServerList_new(ring);
+    char name[32];
+    uint32_t i;
+    for (i = 0; i < servers; i++) {
+        if (i == skip)
+            continue;
+        server_name(name, sizeof(name), i);
+        ConsistentHash_ServerList_add(list, name, strlen(name), 100 + (i % 3) * 50, CH_ALIVE, 0);
+    }
+    return list;
+}
+
+static char *
+make_keys(uint32_t count, uint32_t len)
+{
+    char *keys = malloc((size_t)count * len);
+    uint32_t i, state = 0x9e3779b9;
+    for (i = 0; i < count * len; i++) {
+        state = state * 1103515245 + 12345;
+        keys[i] = 'a' + (state >> 16) % 26;
+    }
+    return keys;
+}
+
+/* returns nanoseconds per lookup, fetching at most `replicas` servers (0 means all) */
+static double
+bench_lookups(ConsistentHash_t *ring, const char *keys, uint32_t key_count, uint32_t key_len,
+              uint32_t lookups, uint32_t replicas)
+{
+    ConsistentHash_Iterator_t iter = ConsistentHash_Iterator_init_value(ring);
+    uint64_t start, sink = 0;
+    uint32_t i, j;
+
+    start = now_ns();
+    for (i = 0; i < lookups; i++) {
+        const char *key = keys + (size_t)(i % key_count) * key_len;
+        ConsistentHash_Iterator_init(&iter, key, key_len);
+        for (j = 0; replicas == 0 || j < replicas; j++) {
+            ConsistentHash_IteratorName_t res = ConsistentHash_Iterator_next_name(&iter);
+            if (res.name == NULL)
+                break;
+            sink += res.size;
+        }
+        ConsistentHash_Iterator_release(&iter);
+    }
+    if (sink == 0)
+        fprintf(stderr, "no servers found\n");
+    return (double)(now_ns() - start) / lookups;
+}
+
+CONSISTENT_DEFINE_LOOKUP(lookup_murmur, CH_murmur_item_hash)
+
+/* same as bench_lookups, through lookup kernel specialised for default item hash */
+static double
+bench_kernel(ConsistentHash_t *ring, const char *keys, uint32_t key_count, uint32_t key_len,
+             uint32_t lookups, uint32_t replicas)
+{
+    ConsistentHash_LookupView_t view = ConsistentHash_lookup_view(ring);
+    uint32_t servers[16];
+    uint64_t start, sink = 0;
+    uint32_t i;
+
+    start = now_ns();
+    for (i = 0; i < lookups; i++) {
+        const char *key = keys + (size_t)(i % key_count) * key_len;
+        sink += lookup_murmur(&view, key, key_len, servers, replicas);
+        sink += servers[0];
+    }
+    if (sink == 0)
+        fprintf(stderr, "no servers found\n");
+    return (double)(now_ns() - start) / lookups;
+}
+
+typedef struct {
+    pthread_t        thread;
+    ConsistentHash_t *ring;
+    const char       *keys;
+    uint32_t          key_count, key_len, lookups, replicas;
+    double            ns;
+} LookupThread_t;
+
+static void *
+lookup_thread(void *arg)
+{
+    LookupThread_t *t = arg;
+    t->ns = bench_lookups(t->ring, t->keys, t->key_count, t->key_len, t->lookups, t->replicas);
+    return NULL;
+}
+
+/* mean nanoseconds per lookup of threads looking up concurrently */
+static double
+bench_threads(const Options_t *opts, ConsistentHash_t *ring, const char *keys, uint32_t key_len,
+              uint32_t lookups, uint32_t replicas)
+{
+    LookupThread_t *threads;
+    double ns = 0;
+    uint32_t i;
+
+    if (opts->threads <= 1)
+        return bench_lookups(ring, keys, opts->keys, key_len, lookups, replicas);
+    threads = calloc(opts->threads, sizeof(*threads));
+    for (i = 0; i < opts->threads; i++) {
+        LookupThread_t t = { 0, ring, keys, opts->keys, key_len, lookups, replicas, 0 };
+        threads[i] = t;
+        pthread_create(&threads[i].thread, NULL, lookup_thread, &threads[i]);
+    }
+    for (i = 0; i < opts->threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        ns += threads[i].ns;
+    }
+    free(threads);
+    return ns / opts->threads;
+}
+
+static void
+bench_case(const Options_t *opts, uint32_t servers, uint32_t points, uint32_t hash_idx, uint32_t layout,
+           int *first)
+{
+    CH_config_t config = {
+        .use_handle = CH_DONOT_USE_HANDLE,
+        .points_hash = points_hashes[hash_idx].hash,
+        .points_per_server = points,
+        .numa_replicas = layouts[layout].replicated,
+        .huge_pages = layouts[layout].replicated
+    };
+    ConsistentHash_t *ring = ConsistentHash_new(config);
+    ConsistentHash_ServerList_t *list;
+    ConsistentHash_AliveByName_t *alive;
+    uint64_t start, build_ns, rebuild_ns, exchange_ns, refresh_ns;
+    char name[32];
+    uint32_t i, k;
+
+    list = make_list(ring, servers, (uint32_t)-1);
+    start = now_ns();
+    ConsistentHash_exchange_server_list(ring, list);
+    build_ns = now_ns() - start;
+    ConsistentHash_ServerList_free(list);
+
+    /* same servers: every point is reused, only continuum is rebuilt */
+    list = make_list(ring, servers, (uint32_t)-1);
+    start = now_ns();
+    ConsistentHash_exchange_server_list(ring, list);
+    rebuild_ns = now_ns() - start;
+    ConsistentHash_ServerList_free(list);
+
+    /* one server less: typical topology change */
+    list = make_list(ring, servers, servers / 2);
+    start = now_ns();
+    ConsistentHash_exchange_server_list(ring, list);
+    exchange_ns = now_ns() - start;
+    ConsistentHash_ServerList_free(list);
+
+    /* every tenth server is down */
+    alive = ConsistentHash_AliveByName_new(ring);
+    for (i = 0; i < servers; i += 10) {
+        server_name(name, sizeof(name), i);
+        ConsistentHash_AliveByName_add(alive, name, strlen(name), CH_DOWN);
+    }
+    start = now_ns();
+    ConsistentHash_refresh_alive_by_name(ring, alive, CH_DEFAULT);
+    refresh_ns = now_ns() - start;
+    ConsistentHash_AliveByName_free(alive);
+
+    printf("%s\n    {\"servers\": %u, \"points_per_server\": %u, \"points_hash\": \"%s\",\n"
+           "     \"layout\": \"%s\", \"replicas\": %u,\n"
+           "     \"build_ns\": %llu, \"rebuild_ns\": %llu, \"exchange_ns\": %llu, \"refresh_ns\": %llu,\n"
+           "     \"memory_bytes\": %zu, \"lookups\": [",
+           *first ? "" : ",", servers, points, points_hashes[hash_idx].name,
+           layouts[layout].name, ConsistentHash_replicas(ring),
+           (unsigned long long)build_ns, (unsigned long long)rebuild_ns,
+           (unsigned long long)exchange_ns, (unsigned long long)refresh_ns,
+           ConsistentHash_size(ring));
+    *first = 0;
+
+    for (k = 0; k < opts->key_lens.count; k++) {
+        uint32_t key_len = opts->key_lens.vals[k];
+        char *keys = make_keys(opts->keys, key_len);
+        printf("%s\n       {\"key_len\": %u, \"first_ns\": %.1f, \"three_ns\": %.1f,"
+               " \"kernel_first_ns\": %.1f, \"kernel_three_ns\": %.1f",
+               k ? "," : "", key_len,
+               bench_threads(opts, ring, keys, key_len, opts->lookups, 1),
+               bench_threads(opts, ring, keys, key_len, opts->lookups, 3),
+               bench_kernel(ring, keys, opts->keys, key_len, opts->lookups, 1),
+               bench_kernel(ring, keys, opts->keys, key_len, opts->lookups, 3));
+        if (servers <= ALL_LOOKUPS_MAX_SERVERS)
+            printf(", \"all_ns\": %.1f",
+                   bench_threads(opts, ring, keys, key_len, opts->lookups / servers + 1, 0));
+        printf("}");
+        free(keys);
+    }
+    printf("]}");
+    fflush(stdout);
+
+    ConsistentHash_free(ring);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-s servers,...] [-p points_per_server,...] [-k key_len,...] [-n lookups] [-t threads]\n"
+            "  defaults: -s 10,100,1000,10000,100000 -p 160,500 -k 8,32,128 -n 1000000 -t 1\n"
+            "  lookups are made by every thread, latency is mean of threads\n",
+            prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    Options_t opts;
+    uint32_t s, p, h, l;
+    int first = 1, opt;
+
+    parse_list(&opts.servers, "10,100,1000,10000,100000");
+    parse_list(&opts.points, "160,500");
+    parse_list(&opts.key_lens, "8,32,128");
+    opts.lookups = 1000000;
+    opts.keys = 4096;
+    opts.threads = 1;
+
+    while ((opt = getopt(argc, argv, "s:p:k:n:t:h")) != -1) {
+        switch (opt) {
+        case 's': parse_list(&opts.servers, optarg); break;
+        case 'p': parse_list(&opts.points, optarg); break;
+        case 'k': parse_list(&opts.key_lens, optarg); break;
+        case 'n': opts.lookups = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 't': opts.threads = (uint32_t)strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (opts.lookups == 0)
+        usage(argv[0]);
+
+    printf("{\"benchmark\": \"consistent\", \"lookups_per_case\": %u, \"threads\": %u, \"results\": [",
+           opts.lookups, opts.threads);
+    for (s = 0; s < opts.servers.count; s++)
+        for (p = 0; p < opts.points.count; p++)
+            for (h = 0; h < sizeof(points_hashes) / sizeof(points_hashes[0]); h++)
+                for (l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+                    bench_case(&opts, opts.servers.vals[s], opts.points.vals[p], h, l, &first);
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,86 @@
+#
+# Ruby level benchmark of Consistent::Ring.
+#
+#   rake bench
+#   BENCH_SIZES=10,1000 BENCH_TIME=2 rake bench
+#   MEMORY_PROFILER=1 rake bench    # detailed allocation report of #get
+#
+require 'benchmark/ips'
+require File.expand_path("../../lib/consistent", __FILE__)
+
+SIZES = (ENV['BENCH_SIZES'] || "10,100,1000").split(",").map(&:to_i)
+TIME = (ENV['BENCH_TIME'] || 3).to_f
+WARMUP = (ENV['BENCH_WARMUP'] || 1).to_f
+ALL_MAX_SIZE = 100
+ALLOC_ITERATIONS = { get: 1000, refresh: 20 }
+
+def nodes(size, prefix = "server")
+  Array.new(size){ |i| { node: "#{prefix}#{i}.mydomain.cc:11211", weight: 100 + (i % 3) * 50 } }
+end
+
+# average amount of objects allocated by one call of block
+def allocations(iterations)
+  yield # warm up caches
+  GC.disable
+  before = GC.stat(:total_allocated_objects)
+  iterations.times{ yield }
+  after = GC.stat(:total_allocated_objects)
+  GC.enable
+  (after - before).to_f / iterations
+end
+
+def cases(size)
+  ring = Consistent::Ring.new nodes(size)
+  keys = Array.new(1024){ |i| "user:#{i * 7919}:profile" }
+  ki = 0
+  toggle = [:dead, :alive].cycle
+  extra = { node: "extra.mydomain.cc:11211" }
+  replacement = nodes(size, "replacement")
+
+  list = {
+    "get"       => proc{ ring.get(keys[(ki += 1) & 1023]) },
+    "get(3)"    => proc{ ring.get(keys[(ki += 1) & 1023], 3) },
+    "get(:all)" => proc{ ring.get(keys[(ki += 1) & 1023], :all) },
+    "add!"      => proc{ ring.add!(extra) },
+    "update!"   => proc{ ring.update!(node: "server0.mydomain.cc:11211", status: toggle.next) },
+    "replace!"  => proc{ ring.replace!(replacement) },
+  }
+  list.delete("get(:all)") if size > ALL_MAX_SIZE
+  list
+end
+
+results = {}
+
+SIZES.each do |size|
+  puts "== ring of #{size} nodes"
+  allocated = {}
+
+  Benchmark.ips do |x|
+    x.config(time: TIME, warmup: WARMUP)
+    cases(size).each do |name, job|
+      x.report("#{name} (#{size})"){ job.call }
+    end
+  end
+
+  # every case gets fresh ring, so that mutations of previous one do not leak
+  cases(size).each_key do |name|
+    iterations = name.start_with?("get") ? ALLOC_ITERATIONS[:get] : ALLOC_ITERATIONS[:refresh]
+    allocated[name] = allocations(iterations, &cases(size)[name])
+  end
+
+  results[size] = allocated
+end
+
+puts
+puts "== allocated objects per call"
+names = results.values.flat_map(&:keys).uniq
+puts "%-12s" % "nodes" + names.map{ |n| "%12s" % n }.join
+results.each do |size, allocated|
+  puts "%-12d" % size + names.map{ |n| allocated[n] ? "%12.1f" % allocated[n] : "%12s" % "-" }.join
+end
+
+if ENV['MEMORY_PROFILER']
+  require 'memory_profiler'
+  get = cases(SIZES.first)["get"]
+  MemoryProfiler.report{ ALLOC_ITERATIONS[:get].times{ get.call } }.pretty_print
+end
@@ -16,124 +16,961 @@ static void md5_points_hash(__unused__ void *_ctx, const char *serv, size_t len,
     MD5_Final((unsigned char*)digest, &ctx);
 }
 
+/* ring memory goes through Ruby's allocator, so that GC knows about its pressure */
+static void *ruby_realloc(__unused__ void *_ctx, void *old, size_t new_size) {
+    if (new_size == 0) {
+        ruby_xfree(old);
+        return NULL;
+    }
+    return ruby_xrealloc(old, new_size);
+}
+
+static uint32_t md5_item_hash(__unused__ void *_ctx, const char *item, size_t len, uint32_t seed) {
+    uint32_t digest[4];
+    md5_points_hash(_ctx, item, len, seed, digest);
+    return digest[0];
+}
+
 
 
 
 // Ruby methods
 VALUE Consistent = Qnil;
+VALUE PointCache = Qnil;
+VALUE SharedRing = Qnil;
 
+VALUE method_init(int argc, VALUE *argv, VALUE self);
+VALUE method_use_handle(VALUE self);
+VALUE method_memsize(VALUE self);
 VALUE method_get(VALUE self, VALUE token, VALUE cnt, VALUE all);
-VALUE method_add(VALUE self, VALUE items);
-VALUE method_update(VALUE self, VALUE items);
-// VALUE method_replace(VALUE self, VALUE items);
-
-CH_config_t config = {
-    .use_handle = CH_DONOT_USE_HANDLE,
-    .points_hash = md5_points_hash,
-    .points_per_server = 500
-};
+VALUE method_get_first(VALUE self, VALUE token);
+VALUE method_get_with_previous(VALUE self, VALUE token);
+VALUE method_epoch(VALUE self);
+VALUE method_retire_previous(VALUE self);
+VALUE method_add_node(int argc, VALUE *argv, VALUE self);
+VALUE method_replace_node(int argc, VALUE *argv, VALUE self);
+VALUE method_update_node(int argc, VALUE *argv, VALUE self);
+VALUE method_update_nodes(VALUE self, VALUE nodes);
+VALUE method_load_chunk(VALUE self, VALUE chunk);
+VALUE method_is_pending(VALUE self);
+VALUE method_refresh(VALUE self);
+VALUE method_ownership(VALUE self);
+VALUE method_diff(VALUE self, VALUE other);
+VALUE method_key_hash(VALUE self, VALUE key);
+VALUE method_collect_stats(VALUE self, VALUE enable);
+VALUE method_stats(VALUE self);
+VALUE method_points_budget(VALUE self, VALUE max_total_points, VALUE min_points);
+VALUE method_track_hot_keys(VALUE self, VALUE sample_rate);
+VALUE method_hot_keys(VALUE self, VALUE n);
+VALUE method_reset_hot_keys(VALUE self);
+VALUE method_mark_hot(VALUE self, VALUE key, VALUE spread, VALUE mode);
+VALUE method_report_load(VALUE self, VALUE node, VALUE load);
+VALUE method_rebalance(VALUE self, VALUE loads, VALUE max_movement);
+VALUE method_reset_balance(VALUE self);
+VALUE method_ramp(VALUE self, VALUE node, VALUE to, VALUE steps);
+VALUE method_ramp_step(VALUE self);
+VALUE method_fail_node(VALUE self, VALUE node);
+VALUE method_is_rebuild_pending(VALUE self);
+VALUE method_rebuild(VALUE self);
+VALUE method_publish(VALUE self, VALUE name);
+
+#define DEFAULT_WEIGHT (100)
+#define DEFAULT_POINTS (500)
+
+typedef struct {
+  CH_config_t       config; /* ring is created with it in initialize */
+  ConsistentHash_t *ring;
+  VALUE names; /* frozen node name for every server index of ring */
+  /* changes staged until refresh */
+  ConsistentHash_ServerList_t  *staged;    /* full new server list, NULL if servers are not changed */
+  int                           replacing; /* staged list is built from scratch */
+  ConsistentHash_AliveByName_t *updates;
+} ConsistentRing_t;
+
+static ID id_alive, id_dead, id_down, id_default, id_md5, id_murmur, id_round_robin, id_least_loaded, id_all, id_to_a;
+static VALUE sym_node, sym_status;
+static VALUE sym_nodes, sym_max_ratio, sym_min_ratio, sym_stddev;
+static VALUE sym_ranges, sym_moved, sym_moved_from, sym_moved_to;
+static VALUE sym_lookups, sym_probes, sym_collisions, sym_rebuilds, sym_rebuild_seconds, sym_last_rebuild_seconds,
+             sym_points_generated, sym_points_reused, sym_memsize, sym_points, sym_points_budget,
+             sym_points_scale, sym_min_points, sym_max_points, sym_max_weight_error;
+
+static const rb_data_type_t ring_type;
+
+ConsistentRing_t* get_Wrapper(VALUE self) {
+  ConsistentRing_t* wrapper;
+  TypedData_Get_Struct(self, ConsistentRing_t, &ring_type, wrapper);
+  if (wrapper->ring == NULL)
+    rb_raise(rb_eRuntimeError, "uninitialized ConsistentRing");
+  return wrapper;
+}
 
 ConsistentHash_t* get_Ring(VALUE self) {
-  ConsistentHash_t* ring;
-  Data_Get_Struct(self, ConsistentHash_t, ring);
-  return ring;
+  return get_Wrapper(self)->ring;
+}
+
+static void mark_Ring(void *ptr) {
+  ConsistentRing_t *wrapper = ptr;
+  rb_gc_mark(wrapper->names);
+}
+
+static void release_staged(ConsistentRing_t *wrapper) {
+  ConsistentHash_ServerList_free(wrapper->staged);
+  ConsistentHash_AliveByName_free(wrapper->updates);
+  wrapper->staged = NULL;
+  wrapper->updates = NULL;
+  wrapper->replacing = 0;
+}
+
+static void free_Ring(void *ptr) {
+  ConsistentRing_t *wrapper = ptr;
+  release_staged(wrapper);
+  ConsistentHash_free(wrapper->ring);
+  xfree(wrapper);
+}
+
+static size_t size_Ring(const void *ptr) {
+  ConsistentRing_t *wrapper = (ConsistentRing_t *)ptr;
+  size_t size = sizeof(*wrapper);
+  if (wrapper->ring)
+    size += ConsistentHash_size(wrapper->ring);
+  if (wrapper->staged)
+    size += ConsistentHash_ServerList_size(wrapper->staged);
+  if (wrapper->updates)
+    size += ConsistentHash_AliveByName_size(wrapper->updates);
+  return size;
+}
+
+static const rb_data_type_t ring_type = {
+  "ConsistentRing",
+  { mark_Ring, free_Ring, size_Ring, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void free_PointCache(void *ptr) {
+  /* rings made with the cache keep it until they are freed */
+  ConsistentHash_PointCache_free(ptr);
+}
+
+static size_t size_PointCache(const void *ptr) {
+  return ConsistentHash_PointCache_size((ConsistentHash_PointCache_t *)ptr);
 }
 
-void wrap_Ring(VALUE klass) {
-  ConsistentHash_t* ring = ConsistentHash_new(config);
-  Data_Wrap_Struct(klass, NULL, ConsistentHash_free, ring);
+static const rb_data_type_t point_cache_type = {
+  "ConsistentPointCache",
+  { 0, free_PointCache, size_PointCache, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE wrap_PointCache(VALUE klass) {
+  CH_config_t config = {0};
+  config.realloc = ruby_realloc;
+  return TypedData_Wrap_Struct(klass, &point_cache_type, ConsistentHash_PointCache_new(config));
+}
+
+static ConsistentHash_PointCache_t *get_PointCache(VALUE self) {
+  ConsistentHash_PointCache_t *cache;
+  TypedData_Get_Struct(self, ConsistentHash_PointCache_t, &point_cache_type, cache);
+  return cache;
+}
+
+/* number of nodes which points are cached */
+static VALUE method_point_cache_size(VALUE self) {
+  return UINT2NUM(ConsistentHash_PointCache_count(get_PointCache(self)));
+}
+
+static VALUE method_point_cache_memsize(VALUE self) {
+  return SIZET2NUM(ConsistentHash_PointCache_size(get_PointCache(self)));
+}
+
+static VALUE wrap_Ring(VALUE klass) {
+  ConsistentRing_t *wrapper;
+  VALUE self = TypedData_Make_Struct(klass, ConsistentRing_t, &ring_type, wrapper);
+  wrapper->names = rb_ary_new();
+  return self;
+}
+
+/* handles are packed ip:port or user's ids, both fit into Fixnum */
+static VALUE server_result(ConsistentRing_t *wrapper, uint32_t server) {
+  if (ConsistentHash_use_handle(wrapper->ring) == CH_USE_HANDLE)
+    return ULL2NUM(ConsistentHash_server_handle(wrapper->ring, server).handle);
+  return RARRAY_AREF(wrapper->names, server);
+}
+
+/* frozen name of server, as #get returns it; nil for CH_NO_SERVER */
+static VALUE cached_name(ConsistentRing_t *wrapper, uint32_t server) {
+  return server < (uint32_t)RARRAY_LEN(wrapper->names) ? RARRAY_AREF(wrapper->names, server) : Qnil;
+}
+
+static VALUE frozen_name(const char *name, size_t size) {
+#ifdef HAVE_RB_INTERNED_STR
+  return rb_interned_str(name, size);
+#else
+  return rb_obj_freeze(rb_str_new(name, size));
+#endif
+}
+
+/* servers are reindexed by every exchange, so cached names are rebuilt too */
+static void refresh_names(ConsistentRing_t *wrapper) {
+  uint32_t i, count = ConsistentHash_servers_count(wrapper->ring);
+  VALUE names = rb_ary_new2(count);
+  for(i = 0; i < count; i++) {
+    ConsistentHash_IteratorName_t name = ConsistentHash_server_name(wrapper->ring, i);
+    rb_ary_push(names, frozen_name(name.name, name.size));
+  }
+  wrapper->names = names;
+}
+
+/* :md5 or :murmur, nil means default_hash */
+static int hash_is_md5(VALUE hash, int default_md5) {
+  ID id;
+  if (NIL_P(hash))
+    return default_md5;
+  id = SYM2ID(rb_to_symbol(hash));
+  if (id == id_md5) return 1;
+  if (id == id_murmur) return 0;
+  rb_raise(rb_eArgError, "Bad hash %"PRIsVALUE", should be :md5 or :murmur", hash);
+}
+
+/* accepts :alive, :dead, :down, :default, raw integer value or nil */
+static CH_aliveness_e status_from_value(VALUE status, CH_aliveness_e default_status) {
+  ID id;
+  if (NIL_P(status))
+    return default_status;
+  if (FIXNUM_P(status))
+    return (CH_aliveness_e)FIX2INT(status);
+  id = SYM2ID(rb_to_symbol(status));
+  if (id == id_alive) return CH_ALIVE;
+  if (id == id_dead) return CH_DEAD;
+  if (id == id_down) return CH_DOWN;
+  if (id == id_default) return CH_DEFAULT;
+  rb_raise(rb_eArgError, "Bad status %"PRIsVALUE, status);
+}
+
+static CH_handle_t handle_from_value(ConsistentRing_t *wrapper, VALUE name, VALUE handle) {
+  CH_handle_t handle_i;
+  if (ConsistentHash_use_handle(wrapper->ring) != CH_USE_HANDLE) {
+    if (!NIL_P(handle))
+      rb_raise(rb_eArgError, "Ring is not created with use_handle");
+    return 0;
+  }
+  if (!NIL_P(handle))
+    return NUM2ULL(handle);
+  handle_i = ConsistentHash_Helper_parse_ipv4_with_port(RSTRING_PTR(name), RSTRING_LEN(name), 0);
+  if (handle_i == 0)
+    rb_raise(rb_eArgError, "Can't get handle from node name %"PRIsVALUE", it should be ip:port", name);
+  return handle_i;
+}
+
+static ConsistentHash_ServerList_t *staged_list(ConsistentRing_t *wrapper, int replace) {
+  if (replace && !wrapper->replacing) {
+    ConsistentHash_ServerList_free(wrapper->staged);
+    wrapper->staged = ConsistentHash_ServerList_new(wrapper->ring);
+    wrapper->replacing = 1;
+  }
+  else if (wrapper->staged == NULL) {
+    wrapper->staged = ConsistentHash_ServerList_dup(wrapper->ring);
+  }
+  return wrapper->staged;
+}
+
+static void stage_node(ConsistentRing_t *wrapper, VALUE name, VALUE weight, VALUE status, VALUE handle, int replace) {
+  CH_aliveness_e alive = status_from_value(status, CH_ALIVE);
+  uint32_t weight_i = NIL_P(weight) ? DEFAULT_WEIGHT : NUM2UINT(weight);
+  CH_handle_t handle_i;
+
+  StringValue(name);
+  handle_i = handle_from_value(wrapper, name, handle);
+  /* node which is already known keeps its description, as before */
+  if (ConsistentHash_ServerList_add(staged_list(wrapper, replace), RSTRING_PTR(name), RSTRING_LEN(name),
+                                    weight_i, alive, handle_i) == CH_HANDLE_EXISTS)
+    rb_raise(rb_eArgError, "Node %"PRIsVALUE" has same handle as another node", name);
+}
+
+static void raise_shm(CH_shm_result_e result, VALUE name) {
+  switch (result) {
+  case CH_SHM_OK:
+    return;
+  case CH_SHM_SYSTEM:
+    rb_sys_fail_str(name);
+  case CH_SHM_NOT_PUBLISHED:
+    rb_raise(rb_eArgError, "Ring %"PRIsVALUE" is not published", name);
+  case CH_SHM_BAD_LAYOUT:
+    rb_raise(rb_eRuntimeError, "Shared memory %"PRIsVALUE" does not hold valid ring of this version", name);
+  case CH_SHM_HASH_MISMATCH:
+    rb_raise(rb_eArgError, "Ring %"PRIsVALUE" is published with another item_hash", name);
+  default:
+    rb_raise(rb_eNotImpError, "Shared memory rings are not supported on this platform");
+  }
+}
+
+static void free_SharedRing(void *ptr) {
+  ConsistentHash_detach(ptr);
+}
+
+static const rb_data_type_t shared_ring_type = {
+  "ConsistentSharedRing",
+  { 0, free_SharedRing, 0, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE wrap_SharedRing(VALUE klass) {
+  return TypedData_Wrap_Struct(klass, &shared_ring_type, NULL);
+}
+
+static ConsistentHash_Shared_t *get_SharedRing(VALUE self) {
+  ConsistentHash_Shared_t *shared;
+  TypedData_Get_Struct(self, ConsistentHash_Shared_t, &shared_ring_type, shared);
+  if (shared == NULL)
+    rb_raise(rb_eRuntimeError, "ConsistentSharedRing is not attached");
+  return shared;
+}
+
+/* ConsistentSharedRing.new(name, item_hash = :murmur) */
+static VALUE method_shared_init(int argc, VALUE *argv, VALUE self) {
+  ConsistentHash_Shared_t *shared;
+  VALUE name, item_hash;
+  CH_config_t config = {0};
+
+  if (DATA_PTR(self) != NULL)
+    rb_raise(rb_eRuntimeError, "ConsistentSharedRing is already attached");
+  rb_scan_args(argc, argv, "11", &name, &item_hash);
+  config.item_hash = hash_is_md5(item_hash, 0) ? md5_item_hash : NULL;
+  config.realloc = ruby_realloc;
+  raise_shm(ConsistentHash_attach(StringValueCStr(name), config, &shared), name);
+  DATA_PTR(self) = shared;
+  return self;
+}
+
+static VALUE shared_server_result(ConsistentHash_Shared_t *shared, uint32_t server) {
+  ConsistentHash_IteratorHandle_t handle = ConsistentHash_Shared_server_handle(shared, server);
+  ConsistentHash_IteratorName_t name;
+  if (handle.found)
+    return ULL2NUM(handle.handle);
+  name = ConsistentHash_Shared_server_name(shared, server);
+  return frozen_name(name.name, name.size);
+}
+
+/* get(token) gives node or nil, get(token, n) and get(token, :all) give array as Ring#get does */
+static VALUE method_shared_get(int argc, VALUE *argv, VALUE self) {
+  ConsistentHash_Shared_t *shared = get_SharedRing(self);
+  VALUE token, cnt_r, nodes, buf;
+  uint32_t first, *servers, cnt, found, i;
+
+  rb_scan_args(argc, argv, "11", &token, &cnt_r);
+  StringValue(token);
+  if (NIL_P(cnt_r)) {
+    found = ConsistentHash_Shared_lookup(shared, RSTRING_PTR(token), RSTRING_LEN(token), &first, 1);
+    return found ? shared_server_result(shared, first) : Qnil;
+  }
+  if (cnt_r == ID2SYM(id_all))
+    cnt = ConsistentHash_Shared_servers_count(shared);
+  else
+    cnt = NUM2UINT(cnt_r);
+  servers = ALLOCV_N(uint32_t, buf, cnt); /* collected by GC if result conversion raises */
+  found = ConsistentHash_Shared_lookup(shared, RSTRING_PTR(token), RSTRING_LEN(token), servers, cnt);
+  nodes = rb_ary_new2(found);
+  for (i = 0; i < found; i++)
+    rb_ary_push(nodes, shared_server_result(shared, servers[i]));
+  ALLOCV_END(buf);
+  return nodes;
+}
+
+/* picks up newest published version, returns true if it is changed */
+static VALUE method_shared_refresh(VALUE self) {
+  ConsistentHash_Shared_t *shared = get_SharedRing(self);
+  int result = ConsistentHash_Shared_refresh(shared);
+  if (result < 0)
+    rb_sys_fail("ConsistentSharedRing#refresh");
+  return result ? Qtrue : Qfalse;
+}
+
+static VALUE method_shared_generation(VALUE self) {
+  return ULL2NUM(ConsistentHash_Shared_generation(get_SharedRing(self)));
+}
+
+static VALUE method_shared_size(VALUE self) {
+  return UINT2NUM(ConsistentHash_Shared_servers_count(get_SharedRing(self)));
+}
+
+static VALUE method_shared_detach(VALUE self) {
+  ConsistentHash_detach(DATA_PTR(self));
+  DATA_PTR(self) = NULL;
+  return Qnil;
+}
+
+static VALUE method_shared_unpublish(VALUE klass, VALUE name) {
+  CH_shm_result_e result = ConsistentHash_unpublish(StringValueCStr(name));
+  if (result == CH_SHM_NOT_PUBLISHED)
+    return Qfalse;
+  raise_shm(result, name);
+  return Qtrue;
 }
 
 void Init_consistent_ring() {
   Consistent = rb_define_class("ConsistentRing", rb_cObject);
-  wrap_Ring(Consistent);
+  id_alive = rb_intern("alive");
+  id_dead = rb_intern("dead");
+  id_down = rb_intern("down");
+  id_default = rb_intern("default");
+  id_md5 = rb_intern("md5");
+  id_murmur = rb_intern("murmur");
+  id_round_robin = rb_intern("round_robin");
+  id_least_loaded = rb_intern("least_loaded");
+  id_all = rb_intern("all");
+  id_to_a = rb_intern("to_a");
+  sym_node = ID2SYM(rb_intern("node"));
+  sym_status = ID2SYM(rb_intern("status"));
+  sym_nodes = ID2SYM(rb_intern("nodes"));
+  sym_max_ratio = ID2SYM(rb_intern("max_ratio"));
+  sym_min_ratio = ID2SYM(rb_intern("min_ratio"));
+  sym_stddev = ID2SYM(rb_intern("stddev"));
+  sym_ranges = ID2SYM(rb_intern("ranges"));
+  sym_moved = ID2SYM(rb_intern("moved"));
+  sym_moved_from = ID2SYM(rb_intern("moved_from"));
+  sym_moved_to = ID2SYM(rb_intern("moved_to"));
+  sym_lookups = ID2SYM(rb_intern("lookups"));
+  sym_probes = ID2SYM(rb_intern("probes"));
+  sym_collisions = ID2SYM(rb_intern("collisions"));
+  sym_rebuilds = ID2SYM(rb_intern("rebuilds"));
+  sym_rebuild_seconds = ID2SYM(rb_intern("rebuild_seconds"));
+  sym_last_rebuild_seconds = ID2SYM(rb_intern("last_rebuild_seconds"));
+  sym_points_generated = ID2SYM(rb_intern("points_generated"));
+  sym_points_reused = ID2SYM(rb_intern("points_reused"));
+  sym_memsize = ID2SYM(rb_intern("memsize"));
+  sym_points = ID2SYM(rb_intern("points"));
+  sym_points_budget = ID2SYM(rb_intern("points_budget"));
+  sym_points_scale = ID2SYM(rb_intern("points_scale"));
+  sym_min_points = ID2SYM(rb_intern("min_points"));
+  sym_max_points = ID2SYM(rb_intern("max_points"));
+  sym_max_weight_error = ID2SYM(rb_intern("max_weight_error"));
 
   rb_define_alloc_func(Consistent, wrap_Ring);
-  // rb_define_method(Consistent, "initialize", method_init, 0);
+
+  PointCache = rb_define_class("ConsistentPointCache", rb_cObject);
+  rb_define_alloc_func(PointCache, wrap_PointCache);
+  rb_define_method(PointCache, "size", method_point_cache_size, 0);
+  rb_define_method(PointCache, "memsize", method_point_cache_memsize, 0);
+
+  SharedRing = rb_define_class("ConsistentSharedRing", rb_cObject);
+  rb_define_alloc_func(SharedRing, wrap_SharedRing);
+  rb_define_singleton_method(SharedRing, "unpublish", method_shared_unpublish, 1);
+  rb_define_method(SharedRing, "initialize", method_shared_init, -1);
+  rb_define_method(SharedRing, "get", method_shared_get, -1);
+  rb_define_method(SharedRing, "refresh", method_shared_refresh, 0);
+  rb_define_method(SharedRing, "generation", method_shared_generation, 0);
+  rb_define_method(SharedRing, "size", method_shared_size, 0);
+  rb_define_method(SharedRing, "detach", method_shared_detach, 0);
+
+  rb_define_method(Consistent, "initialize", method_init, -1);
+  rb_define_method(Consistent, "use_handle?", method_use_handle, 0);
+  rb_define_method(Consistent, "memsize", method_memsize, 0);
   rb_define_method(Consistent, "get", method_get, 3);
-  rb_define_method(Consistent, "add", method_add, 1);
-  rb_define_method(Consistent, "update", method_update, 1);
-  // rb_define_method(Consistent, "replace", method_replace, 1);
+  rb_define_method(Consistent, "get_first", method_get_first, 1);
+  rb_define_method(Consistent, "get_with_previous", method_get_with_previous, 1);
+  rb_define_method(Consistent, "epoch", method_epoch, 0);
+  rb_define_method(Consistent, "retire_previous", method_retire_previous, 0);
+  rb_define_method(Consistent, "add_node", method_add_node, -1);
+  rb_define_method(Consistent, "replace_node", method_replace_node, -1);
+  rb_define_method(Consistent, "update_node", method_update_node, -1);
+  rb_define_method(Consistent, "update_nodes", method_update_nodes, 1);
+  rb_define_method(Consistent, "load_chunk", method_load_chunk, 1);
+  rb_define_method(Consistent, "pending?", method_is_pending, 0);
+  rb_define_method(Consistent, "refresh", method_refresh, 0);
+  rb_define_method(Consistent, "ownership", method_ownership, 0);
+  rb_define_method(Consistent, "diff", method_diff, 1);
+  rb_define_method(Consistent, "key_hash", method_key_hash, 1);
+  rb_define_method(Consistent, "collect_stats", method_collect_stats, 1);
+  rb_define_method(Consistent, "stats", method_stats, 0);
+  rb_define_method(Consistent, "points_budget", method_points_budget, 2);
+  rb_define_method(Consistent, "track_hot_keys", method_track_hot_keys, 1);
+  rb_define_method(Consistent, "hot_keys", method_hot_keys, 1);
+  rb_define_method(Consistent, "reset_hot_keys", method_reset_hot_keys, 0);
+  rb_define_method(Consistent, "mark_hot", method_mark_hot, 3);
+  rb_define_method(Consistent, "report_load", method_report_load, 2);
+  rb_define_method(Consistent, "rebalance", method_rebalance, 2);
+  rb_define_method(Consistent, "reset_balance", method_reset_balance, 0);
+  rb_define_method(Consistent, "ramp", method_ramp, 3);
+  rb_define_method(Consistent, "ramp_step", method_ramp_step, 0);
+  rb_define_method(Consistent, "fail_node", method_fail_node, 1);
+  rb_define_method(Consistent, "rebuild_pending?", method_is_rebuild_pending, 0);
+  rb_define_method(Consistent, "rebuild", method_rebuild, 0);
+  rb_define_method(Consistent, "publish", method_publish, 1);
+}
+
+/* ConsistentRing.new(points_per_server = 500, points_hash = :md5, item_hash = :murmur, use_handle = false,
+ *                    ramp_steps = 0, keep_previous = false, failover = false, point_cache = nil) */
+VALUE method_init(int argc, VALUE *argv, VALUE self) {
+  ConsistentRing_t *wrapper;
+  VALUE points, points_hash, item_hash, use_handle, ramp_steps, keep_previous, failover, point_cache;
+  CH_config_t config = {0};
+
+  TypedData_Get_Struct(self, ConsistentRing_t, &ring_type, wrapper);
+  if (wrapper->ring != NULL)
+    rb_raise(rb_eRuntimeError, "ConsistentRing is already initialized");
+
+  rb_scan_args(argc, argv, "08", &points, &points_hash, &item_hash, &use_handle, &ramp_steps,
+               &keep_previous, &failover, &point_cache);
+  config.points_per_server = NIL_P(points) ? DEFAULT_POINTS : NUM2UINT(points);
+  if (config.points_per_server == 0)
+    rb_raise(rb_eArgError, "points_per_server should be positive");
+  /* NULL hashes are set to murmur by consistent.h */
+  config.points_hash = hash_is_md5(points_hash, 1) ? md5_points_hash : NULL;
+  config.item_hash = hash_is_md5(item_hash, 0) ? md5_item_hash : NULL;
+  config.use_handle = RTEST(use_handle) ? CH_USE_HANDLE : CH_DONOT_USE_HANDLE;
+  config.ramp_steps = NIL_P(ramp_steps) ? 0 : NUM2UINT(ramp_steps);
+  config.keep_previous = RTEST(keep_previous);
+  config.failover_tables = RTEST(failover);
+  /* ring takes its own reference */
+  config.point_cache = NIL_P(point_cache) ? NULL : get_PointCache(point_cache);
+  config.realloc = ruby_realloc;
+
+  wrapper->config = config;
+  wrapper->ring = ConsistentHash_new(config);
+  return self;
+}
+
+VALUE method_memsize(VALUE self) {
+  return SIZET2NUM(size_Ring(get_Wrapper(self)));
+}
+
+VALUE method_use_handle(VALUE self) {
+  return ConsistentHash_use_handle(get_Ring(self)) == CH_USE_HANDLE ? Qtrue : Qfalse;
 }
 
 VALUE method_get(VALUE self, VALUE token_r, VALUE cnt_r, VALUE all_r) {
-  ConsistentHash_t *ring;
-  ring = get_Ring(self);
-  char *token = RSTRING_PTR(token_r);
-  int token_len = RSTRING_LEN(token_r);
-  int i;
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  ConsistentHash_Iterator_t iter = ConsistentHash_Iterator_init_value(wrapper->ring);
+  long cnt = NIL_P(all_r) ? NUM2LONG(cnt_r) : -1;
+  long i;
   VALUE nodes = rb_ary_new();
-  ConsistentHash_Iterator_t *iter = ConsistentHash_Iterator_new(ring, token, token_len);
-  if(all_r == Qnil){
-    int cnt = NUM2INT(cnt_r);
-    for(i = 0; i < cnt; i++) {
-      ConsistentHash_IteratorName_t res = ConsistentHash_Iterator_next_name(iter);
-      if(res.name != NULL) {
-        rb_ary_push(nodes, rb_str_new2(res.name));
-      } else {
-        break;
-      }
+
+  StringValue(token_r);
+  ConsistentHash_Iterator_init(&iter, RSTRING_PTR(token_r), RSTRING_LEN(token_r));
+  for(i = 0; cnt < 0 || i < cnt; i++) {
+    uint32_t server = ConsistentHash_Iterator_next_index(&iter);
+    if(server == CH_NO_SERVER)
+      break;
+    rb_ary_push(nodes, server_result(wrapper, server));
+  }
+  ConsistentHash_Iterator_release(&iter);
+
+  return nodes;
+}
+
+VALUE method_get_first(VALUE self, VALUE token_r) {
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  uint32_t server;
+
+  StringValue(token_r);
+  /* hot keys are spread among replicas */
+  server = ConsistentHash_lookup_first(wrapper->ring, RSTRING_PTR(token_r), RSTRING_LEN(token_r));
+
+  return server == CH_NO_SERVER ? Qnil : server_result(wrapper, server);
+}
+
+/* [owner, previous owner or nil if it is the same] */
+VALUE method_get_with_previous(VALUE self, VALUE token_r) {
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  ConsistentHash_t *previous = ConsistentHash_previous(wrapper->ring);
+  uint32_t server, old;
+  VALUE old_r = Qnil;
+
+  StringValue(token_r);
+  server = ConsistentHash_lookup_migrating(wrapper->ring, RSTRING_PTR(token_r), RSTRING_LEN(token_r), &old);
+  if (old != CH_NO_SERVER) {
+    /* previous generation has its own indexes, names are not cached for it */
+    if (ConsistentHash_use_handle(previous) == CH_USE_HANDLE) {
+      old_r = ULL2NUM(ConsistentHash_server_handle(previous, old).handle);
+    } else {
+      ConsistentHash_IteratorName_t name = ConsistentHash_server_name(previous, old);
+      old_r = frozen_name(name.name, name.size);
     }
-  }else{
-    for(i = 0; ; i++) {
-      ConsistentHash_IteratorName_t res = ConsistentHash_Iterator_next_name(iter);
-      if(res.name != NULL) {
-        rb_ary_push(nodes, rb_str_new2(res.name));
-      } else {
-        break;
-      }
+  }
+  return rb_assoc_new(server == CH_NO_SERVER ? Qnil : server_result(wrapper, server), old_r);
+}
+
+VALUE method_epoch(VALUE self) {
+  return ULL2NUM(ConsistentHash_epoch(get_Ring(self)));
+}
+
+VALUE method_retire_previous(VALUE self) {
+  ConsistentHash_t *ring = get_Ring(self);
+  VALUE had = ConsistentHash_previous(ring) ? Qtrue : Qfalse;
+  ConsistentHash_retire_previous(ring);
+  return had;
+}
+
+VALUE method_add_node(int argc, VALUE *argv, VALUE self) {
+  VALUE name, weight, status, handle;
+  rb_scan_args(argc, argv, "13", &name, &weight, &status, &handle);
+  stage_node(get_Wrapper(self), name, weight, status, handle, 0);
+  return Qnil;
+}
+
+VALUE method_replace_node(int argc, VALUE *argv, VALUE self) {
+  VALUE name, weight, status, handle;
+  rb_scan_args(argc, argv, "13", &name, &weight, &status, &handle);
+  stage_node(get_Wrapper(self), name, weight, status, handle, 1);
+  return Qnil;
+}
+
+VALUE method_update_node(int argc, VALUE *argv, VALUE self) {
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  VALUE name, status;
+  CH_aliveness_e alive;
+
+  rb_scan_args(argc, argv, "11", &name, &status);
+  StringValue(name);
+  alive = status_from_value(status, CH_DEFAULT);
+  if (wrapper->updates == NULL)
+    wrapper->updates = ConsistentHash_AliveByName_new(wrapper->ring);
+  ConsistentHash_AliveByName_add(wrapper->updates, RSTRING_PTR(name), RSTRING_LEN(name), alive);
+  return Qnil;
+}
+
+/* update! of Array of { node:, status: } hashes.
+ * without pending changes names are passed to ring as is and continuum is rebuilt
+ * only if some node became dead or alive again, returns whether it was rebuilt */
+VALUE method_update_nodes(VALUE self, VALUE nodes) {
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  CH_NameStatus_t *statuses;
+  VALUE buf, keep = Qnil;
+  long i, count;
+  int rebuilt;
+
+  Check_Type(nodes, T_ARRAY);
+  if (wrapper->staged || wrapper->updates) {
+    for(i = 0; i < RARRAY_LEN(nodes); i++) {
+      VALUE node = rb_check_hash_type(RARRAY_AREF(nodes, i));
+      if (NIL_P(node))
+        rb_raise(rb_eRuntimeError, "Not valid node");
+      method_update_node(2, (VALUE[]){ rb_hash_aref(node, sym_node), rb_hash_aref(node, sym_status) }, self);
     }
+    return method_refresh(self);
   }
-  ConsistentHash_Iterator_free(iter);
 
-  return nodes;
+  count = RARRAY_LEN(nodes);
+  statuses = ALLOCV_N(CH_NameStatus_t, buf, count);
+  /* everything is checked before ring is touched */
+  for(i = 0; i < count; i++) {
+    VALUE node = rb_check_hash_type(RARRAY_AREF(nodes, i));
+    VALUE name;
+    if (NIL_P(node))
+      rb_raise(rb_eRuntimeError, "Not valid node");
+    name = rb_hash_aref(node, sym_node);
+    if (NIL_P(name))
+      rb_raise(rb_eRuntimeError, "You should declare node name");
+    if (!RB_TYPE_P(name, T_STRING)) {
+      /* converted names should live until ring is updated */
+      if (NIL_P(keep))
+        keep = rb_ary_new();
+      name = rb_str_to_str(name);
+      rb_ary_push(keep, name);
+    }
+    statuses[i].name = RSTRING_PTR(name);
+    statuses[i].name_len = RSTRING_LEN(name);
+    statuses[i].alive = status_from_value(rb_hash_aref(node, sym_status), CH_DEFAULT);
+  }
+  rebuilt = ConsistentHash_update_by_name(wrapper->ring, statuses, count, NULL);
+  ALLOCV_END(buf);
+  RB_GC_GUARD(nodes);
+  RB_GC_GUARD(keep);
+  return rebuilt ? Qtrue : Qfalse;
 }
 
-VALUE method_add(VALUE self, VALUE items) {
-  ConsistentHash_t *ring;
-  ring = get_Ring(self);
-  ConsistentHash_ServerList_t *list = ConsistentHash_ServerList_new(ring);
-  long items_size = RARRAY_LEN(items);
-  VALUE node_str = rb_str_new2("node");
-  VALUE weight_str = rb_str_new2("weight");
-  VALUE status_str = rb_str_new2("status");
-  int i;
-
-  for(i = 0; i < items_size; i++){
-    VALUE item = rb_ary_entry(items, i);
-    VALUE node = rb_hash_aref(item, node_str);
-    char *name = RSTRING_PTR(node);
-    size_t name_len = RSTRING_LEN(node);
-    uint32_t weight = NUM2INT(rb_hash_aref(item, weight_str));
-    uint32_t alive = NUM2INT(rb_hash_aref(item, status_str));
-    ConsistentHash_ServerList_add(list, name, name_len, weight, alive, 0);
-  }
-  ConsistentHash_exchange_server_list(ring, list);
-  ConsistentHash_ServerList_free(list);
+/* stages replacement of nodes by text chunk, nil finishes the text */
+VALUE method_load_chunk(VALUE self, VALUE chunk) {
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  ConsistentHash_ServerList_t *list = staged_list(wrapper, 1);
+  uint32_t bad_line;
+
+  if (NIL_P(chunk)) {
+    bad_line = ConsistentHash_ServerList_load(list, NULL, 0);
+  } else {
+    StringValue(chunk);
+    if (RSTRING_LEN(chunk) == 0)
+      return Qnil;
+    bad_line = ConsistentHash_ServerList_load(list, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+  }
+  if (bad_line) {
+    /* half loaded list should not be applied */
+    release_staged(wrapper);
+    rb_raise(rb_eArgError, "Bad node description at line %u", bad_line);
+  }
   return Qnil;
 }
 
+VALUE method_is_pending(VALUE self) {
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  return (wrapper->staged || wrapper->updates) ? Qtrue : Qfalse;
+}
+
+/* applies every staged change with one continuum rebuild */
+VALUE method_refresh(VALUE self) {
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  int exchanged = wrapper->staged != NULL;
+
+  if (!exchanged && wrapper->updates == NULL)
+    return Qfalse;
+
+  ConsistentHash_apply(wrapper->ring, wrapper->staged, wrapper->updates);
+  release_staged(wrapper);
+  if (exchanged)
+    refresh_names(wrapper);
+  return Qtrue;
+}
+
+VALUE method_ownership(VALUE self) {
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  ConsistentHash_t *ring = wrapper->ring;
+  uint32_t count = ConsistentHash_servers_count(ring);
+  double *fractions = ALLOC_N(double, count + 1);
+  CH_OwnershipStats_t stats = ConsistentHash_ownership(ring, fractions);
+  VALUE nodes = rb_hash_new();
+  VALUE result = rb_hash_new();
+  uint32_t i;
+
+  for(i = 0; i < count; i++)
+    rb_hash_aset(nodes, cached_name(wrapper, i), rb_float_new(fractions[i]));
+  xfree(fractions);
+
+  rb_hash_aset(result, sym_nodes, nodes);
+  rb_hash_aset(result, sym_max_ratio, rb_float_new(stats.max_ratio));
+  rb_hash_aset(result, sym_min_ratio, rb_float_new(stats.min_ratio));
+  rb_hash_aset(result, sym_stddev, rb_float_new(stats.stddev));
+  return result;
+}
+
+VALUE method_diff(VALUE self, VALUE other) {
+  ConsistentRing_t *old_wrapper = get_Wrapper(self);
+  ConsistentRing_t *new_wrapper = get_Wrapper(other);
+  ConsistentHash_t *old_ring = old_wrapper->ring;
+  ConsistentHash_t *new_ring = new_wrapper->ring;
+  ConsistentHash_Diff_t *diff;
+  const CH_RangeMove_t *moves;
+  uint32_t count;
+  VALUE ranges, moved_from, moved_to, result;
+  uint32_t i;
+
+  /* key positions are comparable only with same item hash */
+  if (old_wrapper->config.item_hash != new_wrapper->config.item_hash)
+    rb_raise(rb_eArgError, "Rings use different item_hash");
+
+  diff = ConsistentHash_diff(old_ring, new_ring);
+  moves = ConsistentHash_Diff_ranges(diff);
+  count = ConsistentHash_Diff_count(diff);
+  ranges = rb_ary_new2(count);
+  moved_from = rb_hash_new();
+  moved_to = rb_hash_new();
+  result = rb_hash_new();
+
+  for(i = 0; i < count; i++) {
+    rb_ary_push(ranges, rb_ary_new3(4, UINT2NUM(moves[i].start), UINT2NUM(moves[i].end),
+                                    cached_name(old_wrapper, moves[i].old_server),
+                                    cached_name(new_wrapper, moves[i].new_server)));
+  }
+  for(i = 0; i < ConsistentHash_servers_count(old_ring); i++) {
+    double moved = ConsistentHash_Diff_moved_from(diff, i);
+    if (moved > 0)
+      rb_hash_aset(moved_from, cached_name(old_wrapper, i), rb_float_new(moved));
+  }
+  for(i = 0; i < ConsistentHash_servers_count(new_ring); i++) {
+    double moved = ConsistentHash_Diff_moved_to(diff, i);
+    if (moved > 0)
+      rb_hash_aset(moved_to, cached_name(new_wrapper, i), rb_float_new(moved));
+  }
 
-VALUE method_update(VALUE self, VALUE items) {
+  rb_hash_aset(result, sym_ranges, ranges);
+  rb_hash_aset(result, sym_moved, rb_float_new(ConsistentHash_Diff_moved(diff)));
+  rb_hash_aset(result, sym_moved_from, moved_from);
+  rb_hash_aset(result, sym_moved_to, moved_to);
+  ConsistentHash_Diff_free(diff);
+  return result;
+}
+
+VALUE method_key_hash(VALUE self, VALUE key) {
+  ConsistentHash_t *ring = get_Ring(self);
+  StringValue(key);
+  return UINT2NUM(ConsistentHash_key_hash(ring, RSTRING_PTR(key), RSTRING_LEN(key)));
+}
+
+VALUE method_collect_stats(VALUE self, VALUE enable) {
+  ConsistentHash_collect_stats(get_Ring(self), RTEST(enable));
+  return enable;
+}
+
+VALUE method_stats(VALUE self) {
+  ConsistentHash_t *ring = get_Ring(self);
+  CH_stats_t stats;
+  CH_PointsStats_t points = ConsistentHash_points_stats(ring);
+  VALUE result = rb_hash_new();
+
+  ConsistentHash_stats(ring, &stats);
+  rb_hash_aset(result, sym_lookups, ULL2NUM(stats.lookups));
+  rb_hash_aset(result, sym_probes, ULL2NUM(stats.probes));
+  rb_hash_aset(result, sym_collisions, ULL2NUM(stats.collisions));
+  rb_hash_aset(result, sym_rebuilds, ULL2NUM(stats.rebuilds));
+  rb_hash_aset(result, sym_rebuild_seconds, rb_float_new(stats.rebuild_ns / 1e9));
+  rb_hash_aset(result, sym_last_rebuild_seconds, rb_float_new(stats.last_rebuild_ns / 1e9));
+  rb_hash_aset(result, sym_points_generated, ULL2NUM(stats.points_generated));
+  rb_hash_aset(result, sym_points_reused, ULL2NUM(stats.points_reused));
+  rb_hash_aset(result, sym_memsize, SIZET2NUM(ConsistentHash_size(ring)));
+  rb_hash_aset(result, sym_points, UINT2NUM(points.points));
+  rb_hash_aset(result, sym_points_budget, points.budget ? UINT2NUM(points.budget) : Qnil);
+  rb_hash_aset(result, sym_points_scale, rb_float_new(points.scale));
+  rb_hash_aset(result, sym_min_points, UINT2NUM(points.min_points));
+  rb_hash_aset(result, sym_max_points, UINT2NUM(points.max_points));
+  rb_hash_aset(result, sym_max_weight_error, rb_float_new(points.max_weight_error));
+  return result;
+}
+
+/* applied by next rebuild */
+VALUE method_points_budget(VALUE self, VALUE max_total_points, VALUE min_points) {
+  ConsistentHash_points_budget(get_Ring(self), NIL_P(max_total_points) ? 0 : NUM2UINT(max_total_points),
+                               NIL_P(min_points) ? 0 : NUM2UINT(min_points));
+  return Qnil;
+}
+
+VALUE method_track_hot_keys(VALUE self, VALUE sample_rate) {
+  ConsistentHash_track_hot_keys(get_Ring(self), NIL_P(sample_rate) ? 0 : NUM2UINT(sample_rate));
+  return sample_rate;
+}
+
+/* [[key hash, estimated lookups, primary node], ...] heaviest first */
+VALUE method_hot_keys(VALUE self, VALUE n) {
+  ConsistentRing_t *wrapper = get_Wrapper(self);
+  uint32_t count = NUM2UINT(n);
+  CH_HotKey_t *keys;
+  VALUE result, buf;
+  uint32_t i;
+
+  if (count > CH_HOT_KEYS_MAX)
+    count = CH_HOT_KEYS_MAX;
+  keys = ALLOCV_N(CH_HotKey_t, buf, count); /* collected by GC if result conversion raises */
+  count = ConsistentHash_hot_keys(wrapper->ring, keys, count);
+  result = rb_ary_new2(count);
+  for(i = 0; i < count; i++) {
+    rb_ary_push(result, rb_ary_new3(3, UINT2NUM(keys[i].hash), ULL2NUM(keys[i].count),
+                                    keys[i].server == CH_NO_SERVER ? Qnil : server_result(wrapper, keys[i].server)));
+  }
+  ALLOCV_END(buf);
+  return result;
+}
+
+VALUE method_reset_hot_keys(VALUE self) {
+  ConsistentHash_hot_keys_reset(get_Ring(self));
+  return Qnil;
+}
+
+/* key is String or its key hash, returns false if table of hot keys is full */
+VALUE method_mark_hot(VALUE self, VALUE key, VALUE spread, VALUE mode) {
+  ConsistentHash_t *ring = get_Ring(self);
+  CH_spread_e mode_e = CH_SPREAD_ROUND_ROBIN;
+  uint32_t hash;
+
+  if (!NIL_P(mode)) {
+    ID id = SYM2ID(rb_to_symbol(mode));
+    if (id == id_least_loaded)
+      mode_e = CH_SPREAD_LEAST_LOADED;
+    else if (id != id_round_robin)
+      rb_raise(rb_eArgError, "Bad mode %"PRIsVALUE", should be :round_robin or :least_loaded", mode);
+  }
+  if (RB_INTEGER_TYPE_P(key)) {
+    hash = NUM2UINT(key);
+  } else {
+    StringValue(key);
+    hash = ConsistentHash_key_hash(ring, RSTRING_PTR(key), RSTRING_LEN(key));
+  }
+  return ConsistentHash_mark_hot(ring, hash, NUM2UINT(spread), mode_e) ? Qtrue : Qfalse;
+}
+
+/* node is its name, or handle for ring using handle */
+static uint32_t server_index_of(ConsistentHash_t *ring, VALUE node) {
+  if (RB_INTEGER_TYPE_P(node) && ConsistentHash_use_handle(ring) == CH_USE_HANDLE)
+    return ConsistentHash_server_index_by_handle(ring, NUM2ULL(node));
+  StringValue(node);
+  return ConsistentHash_server_index(ring, RSTRING_PTR(node), RSTRING_LEN(node));
+}
+
+VALUE method_report_load(VALUE self, VALUE node, VALUE load) {
   ConsistentHash_t *ring = get_Ring(self);
-  ConsistentHash_AliveByName_t *list = ConsistentHash_AliveByName_new(ring);
+  uint32_t server = server_index_of(ring, node);
 
-  long items_size = RARRAY_LEN(items);
-  VALUE node_str = rb_str_new2("node");
-  VALUE status_str = rb_str_new2("status");
-  int  i;
+  if (server == CH_NO_SERVER)
+    return Qfalse;
+  ConsistentHash_report_load(ring, server, NUM2UINT(load));
+  return Qtrue;
+}
 
-  for(i = 0; i < items_size; i++){
-    VALUE item = rb_ary_entry(items, i);
-    VALUE node = rb_hash_aref(item, node_str);
-    char *name = RSTRING_PTR(node);
-    size_t name_len = RSTRING_LEN(node);
-    VALUE alive = NUM2INT(rb_hash_aref(item, status_str));
+/* loads is Hash of node => measured load, nodes not in it keep their points */
+VALUE method_rebalance(VALUE self, VALUE loads, VALUE max_movement) {
+  ConsistentHash_t *ring = get_Ring(self);
+  uint32_t count = ConsistentHash_servers_count(ring);
+  VALUE buf, pairs, pair;
+  double *values = ALLOCV_N(double, buf, count + 1); /* collected by GC if conversion raises */
+  double moved;
+  long i;
 
-    ConsistentHash_AliveByName_add(list, name, name_len, alive);
+  for (i = 0; i < count; i++)
+    values[i] = -1;
+  pairs = rb_funcall(rb_convert_type(loads, T_HASH, "Hash", "to_hash"), id_to_a, 0);
+  for (i = 0; i < RARRAY_LEN(pairs); i++) {
+    uint32_t server;
+    pair = RARRAY_AREF(pairs, i);
+    server = server_index_of(ring, RARRAY_AREF(pair, 0));
+    if (server != CH_NO_SERVER)
+      values[server] = NUM2DBL(RARRAY_AREF(pair, 1));
   }
-  CH_aliveness_e default_alive = CH_DEFAULT;
-  ConsistentHash_refresh_alive_by_name(ring, list, default_alive);
-  ConsistentHash_AliveByName_free(list);
+  moved = ConsistentHash_rebalance(ring, values, NUM2DBL(max_movement));
+  ALLOCV_END(buf);
+  return rb_float_new(moved);
+}
+
+VALUE method_reset_balance(VALUE self) {
+  ConsistentHash_reset_adjust(get_Ring(self));
+  return Qnil;
+}
+
+/* to is target fraction of node's weight, returns false for unknown node */
+VALUE method_ramp(VALUE self, VALUE node, VALUE to, VALUE steps) {
+  ConsistentHash_t *ring = get_Ring(self);
+  uint32_t server = server_index_of(ring, node);
+
+  if (server == CH_NO_SERVER)
+    return Qfalse;
+  ConsistentHash_ramp(ring, server, NUM2DBL(to), NUM2UINT(steps));
+  return Qtrue;
+}
+
+VALUE method_ramp_step(VALUE self) {
+  return UINT2NUM(ConsistentHash_ramp_step(get_Ring(self)));
+}
+
+/* true if failure is patched without rebuild, false if ring is rebuilt, nil for unknown node */
+VALUE method_fail_node(VALUE self, VALUE node) {
+  ConsistentHash_t *ring = get_Ring(self);
+  uint32_t server = server_index_of(ring, node);
+
+  if (server == CH_NO_SERVER)
+    return Qnil;
+  return ConsistentHash_fail_server(ring, server) == 1 ? Qtrue : Qfalse;
+}
+
+VALUE method_is_rebuild_pending(VALUE self) {
+  return ConsistentHash_rebuild_pending(get_Ring(self)) ? Qtrue : Qfalse;
+}
+
+VALUE method_rebuild(VALUE self) {
+  ConsistentHash_rebuild(get_Ring(self));
   return Qnil;
 }
+
+/* publishes current layout (pending changes are not applied) for ConsistentSharedRing readers */
+VALUE method_publish(VALUE self, VALUE name) {
+  raise_shm(ConsistentHash_publish(get_Ring(self), StringValueCStr(name)), name);
+  return self;
+}
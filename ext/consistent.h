@@ -29,10 +29,42 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if !defined(CONSISTENT_NO_SHM) && (defined(__unix__) || defined(__APPLE__))
+#define CH_HAVE_SHM 1
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if !defined(CONSISTENT_NO_NUMA) && defined(__linux__)
+#include <unistd.h>
+/* syscall() and MAP_ANONYMOUS are hidden by strict _POSIX_C_SOURCE */
+#if defined(_GNU_SOURCE) || defined(_DEFAULT_SOURCE) || defined(_BSD_SOURCE)
+#define CH_HAVE_NUMA 1
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
 #endif
 
 #ifndef CONSISTENT_INTERFACE
 #define CONSISTENT_INTERFACE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef uint64_t CH_handle_t;
 typedef int (*CH_key_eq_t)(void *ctx, CH_handle_t key_a, CH_handle_t key_b);
@@ -44,12 +76,36 @@ typedef void (*CH_points_hash_t)(void *ctx, const char *server, size_t server_le
  * Murmur3_32 is used by default, so that, there no big need to change it */
 typedef uint32_t (*CH_item_hash_t)(void *ctx, const char *item, size_t item_len, uint32_t seed);
 
+typedef struct ConsistentHash ConsistentHash_t;
+
+/* information about continuum rebuild passed to on_rebuild callback */
+typedef struct CH_rebuild_info {
+    uint64_t duration_ns;
+    uint32_t points;            /* points in continuum */
+    uint32_t alive;             /* alive servers */
+    uint32_t points_generated;  /* points hashed during this rebuild */
+    uint32_t points_reused;     /* points taken from already generated ones */
+} CH_RebuildInfo_t;
+typedef void (*CH_on_rebuild_t)(void *ctx, ConsistentHash_t *ring, const CH_RebuildInfo_t *info);
+
 typedef enum CH_use_handle {
     CH_DEFAULT_IS_USE_HANDLE = 0,
     CH_DONOT_USE_HANDLE = 1,
     CH_USE_HANDLE = 2
 } CH_use_handle_e;
 
+/**
+ * point cache shares generated points of servers with same name among rings using same points_hash,
+ * so that rings over overlapping server lists hash and store them once. every ring keeps own continuum.
+ * cache is reference counted: ring holds a reference while alive, so that caller could drop its one
+ * with ConsistentHash_PointCache_free at any time.
+ * it is not thread safe: rings sharing cache should not be rebuilt concurrently.
+ */
+typedef struct CH_point_cache ConsistentHash_PointCache_t;
+/* node is NUMA node memory should be placed on, or -1. huge asks for 2MB pages, size is rounded for them */
+typedef void *(*CH_page_alloc_t)(void *ctx, size_t size, int node, int huge);
+typedef void (*CH_page_free_t)(void *ctx, void *ptr, size_t size);
+
 typedef struct CH_config {
     void       *ctx; /* fill free to set it as NULL %), but functions should accept it */
     void     *(*realloc)(void *ctx, void *old, size_t new_size); /* will be setup to plain realloc if NULL */
@@ -61,6 +117,28 @@ typedef struct CH_config {
     CH_item_hash_t   item_hash;                                  /* will be setup to Murmur3_32 if NULL */
     uint32_t    points_per_server;
     CH_use_handle_e use_handle;                                  /* use handle or not */
+    CH_on_rebuild_t  on_rebuild;                                 /* called after every continuum rebuild, if set */
+    int         collect_stats;                                   /* count lookups and rebuilds, see ConsistentHash_stats */
+    uint32_t    hot_keys_sample_rate;                            /* track hot keys sampling 1 of N lookups, 0 - don't */
+    uint32_t    ramp_steps;                                      /* servers added to non empty ring ramp up in N steps
+                                                                    (while some alive server is kept),
+                                                                    see ConsistentHash_ramp_step, 0 - at once */
+    int         keep_previous;                                   /* keep layout replaced by last server list exchange,
+                                                                    see ConsistentHash_lookup_migrating */
+    int         failover_tables;                                 /* precompute continuum patch for failure of every
+                                                                    server, see ConsistentHash_fail_server */
+    ConsistentHash_PointCache_t *point_cache;                    /* take points of servers from shared cache, if set */
+    uint32_t    max_total_points;                                /* scale points of all servers down to fit continuum
+                                                                    into it, 0 - no limit. see ConsistentHash_points_stats */
+    uint32_t    min_points_per_server;                           /* scaled server keeps at least that much (1 if 0),
+                                                                    rest is scaled into what is left of the budget.
+                                                                    lowered to budget / servers if minimums do not fit,
+                                                                    continuum exceeds budget only with more servers */
+    int         numa_replicas;                                   /* keep read only copy of sorted continuum and its
+                                                                    index per NUMA node, see ConsistentHash_replicas */
+    int         huge_pages;                                      /* put continuum copies on 2MB pages */
+    CH_page_alloc_t  page_alloc;                                 /* memory of continuum copies, mmap+mbind if NULL */
+    CH_page_free_t   page_free;
 } CH_config_t;
 
 /**
@@ -76,13 +154,30 @@ typedef enum CH_aliveness {
     CH_DEFAULT = 1 << 30
 } CH_aliveness_e;
 
-typedef struct ConsistentHash ConsistentHash_t;
-
 ConsistentHash_t *ConsistentHash_new(CH_config_t config);
 void ConsistentHash_free(ConsistentHash_t *ring);
 
+/* only allocation functions of config are used by cache */
+ConsistentHash_PointCache_t *ConsistentHash_PointCache_new(CH_config_t config);
+/* drops caller's reference */
+void ConsistentHash_PointCache_free(ConsistentHash_PointCache_t *cache);
+size_t ConsistentHash_PointCache_size(ConsistentHash_PointCache_t *cache);
+/* number of servers which points are cached */
+uint32_t ConsistentHash_PointCache_count(ConsistentHash_PointCache_t *cache);
+
 size_t ConsistentHash_size(ConsistentHash_t *ring);
 
+/**
+ * number of continuum copies lookups read, 0 if they read continuum itself.
+ * with config.numa_replicas every rebuild copies sorted points and FASTHASH index
+ * into one replica per NUMA node (allocated on that node), and lookup reads replica
+ * of the node its thread runs on (node is rechecked every CH_NUMA_RECHECK lookups of a thread).
+ * with config.huge_pages alone there is single replica on huge pages.
+ * replicas double continuum memory at least, so that they pay off only for
+ * multi threaded lookups on multi socket hosts.
+ */
+uint32_t ConsistentHash_replicas(ConsistentHash_t *ring);
+
 /**
  * number of alive servers
  */
@@ -96,6 +191,61 @@ CH_use_handle_e ConsistentHash_use_handle(ConsistentHash_t *ring);
  */
 void ConsistentHash_clean(ConsistentHash_t *ring);
 
+/**
+ * counters are collected only when config.collect_stats is set (or enabled later).
+ * they are updated with relaxed atomics, so that, lookups from many threads stay cheap,
+ * but snapshot is not guaranteed to be consistent between fields.
+ */
+typedef struct CH_stats {
+    uint64_t lookups;           /* initialized iterators */
+    uint64_t probes;            /* item hash computations while looking for server */
+    uint64_t collisions;        /* probes which hit already visited server */
+    uint64_t rebuilds;
+    uint64_t rebuild_ns;        /* total time spent in rebuilds */
+    uint64_t last_rebuild_ns;
+    uint64_t points_generated;
+    uint64_t points_reused;
+} CH_stats_t;
+void ConsistentHash_collect_stats(ConsistentHash_t *ring, int enable);
+void ConsistentHash_stats(ConsistentHash_t *ring, CH_stats_t *stats);
+void ConsistentHash_stats_reset(ConsistentHash_t *ring);
+
+/**
+ * continuum size and how well points follow weights of servers, as of last rebuild.
+ * share of server is its points / all points, expected share is computed from weight
+ * (scaled by rebalance and ramp), so that weight error shows what budget and rounding cost.
+ * see ConsistentHash_ownership for resulting share of keys.
+ */
+typedef struct CH_points_stats {
+    uint32_t points;            /* points in continuum */
+    uint32_t budget;            /* config.max_total_points */
+    double   scale;             /* points of servers relative to unlimited ones, 1 if budget is not hit,
+                                   0 if every server is kept at (lowered) minimum */
+    uint32_t min_points;        /* least points of server which has them */
+    uint32_t max_points;
+    double   max_weight_error;  /* max |share / expected share - 1| */
+} CH_PointsStats_t;
+CH_PointsStats_t ConsistentHash_points_stats(ConsistentHash_t *ring);
+/* changes config.max_total_points and config.min_points_per_server, applied by next rebuild */
+void ConsistentHash_points_budget(ConsistentHash_t *ring, uint32_t max_total_points, uint32_t min_points_per_server);
+
+/**
+ * hot keys are tracked by count-min sketch with small table of heaviest candidates.
+ * 1 of sample_rate lookups (counted per thread) feeds it with key hash computed
+ * for the first probe, updates are relaxed atomics.
+ * tracking could be switched (sample_rate == 0 disables it) only while there are no lookups.
+ */
+typedef struct CH_hot_key {
+    uint32_t hash;      /* same as ConsistentHash_key_hash */
+    uint32_t server;    /* primary owner of the key in current continuum, CH_NO_SERVER if none */
+    uint64_t count;     /* estimated lookups (sampled count multiplied by sample rate) */
+} CH_HotKey_t;
+#define CH_HOT_KEYS_MAX (32)    /* candidates kept, no more keys are ever returned */
+void ConsistentHash_track_hot_keys(ConsistentHash_t *ring, uint32_t sample_rate);
+/* fills out with at most n heaviest keys, heaviest first, returns their amount */
+uint32_t ConsistentHash_hot_keys(ConsistentHash_t *ring, CH_HotKey_t *out, uint32_t n);
+void ConsistentHash_hot_keys_reset(ConsistentHash_t *ring);
+
 typedef struct CH_server_list ConsistentHash_ServerList_t;
 ConsistentHash_ServerList_t *ConsistentHash_ServerList_new(ConsistentHash_t *ring);
 size_t ConsistentHash_ServerList_size(ConsistentHash_ServerList_t *servers);
@@ -115,6 +265,31 @@ CH_add_result_e ConsistentHash_ServerList_add(ConsistentHash_ServerList_t *list,
  */
 void ConsistentHash_exchange_server_list(ConsistentHash_t *ring, ConsistentHash_ServerList_t *list);
 void ConsistentHash_ServerList_free(ConsistentHash_ServerList_t *list);
+/**
+ * returns new list filled with ring's current servers description
+ * (name, weight, configured aliveness and handle), so that servers could be added to it.
+ * servers keep their state (updated aliveness, rebalance and ramp), so that list exchanged into
+ * a fresh ring makes the same continuum (except for failure patched by _fail_server).
+ */
+ConsistentHash_ServerList_t *ConsistentHash_ServerList_dup(ConsistentHash_t *ring);
+/**
+ * same as _dup(source), but list belongs to ring (list is bound to ring it is made for,
+ * and should be exchanged into it only), so that servers of one ring could be put into another.
+ */
+ConsistentHash_ServerList_t *ConsistentHash_ServerList_dup_from(ConsistentHash_t *ring, ConsistentHash_t *source);
+/**
+ * adds servers described by text, one per line:
+ *   name weight status [handle]
+ * status is alive, dead or down. handle is decimal number, if it is omitted
+ * for a ring using handle, it is parsed from "ip:port" name.
+ * fields are separated by spaces or tabs, empty lines and lines starting with # are skipped.
+ * text could be passed in chunks of any size, line split between chunks is kept in list,
+ * call with len == 0 to finish last line without trailing newline.
+ * servers with already known name are ignored, as with _add.
+ * returns 0 if everything is fine, otherwise number of first bad line;
+ * after error list is left as is and following chunks are ignored.
+ */
+uint32_t ConsistentHash_ServerList_load(ConsistentHash_ServerList_t *list, const char *buf, size_t len);
 
 /**
  * every "server" has two aliveness value:
@@ -131,6 +306,12 @@ void ConsistentHash_AliveByName_add(ConsistentHash_AliveByName_t *list, const ch
 void ConsistentHash_refresh_alive_by_name(ConsistentHash_t *ring, ConsistentHash_AliveByName_t *list, CH_aliveness_e default_alive);
 size_t ConsistentHash_AliveByName_size(ConsistentHash_AliveByName_t *list);
 void ConsistentHash_AliveByName_free(ConsistentHash_AliveByName_t *list);
+/**
+ * exchanges server list (if list is not NULL) same way _exchange_server_list does,
+ * and then applies aliveness updates (if alive is not NULL), with a single continuum rebuild.
+ * unlike _refresh_alive_by_name, servers not mentioned in alive keep their updated aliveness.
+ */
+void ConsistentHash_apply(ConsistentHash_t *ring, ConsistentHash_ServerList_t *list, ConsistentHash_AliveByName_t *alive);
 
 typedef struct CH_aliveness_by_handle ConsistentHash_AliveByHandle_t;
 ConsistentHash_AliveByHandle_t *ConsistentHash_AliveByHandle_new(ConsistentHash_t *ring);
@@ -139,6 +320,33 @@ void ConsistentHash_refresh_alive_by_handle(ConsistentHash_t *ring, ConsistentHa
 size_t ConsistentHash_AliveByHandle_size(ConsistentHash_AliveByHandle_t *list);
 void ConsistentHash_AliveByHandle_free(ConsistentHash_AliveByHandle_t *list);
 
+/**
+ * bulk aliveness updates, names are borrowed for the time of call only.
+ * like _apply, servers not mentioned keep their updated aliveness,
+ * and unknown servers are ignored.
+ */
+typedef struct CH_name_status {
+    const char    *name;
+    size_t         name_len;
+    CH_aliveness_e alive;
+} CH_NameStatus_t;
+
+typedef struct CH_handle_status {
+    CH_handle_t    handle;
+    CH_aliveness_e alive;
+} CH_HandleStatus_t;
+
+/**
+ * only servers which resulting aliveness is changed are touched.
+ * continuum is rebuilt only when some server becomes CH_DEAD or stops being it,
+ * since CH_DOWN servers keep their points and are skipped by lookup.
+ * returns 1 if continuum was rebuilt, 0 otherwise.
+ * out_changed (if not NULL) receives amount of servers which aliveness is changed.
+ */
+int ConsistentHash_update_by_name(ConsistentHash_t *ring, const CH_NameStatus_t *statuses, size_t count, uint32_t *out_changed);
+/* same for ring which uses handle, returns 0 for ring which does not */
+int ConsistentHash_update_by_handle(ConsistentHash_t *ring, const CH_HandleStatus_t *statuses, size_t count, uint32_t *out_changed);
+
 CH_handle_t ConsistentHash_Helper_parse_ipv4_with_port(const char *str, size_t len, uint32_t default_port);
 
 typedef struct CH_iterator {
@@ -175,6 +383,13 @@ ConsistentHash_IteratorName_t ConsistentHash_Iterator_next_name(ConsistentHash_I
  * returns {0, 0} when no more servers
  */
 ConsistentHash_IteratorHandle_t ConsistentHash_Iterator_next_handle(ConsistentHash_Iterator_t *iterator);
+/**
+ * returns index of next server (see ConsistentHash_server_name),
+ * (uint32_t)-1 when no more servers.
+ * indexes are stable until next _exchange_server_list, so that, they could be used
+ * to keep per server data on caller's side.
+ */
+uint32_t ConsistentHash_Iterator_next_index(ConsistentHash_Iterator_t *iterator);
 
 /* following functions are for custom allocations of iterator.
  * use it if you need maximum speed */
@@ -194,6 +409,472 @@ void ConsistentHash_Iterator_reinit(ConsistentHash_Iterator_t *iterator, const c
 
 size_t ConsistentHash_Iterator_size(ConsistentHash_Iterator_t *iterator);
 
+/**
+ * number of servers in a ring (either alive or not).
+ * server indexes used by analysis functions are in range [0, count)
+ */
+uint32_t ConsistentHash_servers_count(ConsistentHash_t *ring);
+/**
+ * returns {0, NULL} when there is no server with such index
+ */
+ConsistentHash_IteratorName_t ConsistentHash_server_name(ConsistentHash_t *ring, uint32_t server);
+/**
+ * returns {0, 0} when there is no server with such index or ring doesn't use handle
+ */
+ConsistentHash_IteratorHandle_t ConsistentHash_server_handle(ConsistentHash_t *ring, uint32_t server);
+/**
+ * resulting aliveness of server (see CH_aliveness_by_name below), CH_DEAD for unknown index
+ */
+CH_aliveness_e ConsistentHash_server_alive(ConsistentHash_t *ring, uint32_t server);
+/**
+ * index of server with such name (or handle), CH_NO_SERVER if there is no such server
+ */
+uint32_t ConsistentHash_server_index(ConsistentHash_t *ring, const char *name, size_t name_len);
+uint32_t ConsistentHash_server_index_by_handle(ConsistentHash_t *ring, CH_handle_t handle);
+
+/**
+ * hot keys fan-out: lookups of marked keys are spread among first `spread`
+ * servers of the key instead of always choosing the first one.
+ * CH_SPREAD_ROUND_ROBIN - take them in turn.
+ * CH_SPREAD_LEAST_LOADED - take less loaded of two random ones (see _report_load).
+ * table of marked keys is small (CH_HOT_TABLE_SIZE), marks could be changed while
+ * other threads do lookups.
+ */
+typedef enum CH_spread {
+    CH_SPREAD_ROUND_ROBIN = 0,
+    CH_SPREAD_LEAST_LOADED = 1
+} CH_spread_e;
+#define CH_HOT_TABLE_SIZE (64)
+/**
+ * hash is ConsistentHash_key_hash of a key. spread <= 1 removes mark.
+ * returns 0 if table is full.
+ */
+int ConsistentHash_mark_hot(ConsistentHash_t *ring, uint32_t hash, uint32_t spread, CH_spread_e mode);
+/* load is any caller's metric (requests in flight, for example), it is kept for same server over exchanges */
+void ConsistentHash_report_load(ConsistentHash_t *ring, uint32_t server, uint32_t load);
+/**
+ * first choice server index for key, same as first _Iterator_next_index
+ * unless key is marked as hot. CH_NO_SERVER if there is no alive server.
+ */
+uint32_t ConsistentHash_lookup_first(ConsistentHash_t *ring, const char *key, size_t key_len);
+
+/**
+ * feedback rebalancing: points of every CH_ALIVE server are scaled, so that its share
+ * of measured load moves to the share expected from its weight.
+ * loads has a value per server index (ConsistentHash_servers_count of them),
+ * negative value means load of server is unknown, and it is left as is.
+ * since points of a server grow and shrink as a prefix, only marginal keys move.
+ * estimated moved fraction of keys (half the sum of share changes) is limited by max_movement (0..1),
+ * larger corrections are approached by repeated calls.
+ * measured servers keep their total points, so that continuum size does not drift.
+ * scale of a server is kept in [CH_MIN_ADJUST, CH_MAX_ADJUST] and survives exchanges.
+ * returns estimated fraction of keys moved, continuum is rebuilt if it is not 0.
+ */
+#define CH_MIN_ADJUST (0.25)
+#define CH_MAX_ADJUST (4.0)
+double ConsistentHash_rebalance(ConsistentHash_t *ring, const double *loads, double max_movement);
+/* current scale of server points, 1 if it was not rebalanced */
+double ConsistentHash_server_adjust(ConsistentHash_t *ring, uint32_t server);
+/* drops scales of all servers back to 1 */
+void ConsistentHash_reset_adjust(ConsistentHash_t *ring);
+
+/**
+ * warm up and drain: points of server are scaled by its ramp fraction (0..1),
+ * which moves from current value to `to` in `steps` equal steps, one per ConsistentHash_ramp_step.
+ * since points are a prefix, every step moves only a small slice of keys.
+ * server ramped to 0 keeps no points and is never chosen, so it could be removed without misses.
+ * steps == 0 applies `to` at once with a rebuild, otherwise nothing changes until the first step.
+ * returns 0 if there is no such server.
+ */
+int ConsistentHash_ramp(ConsistentHash_t *ring, uint32_t server, double to, uint32_t steps);
+/**
+ * makes one step of every ramping server with a single rebuild.
+ * returns number of servers which are still ramping.
+ */
+uint32_t ConsistentHash_ramp_step(ConsistentHash_t *ring);
+/* current ramp fraction of server, 1 if it is not ramped */
+double ConsistentHash_server_ramp(ConsistentHash_t *ring, uint32_t server);
+
+/**
+ * migration: every server list exchange starts new generation of ring, and increments its epoch.
+ * with config.keep_previous generation replaced by the last exchange is kept until retired,
+ * so that reads could fall back to previous owner of key until new one is warm.
+ */
+uint64_t ConsistentHash_epoch(ConsistentHash_t *ring);
+/**
+ * previous generation (NULL if there is none) is a read only ring: use it with _server_name,
+ * _server_handle, iterators and so on, but never change or free it.
+ * its epoch is the one it had before exchange.
+ */
+ConsistentHash_t *ConsistentHash_previous(ConsistentHash_t *ring);
+void ConsistentHash_retire_previous(ConsistentHash_t *ring);
+/**
+ * returns server index for key in current generation (as _lookup_first, so marked hot keys are spread),
+ * and sets *out_previous to index of first choice in previous generation, if it is a different server,
+ * or CH_NO_SERVER otherwise. key is hashed once unless its first point belongs to not alive server
+ * or key is marked hot.
+ */
+uint32_t ConsistentHash_lookup_migrating(ConsistentHash_t *ring, const char *key, size_t key_len, uint32_t *out_previous);
+
+/**
+ * marks server as CH_DEAD (as alive_as_updated).
+ * with config.failover_tables every rebuild precomputes, for every server, replacements of its points
+ * by their neighbours, so that first failure after rebuild is applied instantly in O(points of server),
+ * giving same lookups as rebuild would (unless median weight or points budget scale is changed
+ * by the failure, then rebuild moves some keys once more).
+ * then the rebuild is pending: caller should do ConsistentHash_rebuild when it is convenient.
+ * following failures (or any without tables) rebuild continuum at once.
+ * returns 1 if continuum is patched, 0 if it is rebuilt (or server is already dead), -1 for unknown server.
+ */
+int ConsistentHash_fail_server(ConsistentHash_t *ring, uint32_t server);
+/* is there a failure patched without rebuild */
+int ConsistentHash_rebuild_pending(ConsistentHash_t *ring);
+/* rebuilds continuum (and failover tables) from current servers state */
+void ConsistentHash_rebuild(ConsistentHash_t *ring);
+
+/**
+ * shared memory: one process publishes ring into POSIX shared memory, others attach read only.
+ * every publish writes new segment "<name>.<generation>" with header, server table, names,
+ * points and index, then bumps generation in control segment "<name>" and unlinks previous segment.
+ * attached reader checks generation on every lookup and maps new segment when it changes,
+ * so that there is no copying and no rebuild in readers.
+ * name should look like "/something". there should be single publisher for a name.
+ * compile with CONSISTENT_NO_SHM to leave it out (functions return CH_SHM_UNSUPPORTED then).
+ */
+typedef enum CH_shm_result {
+    CH_SHM_OK = 0,
+    CH_SHM_SYSTEM = 1,        /* see errno */
+    CH_SHM_NOT_PUBLISHED = 2,
+    CH_SHM_BAD_LAYOUT = 3,    /* segment is not a ring, is written by incompatible version
+                                 or its tables lie outside of it */
+    CH_SHM_HASH_MISMATCH = 4, /* reader's item_hash differs from publisher's one */
+    CH_SHM_UNSUPPORTED = 5
+} CH_shm_result_e;
+CH_shm_result_e ConsistentHash_publish(ConsistentHash_t *ring, const char *name);
+/* removes published segments */
+CH_shm_result_e ConsistentHash_unpublish(const char *name);
+
+typedef struct CH_shared ConsistentHash_Shared_t;
+/* config gives item_hash (it should be the same publisher uses) and allocation functions */
+CH_shm_result_e ConsistentHash_attach(const char *name, CH_config_t config, ConsistentHash_Shared_t **out);
+void ConsistentHash_detach(ConsistentHash_Shared_t *shared);
+/**
+ * maps newest generation if it is changed. called by _Shared_lookup, so that,
+ * explicit call is needed only to learn about changes.
+ * returns 1 if new generation is mapped, 0 if it is the same, -1 on error (old one is kept).
+ * shared handle should be used by one thread at a time, since old mapping is unmapped here.
+ */
+int ConsistentHash_Shared_refresh(ConsistentHash_Shared_t *shared);
+uint64_t ConsistentHash_Shared_generation(ConsistentHash_Shared_t *shared);
+/**
+ * fills out with up to n server indexes for key, in the same order ring's iterator gives them.
+ * returns number of servers found.
+ */
+uint32_t ConsistentHash_Shared_lookup(ConsistentHash_Shared_t *shared, const char *key, size_t key_len, uint32_t *out, uint32_t n);
+uint32_t ConsistentHash_Shared_servers_count(ConsistentHash_Shared_t *shared);
+ConsistentHash_IteratorName_t ConsistentHash_Shared_server_name(ConsistentHash_Shared_t *shared, uint32_t server);
+ConsistentHash_IteratorHandle_t ConsistentHash_Shared_server_handle(ConsistentHash_Shared_t *shared, uint32_t server);
+
+/**
+ * ratio is (ownership fraction of server) / (fraction expected from its weight),
+ * so that, ideally balanced ring has all ratios equal to 1.
+ * only CH_ALIVE servers are taken into account.
+ */
+typedef struct CH_ownership_stats {
+    uint32_t servers;
+    double   max_ratio;
+    double   min_ratio;
+    double   stddev;
+} CH_OwnershipStats_t;
+/**
+ * computes exact fraction of keys which has server as a first choice,
+ * using arc lengths of continuum and the same nearest point rule as lookup.
+ * keys falling on CH_DOWN servers are rehashed by lookup, so that, their share
+ * is spread among alive servers proportionally (and CH_DOWN servers get 0).
+ * out_fractions (if not NULL) should have room for ConsistentHash_servers_count values.
+ */
+CH_OwnershipStats_t ConsistentHash_ownership(ConsistentHash_t *ring, double *out_fractions);
+
+/**
+ * position of key in a key space, i.e. hash used for the first choice lookup
+ */
+uint32_t ConsistentHash_key_hash(ConsistentHash_t *ring, const char *key, size_t key_len);
+
+#define CH_NO_SERVER ((uint32_t)-1)
+/**
+ * range of key space, which changes its first choice server.
+ * old_server is index in old ring, new_server is index in new ring,
+ * any of them is CH_NO_SERVER if ring were empty.
+ */
+typedef struct CH_range_move {
+    uint32_t start;
+    uint32_t end;     /* inclusive */
+    uint32_t old_server;
+    uint32_t new_server;
+} CH_RangeMove_t;
+
+typedef struct CH_ring_diff ConsistentHash_Diff_t;
+/**
+ * computes exactly which key ranges will move from old_ring to new_ring.
+ * servers are matched by name. it is single linear pass over both continuums,
+ * so that, it is fine to call it before applying topology change on a copy of ring.
+ * as with ConsistentHash_ownership, ranges are about first point of lookup.
+ */
+ConsistentHash_Diff_t *ConsistentHash_diff(ConsistentHash_t *old_ring, ConsistentHash_t *new_ring);
+uint32_t ConsistentHash_Diff_count(ConsistentHash_Diff_t *diff);
+const CH_RangeMove_t *ConsistentHash_Diff_ranges(ConsistentHash_Diff_t *diff);
+/* fraction of whole key space that moves */
+double ConsistentHash_Diff_moved(ConsistentHash_Diff_t *diff);
+/* fraction of whole key space leaving server of old ring */
+double ConsistentHash_Diff_moved_from(ConsistentHash_Diff_t *diff, uint32_t old_server);
+/* fraction of whole key space coming to server of new ring */
+double ConsistentHash_Diff_moved_to(ConsistentHash_Diff_t *diff, uint32_t new_server);
+size_t ConsistentHash_Diff_size(ConsistentHash_Diff_t *diff);
+void ConsistentHash_Diff_free(ConsistentHash_Diff_t *diff);
+
+/**
+ * LOOKUP KERNELS
+ * view is a flat picture of a ring: sorted points with their index and aliveness of servers
+ * as a dense byte array. CONSISTENT_DEFINE_LOOKUP makes lookup function over view for fixed
+ * item hash, so that hash and whole probe loop are inlined, with no indirect calls and no
+ * pointer chasing through server items. it gives the same servers in the same order as
+ * ConsistentHash_Iterator_next_index, but skips stats, hot key sampling and spreading.
+ *
+ *   CONSISTENT_DEFINE_LOOKUP(lookup_murmur, CH_murmur_item_hash)
+ *   ConsistentHash_LookupView_t view = ConsistentHash_lookup_view(ring);
+ *   n = lookup_murmur(&view, key, key_len, servers, 3);
+ *
+ * view is valid until the ring is changed. taking it walks all servers, so that it should be
+ * taken after every change, not for every lookup. with replicas (see ConsistentHash_replicas)
+ * view reads replica of NUMA node of the thread which took it.
+ * visited servers are marked in a bitmap on stack for views of up to CH_LOOKUP_STACK_BITS
+ * servers. larger views need CH_LOOKUP_VISITED_WORDS(view.servers) words: name##_visited
+ * takes them from caller, name allocates them for every call (and finds nothing if it can't).
+ */
+#define CH_INDEX_LOG 12
+#define CH_INDEX_SIZE ((1<<CH_INDEX_LOG) + 1)
+#define CH_INDEX_ILOG (32 - CH_INDEX_LOG)
+#define CH_ITERATOR_SEED (~5)
+#define CH_LOOKUP_STACK_BITS (4096)
+#define CH_LOOKUP_VISITED_WORDS(servers) (((size_t)(servers) + 63) / 64)
+
+typedef struct CH_point {
+    uint32_t point;
+    uint32_t server;
+} CH_Point_t;
+
+typedef struct CH_lookup_view {
+    const CH_Point_t  *points;          /* sorted */
+    const uint32_t    *index;           /* CH_INDEX_SIZE bounds of points by top CH_INDEX_LOG bits */
+    const uint8_t     *alive;           /* 1 for CH_ALIVE servers, by server index */
+    const CH_handle_t *handles;         /* by server index, NULL if ring does not use handles */
+    void              *ctx;             /* config.ctx passed to item hash */
+    uint32_t           points_count;
+    uint32_t           servers;
+    uint32_t           alive_count;
+    uint32_t           visitable_count; /* servers having points */
+} ConsistentHash_LookupView_t;
+
+ConsistentHash_LookupView_t ConsistentHash_lookup_view(ConsistentHash_t *ring);
+
+/* Murmur3_32, default item hash */
+static inline uint32_t
+CH_rotl32(uint32_t x, int r) { return (x << r) | (x >> (32 - r)); }
+
+static inline uint32_t
+CH_murmur3_32(const void *key, size_t len, uint32_t seed)
+{
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    const uint8_t *data = (const uint8_t*)key;
+    const uint8_t *tail = data + (len & ~(size_t)3);
+    uint32_t h1 = seed, k1;
+    size_t i;
+    for (i = 0; i + 4 <= len; i += 4) {
+        memcpy(&k1, data + i, 4);
+        k1 *= c1; k1 = CH_rotl32(k1, 15); k1 *= c2;
+        h1 ^= k1; h1 = CH_rotl32(h1, 13); h1 = h1 * 5 + 0xe6546b64;
+    }
+    k1 = 0;
+    switch (len & 3) {
+    case 3: k1 ^= (uint32_t)tail[2] << 16; /* fall through */
+    case 2: k1 ^= (uint32_t)tail[1] << 8;  /* fall through */
+    case 1: k1 ^= tail[0];
+            k1 *= c1; k1 = CH_rotl32(k1, 15); k1 *= c2; h1 ^= k1;
+    }
+    h1 ^= (uint32_t)len;
+    h1 = (h1 ^ (h1 >> 16)) * 0x85ebca6b;
+    h1 = (h1 ^ (h1 >> 13)) * 0xc2b2ae35;
+    return h1 ^ (h1 >> 16);
+}
+
+static inline uint32_t
+CH_murmur_item_hash(void *ctx, const char *item, size_t len, uint32_t seed)
+{
+    (void)ctx;
+    return CH_murmur3_32(item, len, seed);
+}
+
+static inline uint32_t
+CH_points_first_greater_or_equal(const CH_Point_t *points, uint32_t point, uint32_t left, uint32_t right)
+{
+    uint32_t mid;
+    while (left < right) {
+        mid = left + (right - left) / 2;
+        if (points[mid].point < point)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    return left;
+}
+
+static inline uint32_t
+CH_distance(uint32_t a, uint32_t b)
+{
+    uint32_t dist = a - b;
+    uint32_t close = !(dist & (1u << 31));
+    return close * dist + !close * (~dist + 1);
+}
+
+/* nearest point rule over sorted points with index, count should be positive.
+ * ties go to the lesser point */
+static inline uint32_t
+CH_points_find_server(const CH_Point_t *points, uint32_t count, const uint32_t *index, uint32_t point)
+{
+    uint32_t index_pos = point >> CH_INDEX_ILOG;
+    uint32_t left = index[index_pos];
+    uint32_t right = index[index_pos + 1];
+    uint32_t greater = left == right ? right : CH_points_first_greater_or_equal(points, point, left, right);
+    uint32_t lesser = greater + (!greater * count) - 1;
+    greater %= count;
+    return (CH_distance(point, points[greater].point) < CH_distance(point, points[lesser].point)) ?
+        points[greater].server :
+        points[lesser].server;
+}
+
+/* servers visited by one lookup, small enough to live on stack */
+typedef struct CH_lookup_state {
+    uint32_t seed;
+    uint32_t found;
+    uint32_t visited;
+    int      owned;                                  /* visited_bits are allocated by state */
+    uint64_t *visited_bits;                          /* for larger views, NULL - stack_bits are used */
+    uint64_t stack_bits[CH_LOOKUP_STACK_BITS / 64];  /* for views of up to CH_LOOKUP_STACK_BITS servers */
+} CH_LookupState_t;
+
+/* visited is caller's bitmap of CH_LOOKUP_VISITED_WORDS(view->servers) words or NULL.
+ * returns 0 if bitmap for large view could not be allocated */
+static inline int
+CH_lookup_state_init(CH_LookupState_t *state, const ConsistentHash_LookupView_t *view, uint64_t *visited)
+{
+    size_t words = CH_LOOKUP_VISITED_WORDS(view->servers);
+    state->seed = CH_ITERATOR_SEED;
+    state->found = 0;
+    state->visited = 0;
+    state->owned = 0;
+    state->visited_bits = visited;
+    if (visited == NULL && view->servers > CH_LOOKUP_STACK_BITS) {
+        state->visited_bits = (uint64_t*)malloc(words * sizeof(uint64_t));
+        if (state->visited_bits == NULL)
+            return 0;
+        state->owned = 1;
+    }
+    memset(state->visited_bits ? state->visited_bits : state->stack_bits, 0, words * sizeof(uint64_t));
+    return 1;
+}
+
+static inline void
+CH_lookup_state_done(CH_LookupState_t *state)
+{
+    if (state->owned)
+        free(state->visited_bits);
+    state->visited_bits = NULL;
+    state->owned = 0;
+}
+
+/* could probing find one more server */
+static inline int
+CH_lookup_state_more(const CH_LookupState_t *state, const ConsistentHash_LookupView_t *view)
+{
+    return view->points_count != 0 && state->found < view->alive_count &&
+        state->visited < view->visitable_count;
+}
+
+/* takes server found by a probe: returns 1 if it is not visited alive server,
+ * 0 if probing should go on */
+static inline int
+CH_lookup_state_visit(CH_LookupState_t *state, const ConsistentHash_LookupView_t *view, uint32_t server)
+{
+    uint64_t *bits = state->visited_bits ? state->visited_bits : state->stack_bits;
+    uint64_t bit = (uint64_t)1 << (server & 63);
+    if (bits[server >> 6] & bit)
+        return 0;
+    bits[server >> 6] |= bit;
+    state->visited++;
+    if (!view->alive[server])
+        return 0;
+    state->found++;
+    return 1;
+}
+
+/* probe loop of the iterator, emit(i, server) stores found server */
+#define CH_LOOKUP_BODY(hash, view, key, key_len, n, visited, emit) do { \
+    CH_LookupState_t ch_state_; \
+    uint32_t ch_server_; \
+    if (!CH_lookup_state_init(&ch_state_, (view), (visited))) \
+        return 0; \
+    while (ch_state_.found < (n) && CH_lookup_state_more(&ch_state_, (view))) { \
+        ch_server_ = CH_points_find_server((view)->points, (view)->points_count, (view)->index, \
+                hash((view)->ctx, (key), (key_len), ch_state_.seed)); \
+        ch_state_.seed--; \
+        if (CH_lookup_state_visit(&ch_state_, (view), ch_server_)) \
+            emit(ch_state_.found - 1, ch_server_); \
+    } \
+    CH_lookup_state_done(&ch_state_); \
+    return ch_state_.found; \
+} while (0)
+
+#define CH_LOOKUP_EMIT_INDEX(i, server) (out[i] = (server))
+#define CH_LOOKUP_EMIT_HANDLE(i, server) (out[i] = view->handles[server])
+
+/**
+ * static uint32_t name(const ConsistentHash_LookupView_t *view, const char *key, size_t key_len,
+ *                      uint32_t *out, uint32_t n)
+ * static uint32_t name##_visited(..., uint32_t *out, uint32_t n, uint64_t *visited)
+ * fills out with up to n server indexes, returns their number.
+ * hash has CH_item_hash_t signature and should give the same values as ring's item_hash.
+ */
+#define CONSISTENT_DEFINE_LOOKUP(name, hash) \
+static inline uint32_t \
+name##_visited(const ConsistentHash_LookupView_t *view, const char *key, size_t key_len, uint32_t *out, uint32_t n, \
+        uint64_t *visited) \
+{ \
+    CH_LOOKUP_BODY(hash, view, key, key_len, n, visited, CH_LOOKUP_EMIT_INDEX); \
+} \
+static inline uint32_t \
+name(const ConsistentHash_LookupView_t *view, const char *key, size_t key_len, uint32_t *out, uint32_t n) \
+{ \
+    return name##_visited(view, key, key_len, out, n, NULL); \
+}
+
+/* same, but fills out with handles, for rings with CH_USE_HANDLE */
+#define CONSISTENT_DEFINE_LOOKUP_HANDLE(name, hash) \
+static inline uint32_t \
+name##_visited(const ConsistentHash_LookupView_t *view, const char *key, size_t key_len, CH_handle_t *out, uint32_t n, \
+        uint64_t *visited) \
+{ \
+    CH_LOOKUP_BODY(hash, view, key, key_len, n, visited, CH_LOOKUP_EMIT_HANDLE); \
+} \
+static inline uint32_t \
+name(const ConsistentHash_LookupView_t *view, const char *key, size_t key_len, CH_handle_t *out, uint32_t n) \
+{ \
+    return name##_visited(view, key, key_len, out, n, NULL); \
+}
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 #ifdef CONSISTENT_IMPLEMENTATION
@@ -253,6 +934,40 @@ default_handle_eq(__unused__ void *ctx, CH_handle_t handle_a, CH_handle_t handle
     return handle_a == handle_b;
 }
 
+#if defined(__GNUC__)
+#define relaxed_add(ptr, n) __atomic_add_fetch((ptr), (n), __ATOMIC_RELAXED)
+#define relaxed_store(ptr, v) __atomic_store_n((ptr), (v), __ATOMIC_RELAXED)
+#define relaxed_load(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define CH_THREAD_LOCAL __thread
+#else
+#define relaxed_add(ptr, n) (*(ptr) += (n))
+#define relaxed_store(ptr, v) (*(ptr) = (v))
+#define relaxed_load(ptr) (*(ptr))
+#if defined(_MSC_VER)
+#define CH_THREAD_LOCAL __declspec(thread)
+#else
+#define CH_THREAD_LOCAL
+#endif
+#endif
+
+#define stat_add(ring, field, n) do { \
+    if ((ring)->config.collect_stats) \
+        relaxed_add(&(ring)->stats.field, (n)); \
+} while(0)
+#define stat_set(ring, field, n) do { \
+    if ((ring)->config.collect_stats) \
+        relaxed_store(&(ring)->stats.field, (n)); \
+} while(0)
+#define stat_get(ring, field) relaxed_load(&(ring)->stats.field)
+
+static inline uint64_t
+clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 static inline uint32_t
 fmix64(CH_handle_t k)
 {
@@ -359,13 +1074,13 @@ _ensure_capa(CH_config_t *config, void **buf, uint32_t *capa, uint32_t need_capa
     }
 }
 
-#define do_realloc(config, buf, count) _do_realloc(config, (void**)buf, count * sizeof(**(buf)))
-#define do_realloca(config, buf, new_count, old_count) _do_realloc(config, (void**)buf, new_count * sizeof(**(buf)), old_count * sizeof(**(buf)))
-#define do_malloc(config, buf, count)   _do_malloc(config, (void**)buf, count * sizeof(**(buf)))
-#define do_calloc(config, buf, count)   _do_calloc(config, (void**)buf, count * sizeof(**(buf)))
+#define do_realloc(config, buf, count) _do_realloc(config, (void**)buf, (count) * sizeof(**(buf)))
+#define do_realloca(config, buf, new_count, old_count) _do_realloc(config, (void**)buf, (new_count) * sizeof(**(buf)), (old_count) * sizeof(**(buf)))
+#define do_malloc(config, buf, count)   _do_malloc(config, (void**)buf, (count) * sizeof(**(buf)))
+#define do_calloc(config, buf, count)   _do_calloc(config, (void**)buf, (count) * sizeof(**(buf)))
 #define do_free(config, buf)            _do_free(config, (void**)buf)
 
-#define do_memzero(buf, count) memset(buf, 0, sizeof(*(buf)) * count)
+#define do_memzero(buf, count) memset(buf, 0, sizeof(*(buf)) * (count))
 
 #define ensure_capa(config, arr, need_capa) _ensure_capa(config, (void**)&(arr).buf, &(arr).capa, need_capa, sizeof(*(arr).buf))
 #define array_clean(config, arr) do { do_free(config, (void**)&(arr).buf); (arr).capa = (arr).count = 0; } while(0)
@@ -377,16 +1092,30 @@ _ensure_capa(CH_config_t *config, void **buf, uint32_t *capa, uint32_t need_capa
 } while(0)
 
 
-#define FASTHASH_LOG 12
-#define FASTHASH_SIZE ((1<<FASTHASH_LOG) + 1)
-#define FASTHASH_ILOG (32 - FASTHASH_LOG)
+/* seed of the first lookup hash, every next choice decrements it */
+#define ITERATOR_SEED CH_ITERATOR_SEED
+
+#define FASTHASH_LOG CH_INDEX_LOG
+#define FASTHASH_SIZE CH_INDEX_SIZE
+#define FASTHASH_ILOG CH_INDEX_ILOG
 #define FASTHASH_STEP (1<<FASTHASH_ILOG)
 #define MINIMUM_CONTINUUM (4 * 1024)
 
+typedef CH_Point_t Point_t;
+
+#define CH_MAX_NUMA_NODES (64)
+#define CH_NUMA_RECHECK (1024)
+#define CH_HUGE_PAGE ((size_t)2 << 20)
+
+/* read only copy of sorted continuum: FASTHASH index followed by points in one block */
 typedef struct {
-    uint32_t point;
-    uint32_t server;
-} Point_t;
+    void         *mem;
+    size_t        size;
+    int           node;
+    int           mapped;  /* mem is got from page allocator (or mmap), not from realloc */
+    uint32_t     *hash;
+    Point_t      *points;
+} CH_Replica_t;
 
 typedef struct {
     CH_config_t  *config;
@@ -397,8 +1126,16 @@ typedef struct {
         Point_t      *buf;
     } points;
     uint32_t      hash[FASTHASH_SIZE];
+    int           replicas_ready; /* replicas match sorted points */
+    struct {
+        uint32_t      capa;
+        uint32_t      count;
+        CH_Replica_t *buf;
+    } replicas;
 } Continuum_t;
 
+static void Continuum_free_replicas(Continuum_t *cont);
+
 static Continuum_t *
 Continuum_new(CH_config_t *config)
 {
@@ -414,18 +1151,24 @@ Continuum_clean(Continuum_t *cont)
 {
     cont->points.count = 0;
     cont->sorted = 0;
+    cont->replicas_ready = 0;
 }
 
 static size_t
 Continuum_size(Continuum_t *cont)
 {
-    return sizeof(Continuum_t) + buf_size(cont->points);
+    size_t size = sizeof(Continuum_t) + buf_size(cont->points) + buf_size(cont->replicas);
+    uint32_t i;
+    for (i = 0; i < cont->replicas.count; i++)
+        size += cont->replicas.buf[i].size;
+    return size;
 }
 
 static void
 Continuum_free(Continuum_t *cont)
 {
     if (cont) {
+        Continuum_free_replicas(cont);
         array_clean(cont->config, cont->points);
         do_free(cont->config, &cont);
     }
@@ -454,6 +1197,7 @@ Continuum_add_server(Continuum_t *cont, uint32_t server, uint32_t *points, uint3
 
     cont->points.count += points_num;
     cont->sorted = 0;
+    cont->replicas_ready = 0;
 }
 
 static void
@@ -508,20 +1252,7 @@ points_sort(Point_t *points, uint32_t points_num, uint32_t median, uint32_t delt
     }
 }
 
-static uint32_t
-points_first_greater_or_equal(Point_t *points, uint32_t point, uint32_t left, uint32_t right)
-{
-    uint32_t mid, mid_pnt;
-    while (left < right) {
-        mid = left + (right - left) / 2;
-        mid_pnt = points[mid].point;
-        if (mid_pnt < point)
-            left = mid + 1;
-        else if (mid_pnt >= point)
-            right = mid;
-    }
-    return left;
-}
+static void Continuum_copy_replicas(Continuum_t *cont);
 
 static void
 Continuum_fill_hash(Continuum_t *cont)
@@ -542,8 +1273,10 @@ Continuum_fill_hash(Continuum_t *cont)
         }
         if (right > cont->points.count) right = cont->points.count;
         cont->hash[i] = left =
-            points_first_greater_or_equal(cont->points.buf, hash_point, left, right);
+            CH_points_first_greater_or_equal(cont->points.buf, hash_point, left, right);
     }
+    if (cont->config->numa_replicas || cont->config->huge_pages)
+        Continuum_copy_replicas(cont);
 }
 
 static void
@@ -556,146 +1289,404 @@ Continuum_sort(Continuum_t *cont)
     }
 }
 
-static inline uint32_t
-distance(uint32_t a, uint32_t b)
+
+/* REPLICAS */
+
+#ifdef CH_HAVE_NUMA
+#define CH_MPOL_PREFERRED (1)
+
+static void *
+default_page_alloc(size_t size, int node, int huge)
 {
-    uint32_t dist = a - b;
-    uint32_t close = !(dist & (1 << 31));
-    return close * dist + !close * (~dist + 1);
+    void *ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    /* succeeds only if huge pages are reserved */
+    if (huge)
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if (huge)
+            madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    }
+    if (node >= 0) {
+        /* before first touch, so that pages are faulted in on that node. failure is harmless */
+        unsigned long mask = 1ul << node;
+        syscall(SYS_mbind, ptr, size, CH_MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+    return ptr;
 }
 
-static int
-Continuum_find_server(Continuum_t *cont, uint32_t point, uint32_t *server)
+static void
+default_page_free(void *ptr, size_t size)
 {
-    if (cont->points.count == 0)
-        return 0;
-
-    if (!cont->sorted)
-        Continuum_sort(cont);
+    munmap(ptr, size);
+}
 
-    {
-        uint32_t hash_pos = point >> FASTHASH_ILOG;
-        uint32_t left = cont->hash[hash_pos];
-        uint32_t right = cont->hash[hash_pos + 1];
-        uint32_t greater = left == right ? right : points_first_greater_or_equal(cont->points.buf, point, left, right);
-        uint32_t lesser = greater + (!greater * cont->points.count) - 1;
-        uint32_t dist_greater, dist_lesser;
-        greater %= cont->points.count;
-        dist_greater = distance(point, cont->points.buf[greater].point);
-        dist_lesser = distance(point, cont->points.buf[lesser].point);
-        *server = (dist_greater < dist_lesser) ?
-            cont->points.buf[greater].server :
-            cont->points.buf[lesser].server;
+/* nodes listed in sysfs as "0" or "0-1" or "0,2-3" */
+static uint32_t
+numa_nodes_count(void)
+{
+    char buf[256];
+    uint32_t count = 1;
+    size_t len, i;
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (f == NULL)
         return 1;
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = 0;
+    for (i = 0; i < len; i++) {
+        if (buf[i] >= '0' && buf[i] <= '9') {
+            uint32_t node = (uint32_t)strtoul(buf + i, NULL, 10);
+            if (node + 1 > count)
+                count = node + 1;
+            while (i + 1 < len && buf[i + 1] >= '0' && buf[i + 1] <= '9')
+                i++;
+        }
     }
+    return count > CH_MAX_NUMA_NODES ? CH_MAX_NUMA_NODES : count;
 }
 
+static CH_THREAD_LOCAL uint32_t numa_node_cache;
+static CH_THREAD_LOCAL uint32_t numa_node_countdown;
+
+/* getcpu is a real syscall on some platforms, so that it is not made on every lookup */
 static inline uint32_t
-fmix_int32(uint32_t key, uint32_t mix)
+current_numa_node(void)
 {
-    uint64_t res = (uint64_t)key * (uint64_t)mix;
-    return (uint32_t)res ^ (uint32_t)(res >> 32);
+    if (numa_node_countdown == 0) {
+        unsigned cpu = 0, node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+            node = 0;
+        numa_node_cache = node;
+        numa_node_countdown = CH_NUMA_RECHECK;
+    }
+    numa_node_countdown--;
+    return numa_node_cache;
 }
-
-/* Murmur3_32 hash implementation */
-#if defined(_MSC_VER)
-#define rotl32(x,y)  _rotl(x,y)
 #else
-static inline uint32_t
-rotl32(uint32_t x, int8_t r) { return (x << r) | (x >> (32 - r)); }
+#define numa_nodes_count() (1)
+#define current_numa_node() (0)
 #endif
-/* Block read - if your platform needs to do endian-swapping or can only
-   handle aligned reads, do the conversion here */
-static inline uint32_t
-getblock32 (const uint32_t * p, int i) { return p[i]; }
-static const uint32_t c1 = 0xcc9e2d51;
-static const uint32_t c2 = 0x1b873593;
-static const uint32_t cm1 = 0x85ebca6b;
-static const uint32_t cm2 = 0xc2b2ae35;
-static uint32_t
-CH_MurmurHash3( const void * key, int len, uint32_t seed )
-{
-  const uint8_t * data = (const uint8_t*)key;
-  const int nblocks = len / 4;
-  uint32_t h1 = seed, k1;
-  const uint32_t * blocks = (const uint32_t *)(data + nblocks*4);
-  int i;
-  for(i = -nblocks; i; i++)
-  {
-    uint32_t k1 = getblock32(blocks,i);
-    k1 *= c1; k1 = rotl32(k1,15); k1 *= c2;
-    h1 ^= k1; h1 = rotl32(h1,13); h1 = h1*5+0xe6546b64;
-  }
-  const uint8_t * tail = (const uint8_t*)(data + nblocks*4);
-  k1 = 0;
-  switch(len & 3)
-  {
-  case 3: k1 ^= tail[2] << 16;
-  case 2: k1 ^= tail[1] << 8;
-  case 1: k1 ^= tail[0];
-          k1 *= c1; k1 = rotl32(k1,15); k1 *= c2; h1 ^= k1;
-  };
-  h1 ^= len;
-  h1 = (h1 ^ (h1 >> 16)) * cm1;
-  h1 = (h1 ^ (h1 >> 13)) * cm2;
-  return h1 ^ (h1 >> 16);
-}
 
 static void
-simple_points_hash(__unused__ void *ctx, const char *server, size_t len, uint32_t seed, uint32_t digest[4])
+Replica_release(CH_config_t *config, CH_Replica_t *replica)
 {
-    uint32_t i = seed * 4;
-    digest[0] = CH_MurmurHash3(server, len, i * c1);
-    digest[1] = CH_MurmurHash3(server, len, (i+1) * c2);
-    digest[2] = CH_MurmurHash3(server, len, (i+2) * cm1);
-    digest[3] = CH_MurmurHash3(server, len, (i+3) * cm2);
+    if (replica->mem == NULL)
+        return;
+    if (!replica->mapped)
+        do_free(config, &replica->mem);
+    else if (config->page_free)
+        config->page_free(config->ctx, replica->mem, replica->size);
+#ifdef CH_HAVE_NUMA
+    else
+        default_page_free(replica->mem, replica->size);
+#endif
+    replica->mem = NULL;
+    replica->size = 0;
 }
 
-static uint32_t
-murmur_item_hash(__unused__ void *ctx, const char *item, size_t len, uint32_t seed)
+static void
+Replica_reserve(CH_config_t *config, CH_Replica_t *replica, size_t size)
 {
-    return CH_MurmurHash3(item, len, seed);
-}
+    size_t hash_size = sizeof(uint32_t) * FASTHASH_SIZE;
+    hash_size = (hash_size + 63) & ~(size_t)63;
+    size += hash_size;
+    if (replica->size >= size)
+        return;
+    Replica_release(config, replica);
+    if (config->huge_pages)
+        size = (size + CH_HUGE_PAGE - 1) & ~(CH_HUGE_PAGE - 1);
+    if (config->page_alloc)
+        replica->mem = config->page_alloc(config->ctx, size, replica->node, config->huge_pages);
+#ifdef CH_HAVE_NUMA
+    else
+        replica->mem = default_page_alloc(size, replica->node, config->huge_pages);
+#endif
+    replica->mapped = replica->mem != NULL;
+    if (replica->mem == NULL)
+        do_malloc(config, (char**)&replica->mem, size);
+    replica->size = size;
+    replica->hash = replica->mem;
+    replica->points = (Point_t*)((char*)replica->mem + hash_size);
+}
+
+static void
+Continuum_free_replicas(Continuum_t *cont)
+{
+    uint32_t i;
+    for (i = 0; i < cont->replicas.count; i++)
+        Replica_release(cont->config, &cont->replicas.buf[i]);
+    array_clean(cont->config, cont->replicas);
+    cont->replicas_ready = 0;
+}
+
+static void
+Continuum_copy_replicas(Continuum_t *cont)
+{
+    uint32_t i;
+    if (cont->replicas.count == 0) {
+        uint32_t nodes = cont->config->numa_replicas ? numa_nodes_count() : 1;
+        ensure_capa(cont->config, cont->replicas, nodes);
+        do_memzero(cont->replicas.buf, nodes);
+        for (i = 0; i < nodes; i++)
+            cont->replicas.buf[i].node = cont->config->numa_replicas ? (int)i : -1;
+        cont->replicas.count = nodes;
+    }
+    for (i = 0; i < cont->replicas.count; i++) {
+        CH_Replica_t *replica = &cont->replicas.buf[i];
+        Replica_reserve(cont->config, replica, sizeof(Point_t) * cont->points.count);
+        memcpy(replica->hash, cont->hash, sizeof(cont->hash));
+        memcpy(replica->points, cont->points.buf, sizeof(Point_t) * cont->points.count);
+    }
+    cont->replicas_ready = 1;
+}
+
+static inline const CH_Replica_t *
+Continuum_replica(Continuum_t *cont)
+{
+    if (cont->replicas.count == 1)
+        return cont->replicas.buf;
+    return &cont->replicas.buf[current_numa_node() % cont->replicas.count];
+}
+
+static int
+Continuum_find_server(Continuum_t *cont, uint32_t point, uint32_t *server)
+{
+    if (cont->points.count == 0)
+        return 0;
+
+    if (!cont->sorted)
+        Continuum_sort(cont);
+
+    if (cont->replicas_ready) {
+        const CH_Replica_t *replica = Continuum_replica(cont);
+        *server = CH_points_find_server(replica->points, cont->points.count, replica->hash, point);
+        return 1;
+    }
+    *server = CH_points_find_server(cont->points.buf, cont->points.count, cont->hash, point);
+    return 1;
+}
+
+/* walks continuum arcs in order of key space [0, 2^32),
+ * every arc is owned by the server Continuum_find_server returns for its keys:
+ * keys between two neighbour points belong to the nearest one, ties go to the lesser one */
+typedef struct {
+    const Point_t *buf;
+    uint32_t  count;
+    uint32_t  next;     /* first point of next group of equal points */
+    uint32_t  last;     /* last point of current group */
+    uint64_t  wrap_end; /* end of right arc of the last group, may exceed 2^32 */
+    uint64_t  pos;      /* first key of next arc */
+    int       state;
+    /* current arc, both ends are inclusive */
+    uint32_t  start;
+    uint32_t  end;
+    uint32_t  server;
+} ArcCursor_t;
+
+#define KEYS_END ((uint64_t)1 << 32)
+
+static void
+ArcCursor_init(ArcCursor_t *cursor, Continuum_t *cont)
+{
+    do_memzero(cursor, 1);
+    if (cont->points.count && !cont->sorted)
+        Continuum_sort(cont);
+    cursor->buf = cont->points.buf;
+    cursor->count = cont->points.count;
+    if (cursor->count) {
+        uint64_t first = cursor->buf[0].point;
+        uint64_t last = cursor->buf[cursor->count - 1].point;
+        cursor->wrap_end = last + (KEYS_END + first - last) / 2;
+    }
+}
+
+static inline uint32_t
+ArcCursor_group_end(ArcCursor_t *cursor, uint32_t i)
+{
+    uint32_t point = cursor->buf[i].point;
+    while (i + 1 < cursor->count && cursor->buf[i + 1].point == point)
+        i++;
+    return i;
+}
+
+static int
+ArcCursor_next(ArcCursor_t *cursor)
+{
+    const Point_t *buf = cursor->buf;
+    uint64_t end;
+    uint32_t server;
+
+    for (;;) {
+        switch (cursor->state) {
+        case 0: /* first arc, or whole ring when all points are equal */
+            if (cursor->count == 0)
+                return 0;
+            cursor->last = ArcCursor_group_end(cursor, 0);
+            if (cursor->last == cursor->count - 1) {
+                /* equal distances everywhere, so that lesser point wins except exact match */
+                cursor->state = 5;
+                end = buf[0].point;
+                if (end == 0) continue;
+                end--;
+                server = buf[cursor->last].server;
+                break;
+            }
+            cursor->state = 1;
+            if (cursor->wrap_end < KEYS_END) continue;
+            end = cursor->wrap_end - KEYS_END;
+            server = buf[cursor->count - 1].server;
+            break;
+        case 1: /* left arc of group */
+            if (cursor->next >= cursor->count) {
+                cursor->state = 3;
+                continue;
+            }
+            end = buf[cursor->next].point;
+            server = buf[cursor->next].server;
+            cursor->last = ArcCursor_group_end(cursor, cursor->next);
+            cursor->next = cursor->last + 1;
+            cursor->state = 2;
+            break;
+        case 2: /* right arc of group */
+            if (cursor->next < cursor->count) {
+                end = buf[cursor->last].point +
+                    (buf[cursor->next].point - buf[cursor->last].point) / 2;
+            } else {
+                end = cursor->wrap_end < KEYS_END ? cursor->wrap_end : KEYS_END - 1;
+            }
+            server = buf[cursor->last].server;
+            cursor->state = 1;
+            break;
+        case 3: /* left arc of the first group crosses the end of key space */
+            cursor->state = 4;
+            if (cursor->wrap_end >= KEYS_END - 1) continue;
+            end = KEYS_END - 1;
+            server = buf[0].server;
+            break;
+        case 5:
+            cursor->state = 6;
+            end = buf[0].point;
+            server = buf[0].server;
+            break;
+        case 6:
+            cursor->state = 4;
+            end = KEYS_END - 1;
+            server = buf[cursor->last].server;
+            break;
+        default:
+            return 0;
+        }
+        if (end < cursor->pos || cursor->pos >= KEYS_END)
+            continue; /* empty arc */
+        cursor->start = (uint32_t)cursor->pos;
+        cursor->end = (uint32_t)end;
+        cursor->server = server;
+        cursor->pos = end + 1;
+        return 1;
+    }
+}
+
+static inline uint32_t
+fmix_int32(uint32_t key, uint32_t mix)
+{
+    uint64_t res = (uint64_t)key * (uint64_t)mix;
+    return (uint32_t)res ^ (uint32_t)(res >> 32);
+}
+
+/* Murmur3_32 hash implementation is CH_murmur3_32 of interface */
+static const uint32_t c1 = 0xcc9e2d51;
+static const uint32_t c2 = 0x1b873593;
+static const uint32_t cm1 = 0x85ebca6b;
+static const uint32_t cm2 = 0xc2b2ae35;
+static inline uint32_t
+CH_MurmurHash3(const void *key, int len, uint32_t seed)
+{
+    return CH_murmur3_32(key, (size_t)len, seed);
+}
+
+static void
+simple_points_hash(__unused__ void *ctx, const char *server, size_t len, uint32_t seed, uint32_t digest[4])
+{
+    uint32_t i = seed * 4;
+    digest[0] = CH_MurmurHash3(server, len, i * c1);
+    digest[1] = CH_MurmurHash3(server, len, (i+1) * c2);
+    digest[2] = CH_MurmurHash3(server, len, (i+2) * cm1);
+    digest[3] = CH_MurmurHash3(server, len, (i+3) * cm2);
+}
 
-/* tired - cause I'm tired to write something more robust :-) */
-/* workflow: fill with items => search by key => delete by key => iterate */
-/* it is not intended for insertion after deletion nor for insertion of duplicates */
-#define TIRED_SET_INIT_CAPA (8)
+static uint32_t
+murmur_item_hash(__unused__ void *ctx, const char *item, size_t len, uint32_t seed)
+{
+    return CH_MurmurHash3(item, len, seed);
+}
+
+/* Swiss table like set: slots are probed by groups of 16 with 1-byte control tags,
+ * whole group is matched with one SSE2 compare (or plain loop without SSE2).
+ * tag keeps 7 bits of hash and full hash is stored too, so that key_eq
+ * is called almost only for the key itself.
+ * deleted slots are reused, so that any sequence of add/delete is allowed. */
+#define SET_GROUP (16)
+#define SET_INIT_CAPA (16)
+#define SET_EMPTY ((uint8_t)0x80)
+#define SET_DELETED ((uint8_t)0xfe)
+#define SET_NOT_FOUND ((uint32_t)-1)
 typedef CH_handle_t (*CH_key_get_t)(void *elem);
 
-typedef struct tired_set {
+typedef struct swiss_set {
     CH_config_t  *config;
     CH_key_hash_t key_hash;
     CH_key_eq_t   key_eq;
     CH_key_get_t  key_get;
-    uint32_t  capa;
+    uint32_t  capa;         /* power of two, multiple of SET_GROUP */
     uint32_t  size;
-    uint32_t  busy;
-    uint32_t  max;
+    uint32_t  growth_left;  /* empty slots could be taken before rehash */
+    uint8_t  *ctrl;         /* SET_EMPTY, SET_DELETED or 7 bits tag of hash */
     uint32_t *hashes;
     void    **elems;
-} TiredSet_t;
+} SwissSet_t;
+
+static inline uint32_t
+set_max_load(uint32_t capa)
+{
+    return capa - capa / 8;
+}
+
+static void
+set_alloc(SwissSet_t *set, uint32_t capa)
+{
+    do_malloc(set->config, &set->ctrl, capa);
+    do_malloc(set->config, &set->hashes, capa);
+    do_malloc(set->config, &set->elems, capa);
+    memset(set->ctrl, SET_EMPTY, capa);
+    set->capa = capa;
+    set->growth_left = set_max_load(capa); /* elements are put back by caller */
+}
 
-static TiredSet_t *
-TiredSet_new(CH_config_t *config, CH_key_get_t key_get, CH_key_hash_t key_hash, CH_key_eq_t key_eq)
+static SwissSet_t *
+SwissSet_new(CH_config_t *config, CH_key_get_t key_get, CH_key_hash_t key_hash, CH_key_eq_t key_eq)
 {
-    TiredSet_t *set;
+    SwissSet_t *set;
     do_calloc(config, &set, 1);
     set->config   = config;
     set->key_hash = key_hash;
     set->key_eq   = key_eq;
     set->key_get  = key_get;
-    do_calloc(config, &set->hashes, TIRED_SET_INIT_CAPA);
-    do_calloc(config, &set->elems, TIRED_SET_INIT_CAPA);
-    set->capa     = TIRED_SET_INIT_CAPA;
-    set->max = (set->capa >> 2) | (set->capa >> 1); /* (capa / 4 * 3) */
+    set_alloc(set, SET_INIT_CAPA);
     return set;
 }
 
 static void
-TiredSet_free(TiredSet_t *set)
+SwissSet_free(SwissSet_t *set)
 {
     if (set) {
+        do_free(set->config, &set->ctrl);
         do_free(set->config, &set->hashes);
         do_free(set->config, &set->elems);
         do_free(set->config, &set);
@@ -703,196 +1694,203 @@ TiredSet_free(TiredSet_t *set)
 }
 
 static size_t
-TiredSet_size(TiredSet_t *set)
+SwissSet_size(SwissSet_t *set)
 {
     if (set == NULL) return 0;
-    return sizeof(*set) + set->capa * (sizeof(*set->hashes) + sizeof(*set->elems));
+    return sizeof(*set) + set->capa * (sizeof(*set->ctrl) + sizeof(*set->hashes) + sizeof(*set->elems));
 }
 
-#define TH_EMPTY (0)
-#define TH_DELETED (1)
+/* bit i of mask is set when ctrl[i] matches */
+static inline uint32_t
+set_group_match(const uint8_t *ctrl, uint8_t tag)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t i, mask = 0;
+    for (i = 0; i < SET_GROUP; i++)
+        mask |= (uint32_t)(ctrl[i] == tag) << i;
+    return mask;
+#endif
+}
 
-static inline CH_handle_t
-th_key_get(TiredSet_t *set, void *elem)
+/* empty or deleted slots, both have high bit set */
+static inline uint32_t
+set_group_free(const uint8_t *ctrl)
 {
-    return set->key_get(elem);
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+    uint32_t i, mask = 0;
+    for (i = 0; i < SET_GROUP; i++)
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    return mask;
+#endif
 }
 
 static inline uint32_t
-th_hash(TiredSet_t *set, CH_handle_t key)
+set_ctz(uint32_t mask)
 {
-    uint32_t hash = set->key_hash(set->config->ctx, key);
-    return hash | ((!(hash & ~TH_DELETED)) << 1); /* > TH_DELETED */
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    uint32_t i = 0;
+    while (!(mask & 1)) { mask >>= 1; i++; }
+    return i;
+#endif
 }
 
-static inline int
-th_key_eq(TiredSet_t *set, uint32_t pos, CH_handle_t key)
-{
-    return set->key_eq(set->config->ctx, th_key_get(set, set->elems[pos]), key);
-}
-
-#define search_prepare() \
-    uint32_t *hashes = set->hashes; \
-    void    **elems = set->elems; \
-    uint32_t hash = th_hash(set, key); \
-    uint32_t mask = set->capa - 1; \
-    uint32_t pos = hash & mask; \
-    uint32_t delta
-
-#define search_loop() do { \
-    check_pos(); \
-    delta = (((hash % (mask >> 2)) | 1) << 2) - 3; \
-    for(;;) { \
-        pos = (pos + 1) & mask; \
-        check_pos(); \
-        pos = (pos + 1) & mask; \
-        check_pos(); \
-        pos = (pos + 1) & mask; \
-        check_pos(); \
-        pos = (pos + delta) & mask; \
-        check_pos(); \
-    } \
-} while(0)
+#define set_tag(hash) ((uint8_t)((hash) & 0x7f))
 
-static void *
-TiredSet_insert(TiredSet_t *set, void *elem)
-{
-    CH_handle_t key = th_key_get(set, elem);
-    search_prepare();
-    uint32_t deleted_pos = 0;
-
-#define check_pos() do { \
-    if (hashes[pos] == hash && th_key_eq(set, pos, key)) \
-        goto found; \
-    else if (hashes[pos] == TH_EMPTY) \
-        goto fresh; \
-    else if (hashes[pos] == TH_DELETED) \
-        deleted_pos = pos + 1; \
-} while(0)
+/* triangular probing over groups visits every group, since count of groups is power of two */
+#define set_probe_start(set, hash) \
+    uint32_t gmask = (set)->capa / SET_GROUP - 1; \
+    uint32_t group = ((hash) >> 7) & gmask; \
+    uint32_t step = 0
+#define set_probe_next() (group = (group + ++step) & gmask)
 
-    search_loop();
-#undef check_pos
-found:
-    if (deleted_pos) {
-        hashes[pos] = TH_DELETED;
-        hashes[deleted_pos - 1] = hash;
-        elems[deleted_pos - 1] = elems[pos];
-        pos = deleted_pos - 1;
-    }
-    return elems[pos];
-fresh:
-    if (!deleted_pos)
-        set->busy++;
-    else
-        pos = deleted_pos - 1;
-    set->size++;
-    hashes[pos] = hash;
-    elems[pos] = elem;
-    return elem;
+static uint32_t
+set_find(SwissSet_t *set, CH_handle_t key, uint32_t hash)
+{
+    uint8_t tag = set_tag(hash);
+    set_probe_start(set, hash);
+    for (;;) {
+        const uint8_t *ctrl = set->ctrl + group * SET_GROUP;
+        uint32_t mask = set_group_match(ctrl, tag);
+        while (mask) {
+            uint32_t pos = group * SET_GROUP + set_ctz(mask);
+            if (set->hashes[pos] == hash &&
+                    set->key_eq(set->config->ctx, set->key_get(set->elems[pos]), key))
+                return pos;
+            mask &= mask - 1;
+        }
+        if (set_group_match(ctrl, SET_EMPTY))
+            return SET_NOT_FOUND;
+        set_probe_next();
+    }
+}
+
+static uint32_t
+set_find_free(SwissSet_t *set, uint32_t hash)
+{
+    set_probe_start(set, hash);
+    for (;;) {
+        uint32_t mask = set_group_free(set->ctrl + group * SET_GROUP);
+        if (mask)
+            return group * SET_GROUP + set_ctz(mask);
+        set_probe_next();
+    }
+}
+
+static inline void
+set_put(SwissSet_t *set, uint32_t pos, uint32_t hash, void *elem)
+{
+    if (set->ctrl[pos] == SET_EMPTY)
+        set->growth_left--;
+    set->ctrl[pos] = set_tag(hash);
+    set->hashes[pos] = hash;
+    set->elems[pos] = elem;
 }
 
+/* grows when mostly filled with live elements, otherwise just drops deleted slots */
 static void
-TiredSet_increase(TiredSet_t *set)
+set_rehash(SwissSet_t *set)
 {
     uint32_t i;
     uint32_t old_capa = set->capa;
-    uint32_t capa = old_capa * 2;
+    uint8_t  *old_ctrl = set->ctrl;
     uint32_t *old_hashes = set->hashes;
     void    **old_elems = set->elems;
-    uint32_t mask = capa - 1;
-    uint32_t *hashes;
-    void    **elems;
+    uint32_t capa = set->size >= set_max_load(old_capa) / 2 ? old_capa * 2 : old_capa;
 
-    do_calloc(set->config, &hashes, capa);
-    do_calloc(set->config, &elems, capa);
-
-    for(i = 0; i < old_capa; i++) {
-        uint32_t hash = old_hashes[i];
-        if (hash > TH_DELETED) {
-            uint32_t pos = hash & mask;
-            uint32_t delta;
-#define check_pos()  if (hashes[pos] == TH_EMPTY) goto insert
-            search_loop();
-#undef check_pos
-        insert:
-            hashes[pos] = hash;
-            elems[pos] = old_elems[i];
+    set_alloc(set, capa);
+    for (i = 0; i < old_capa; i++) {
+        if (!(old_ctrl[i] & SET_EMPTY)) {
+            uint32_t hash = old_hashes[i];
+            set_put(set, set_find_free(set, hash), hash, old_elems[i]);
         }
     }
-
-    set->hashes = hashes;
-    set->elems = elems;
-    set->capa = capa;
-    set->max = (capa >> 2) | (capa >> 1);
-    set->busy = set->size;
+    do_free(set->config, &old_ctrl);
     do_free(set->config, &old_hashes);
     do_free(set->config, &old_elems);
 }
 
+/* returns elem with same key if it is already in set */
 static void *
-TiredSet_add(TiredSet_t *set, void *elem)
+SwissSet_add(SwissSet_t *set, void *elem)
 {
-    if (set->busy >= set->max) {
-        TiredSet_increase(set);
+    CH_handle_t key = set->key_get(elem);
+    uint32_t hash = set->key_hash(set->config->ctx, key);
+    uint32_t pos = set_find(set, key, hash);
+
+    if (pos != SET_NOT_FOUND)
+        return set->elems[pos];
+    pos = set_find_free(set, hash);
+    if (set->growth_left == 0 && set->ctrl[pos] == SET_EMPTY) {
+        set_rehash(set);
+        pos = set_find_free(set, hash);
     }
-    return TiredSet_insert(set, elem);
+    set_put(set, pos, hash, elem);
+    set->size++;
+    return elem;
 }
 
-#define check_pos() do { \
-    if (hashes[pos] == hash && th_key_eq(set, pos, key)) \
-        goto found; \
-    else if (hashes[pos] == TH_EMPTY) \
-        goto not_found; \
-} while(0)
-
 static void *
-TiredSet_get(TiredSet_t *set, CH_handle_t key)
+SwissSet_get(SwissSet_t *set, CH_handle_t key)
 {
-    search_prepare();
-
-    search_loop();
-found:
-    return elems[pos];
-not_found:
-    return NULL;
+    uint32_t pos = set_find(set, key, set->key_hash(set->config->ctx, key));
+    return pos == SET_NOT_FOUND ? NULL : set->elems[pos];
 }
 
 static void *
-TiredSet_delete(TiredSet_t *set, CH_handle_t key)
+SwissSet_delete(SwissSet_t *set, CH_handle_t key)
 {
-    search_prepare();
+    uint32_t pos = set_find(set, key, set->key_hash(set->config->ctx, key));
 
-    search_loop();
-found:
-    hashes[pos] = TH_DELETED;
+    if (pos == SET_NOT_FOUND)
+        return NULL;
+    /* group which still has empty slot never was full, so that no probe went
+     * through it further, and slot could become empty again */
+    if (set_group_match(set->ctrl + (pos & ~(SET_GROUP - 1)), SET_EMPTY)) {
+        set->ctrl[pos] = SET_EMPTY;
+        set->growth_left++;
+    } else {
+        set->ctrl[pos] = SET_DELETED;
+    }
     set->size--;
-    return elems[pos];
-not_found:
-    return NULL;
+    return set->elems[pos];
 }
-#undef check_pos
-#undef search_loop
-#undef TH_DELETED
-#undef TH_EMPTY
-/** END OF TIRED HASH **/
+#undef set_probe_start
+#undef set_probe_next
+#undef set_tag
+/** END OF SWISS SET **/
 
 typedef struct CH_name {
     size_t size;
     char   str[];
 } CH_Name_t;
 
+/* key of by_name set, could point to borrowed string for lookups */
+typedef struct CH_name_key {
+    size_t      size;
+    const char *str;
+} CH_NameKey_t;
+
+#define name_key_handle(key) ((CH_handle_t)(uintptr_t)(key))
+
 static uint32_t
 name_hash(__unused__ void *ctx, CH_handle_t key_name)
 {
-    CH_Name_t *name = (CH_Name_t*)(uintptr_t)key_name;
+    const CH_NameKey_t *name = (const CH_NameKey_t*)(uintptr_t)key_name;
     return CH_MurmurHash3(name->str, name->size, 0);
 }
 
 static int
 name_eq(__unused__ void *ctx, CH_handle_t key_name_a, CH_handle_t key_name_b)
 {
-    CH_Name_t *name_a = (CH_Name_t*)(uintptr_t)key_name_a;
-    CH_Name_t *name_b = (CH_Name_t*)(uintptr_t)key_name_b;
+    const CH_NameKey_t *name_a = (const CH_NameKey_t*)(uintptr_t)key_name_a;
+    const CH_NameKey_t *name_b = (const CH_NameKey_t*)(uintptr_t)key_name_b;
 
     return name_a->size == name_b->size &&
         memcmp(name_a->str, name_b->str, name_a->size) == 0;
@@ -921,20 +1919,158 @@ CH_Name_free(CH_config_t *config, CH_Name_t *name)
     do_free(config, &name);
 }
 
+/* POINT CACHE */
+
+typedef struct CH_points {
+    uint32_t   capa;
+    uint32_t   count;
+    uint32_t  *buf;
+} CH_Points_t;
+
+typedef struct CH_point_key {
+    CH_NameKey_t     name;
+    CH_points_hash_t points_hash;
+    void            *ctx;
+} CH_PointKey_t;
+
+typedef struct CH_point_entry {
+    CH_PointKey_t  key;
+    CH_Name_t     *name;
+    uint32_t       refs;   /* server items using it */
+    CH_Points_t    points;
+} CH_PointEntry_t;
+
+struct CH_point_cache {
+    CH_config_t  config;
+    uint32_t     refs;     /* caller and rings */
+    uint32_t     count;
+    size_t       points_size;
+    SwissSet_t  *entries;
+};
+
+static CH_handle_t
+PointEntry_key_as_handle(void *entry)
+{
+    return (CH_handle_t)(uintptr_t)&((CH_PointEntry_t*)entry)->key;
+}
+
+static uint32_t
+point_key_hash(__unused__ void *ctx, CH_handle_t handle)
+{
+    const CH_PointKey_t *key = (const CH_PointKey_t*)(uintptr_t)handle;
+    uint64_t fn = (uint64_t)(uintptr_t)key->points_hash ^ (uint64_t)(uintptr_t)key->ctx;
+    return CH_MurmurHash3(key->name.str, key->name.size, (uint32_t)(fn ^ (fn >> 32)));
+}
+
+static int
+point_key_eq(__unused__ void *ctx, CH_handle_t handle_a, CH_handle_t handle_b)
+{
+    const CH_PointKey_t *key_a = (const CH_PointKey_t*)(uintptr_t)handle_a;
+    const CH_PointKey_t *key_b = (const CH_PointKey_t*)(uintptr_t)handle_b;
+
+    return key_a->points_hash == key_b->points_hash && key_a->ctx == key_b->ctx &&
+        name_eq(NULL, name_key_handle(&key_a->name), name_key_handle(&key_b->name));
+}
+
+ConsistentHash_PointCache_t *
+ConsistentHash_PointCache_new(CH_config_t config)
+{
+    ConsistentHash_PointCache_t *cache;
+
+    config_set_defaults(&config);
+    do_calloc(&config, &cache, 1);
+    cache->config = config;
+    cache->config.point_cache = NULL;
+    cache->refs = 1;
+    cache->entries = SwissSet_new(&cache->config, PointEntry_key_as_handle, point_key_hash, point_key_eq);
+    return cache;
+}
+
+static void
+PointCache_ref(ConsistentHash_PointCache_t *cache)
+{
+    cache->refs++;
+}
+
+void
+ConsistentHash_PointCache_free(ConsistentHash_PointCache_t *cache)
+{
+    if (cache && --cache->refs == 0) {
+        /* rings are gone, so that, every entry is already released */
+        SwissSet_free(cache->entries);
+        do_free(&cache->config, &cache);
+    }
+}
+
+size_t
+ConsistentHash_PointCache_size(ConsistentHash_PointCache_t *cache)
+{
+    return sizeof(*cache) + SwissSet_size(cache->entries) +
+        cache->count * sizeof(CH_PointEntry_t) + cache->points_size;
+}
+
+uint32_t
+ConsistentHash_PointCache_count(ConsistentHash_PointCache_t *cache)
+{
+    return cache->count;
+}
+
+static CH_PointEntry_t *
+PointCache_get(ConsistentHash_PointCache_t *cache, const CH_config_t *config, CH_Name_t *name)
+{
+    CH_PointEntry_t *entry;
+    CH_PointKey_t key = { { name->size, name->str }, config->points_hash, config->ctx };
+
+    entry = SwissSet_get(cache->entries, (CH_handle_t)(uintptr_t)&key);
+    if (entry == NULL) {
+        do_calloc(&cache->config, &entry, 1);
+        entry->name = CH_Name_new(&cache->config, name->str, name->size);
+        entry->key = key;
+        entry->key.name.str = entry->name->str;
+        SwissSet_add(cache->entries, entry);
+        cache->count++;
+    }
+    entry->refs++;
+    return entry;
+}
+
+static void
+PointCache_release(ConsistentHash_PointCache_t *cache, CH_PointEntry_t *entry)
+{
+    if (--entry->refs == 0) {
+        SwissSet_delete(cache->entries, PointEntry_key_as_handle(entry));
+        cache->count--;
+        cache->points_size -= buf_size(entry->points);
+        CH_Name_free(&cache->config, entry->name);
+        array_clean(&cache->config, entry->points);
+        do_free(&cache->config, &entry);
+    }
+}
+
 typedef struct CH_server_item {
     CH_Name_t     *name;
+    CH_NameKey_t   key;      /* points to name, by_name is keyed by it */
     CH_handle_t    handle;
     uint32_t       weight;
     CH_aliveness_e alive_as_configured;
     CH_aliveness_e alive_as_updated;
+    uint32_t       index;    /* position in server list */
+    uint32_t       load;     /* see ConsistentHash_report_load */
+    float          adjust;   /* multiplier of points set by ConsistentHash_rebalance */
+    float          ramp;     /* multiplier of points set by ConsistentHash_ramp */
+    float          ramp_target;
+    float          ramp_step; /* 0 when not ramping */
     uint32_t       used_points;
-    struct {
-        uint32_t   capa;
-        uint32_t   count;
-        uint32_t  *buf;
-    } points;
+    CH_Points_t    points;
+    CH_PointEntry_t *shared; /* points are in config.point_cache then */
 } CH_ServerItem_t;
 
+static inline CH_Points_t *
+ServerItem_points(CH_ServerItem_t *server)
+{
+    return server->shared ? &server->shared->points : &server->points;
+}
+
 static inline CH_aliveness_e
 server_item_alive(CH_ServerItem_t *server)
 {
@@ -952,10 +2088,15 @@ ServerItem_new(CH_config_t *config, const char *name, size_t name_len, uint32_t
 
     do_calloc(config, &server, 1);
     server->name = CH_Name_new(config, name, name_len);
+    server->key.size = server->name->size;
+    server->key.str = server->name->str;
     server->handle = handle;
     server->weight = weight;
     server->alive_as_configured = alive;
     server->alive_as_updated = CH_DEFAULT;
+    server->adjust = 1;
+    server->ramp = 1;
+    server->ramp_target = 1;
     return server;
 }
 
@@ -972,6 +2113,8 @@ ServerItem_free(CH_config_t *config, CH_ServerItem_t *server)
     if (server) {
         CH_Name_free(config, server->name);
         do_free(config, &server->points.buf);
+        if (server->shared)
+            PointCache_release(config->point_cache, server->shared);
         do_free(config, &server);
     }
 }
@@ -979,7 +2122,7 @@ ServerItem_free(CH_config_t *config, CH_ServerItem_t *server)
 static CH_handle_t
 ServerItem_name_as_handle(void *server)
 {
-    return (CH_handle_t)(uintptr_t)((CH_ServerItem_t*)server)->name;
+    return name_key_handle(&((CH_ServerItem_t*)server)->key);
 }
 
 static CH_handle_t
@@ -988,37 +2131,70 @@ ServerItem_handle_as_handle(void *server)
     return ((CH_ServerItem_t*)server)->handle;
 }
 
-static void
-ServerItem_set_used_points(CH_config_t *config, CH_ServerItem_t *server, uint32_t used)
+/* returns amount of freshly generated points, *reused receives amount of already generated ones */
+static uint32_t
+ServerItem_set_used_points(CH_config_t *config, CH_ServerItem_t *server, uint32_t used, uint32_t *reused)
 {
-    if (server->points.count < used) {
+    uint32_t generated = 0;
+    CH_Points_t *points;
+    CH_config_t *alloc = config;
+
+    if (config->point_cache != NULL && used > 0) {
+        if (server->shared == NULL)
+            server->shared = PointCache_get(config->point_cache, config, server->name);
+        alloc = &config->point_cache->config;
+    }
+    points = ServerItem_points(server);
+    *reused = used < points->count ? used : points->count;
+    if (points->count < used) {
         uint32_t i;
         uint32_t *pnts;
         size_t      name_size;
         const char *name_str;
         uint32_t rounded = ((used + 3) / 4) * 4;
 
-        ensure_capa(config, server->points, rounded);
+        if (server->shared) {
+            config->point_cache->points_size -= buf_size(*points);
+            ensure_capa(alloc, *points, rounded);
+            config->point_cache->points_size += buf_size(*points);
+        } else
+            ensure_capa(alloc, *points, rounded);
         name_str = server->name->str;
         name_size = server->name->size;
-        i = server->points.count;
-        pnts = server->points.buf + i;
+        i = points->count;
+        pnts = points->buf + i;
         for (; i < rounded; i+=4, pnts+=4) {
             config->points_hash(config->ctx, name_str, name_size, i/4, pnts);
         }
-        server->points.count = rounded;
+        generated = rounded - points->count;
+        points->count = rounded;
     }
     server->used_points = used;
+    return generated;
+}
+
+/* state gained after server is added: updated aliveness, reported load, rebalance and ramp */
+static void
+ServerItem_copy_state(CH_ServerItem_t *to, CH_ServerItem_t *from)
+{
+    to->alive_as_updated = from->alive_as_updated;
+    to->load = from->load;
+    to->adjust = from->adjust;
+    to->ramp = from->ramp;
+    to->ramp_target = from->ramp_target;
+    to->ramp_step = from->ramp_step;
 }
 
 static void
 ServerItem_steal_points_and_alive(CH_ServerItem_t *to, CH_ServerItem_t *from)
 {
     to->points = from->points;
-    to->alive_as_updated = from->alive_as_updated;
+    to->shared = from->shared;
+    ServerItem_copy_state(to, from);
     from->points.capa = 0;
     from->points.count = 0;
     from->points.buf = NULL;
+    from->shared = NULL;
 }
 
 struct CH_server_list {
@@ -1028,65 +2204,315 @@ struct CH_server_list {
         uint32_t      count;
         CH_ServerItem_t **buf;
     } list;
-    TiredSet_t   *by_name;
-    TiredSet_t   *by_handle;
+    SwissSet_t   *by_name;
+    SwissSet_t   *by_handle;
+    /* state of _load */
+    struct {
+        uint32_t  capa;
+        uint32_t  count;
+        char     *buf;
+    } carry;                /* line split between chunks */
+    uint32_t      load_line;
+    uint32_t      load_error;
 };
 
-struct ConsistentHash {
-    CH_config_t    config;
-    ConsistentHash_ServerList_t servers;
-    uint32_t       alive_count;
-    uint32_t       visitable_count;
-    Continuum_t   *continuum;
+/* HOT KEYS */
+#define HOT_SKETCH_DEPTH (4)
+#define HOT_SKETCH_WIDTH (2048)
+#define HOT_CANDIDATES CH_HOT_KEYS_MAX
+
+typedef struct CH_hot_keys {
+    uint32_t sample_rate;
+    uint32_t sketch[HOT_SKETCH_DEPTH][HOT_SKETCH_WIDTH];
+    /* hash << 32 | sampled count, so that pair is stored at once */
+    uint64_t candidates[HOT_CANDIDATES];
+} CH_HotKeys_t;
+
+static const uint32_t hot_sketch_mix[HOT_SKETCH_DEPTH] = {
+    0x9e3779b1, 0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f
 };
 
-#define DEFAULT_SERVERS_AMOUNT (8)
-ConsistentHash_ServerList_t *
-ConsistentHash_ServerList_new(ConsistentHash_t *ring)
+static CH_THREAD_LOCAL uint32_t thread_random_state = 0x2545f491;
+
+/* xorshift32, cheap randomness for sampling and spreading */
+static inline uint32_t
+thread_random(void)
 {
-    ConsistentHash_ServerList_t *servers;
-    do_calloc(&ring->config, &servers, 1);
-    servers->config = &ring->config;
-    do_calloc(&ring->config, &servers->list.buf, DEFAULT_SERVERS_AMOUNT);
-    servers->list.capa = DEFAULT_SERVERS_AMOUNT;
-    servers->by_name = TiredSet_new(&ring->config, ServerItem_name_as_handle,
-                                    name_hash, name_eq);
-    if (servers->config->use_handle == CH_USE_HANDLE) {
-        servers->by_handle = TiredSet_new(&ring->config, ServerItem_handle_as_handle,
-                                    ring->config.handle_hash, ring->config.handle_eq);
-    }
-    return servers;
+    uint32_t x = thread_random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    thread_random_state = x;
+    return x;
 }
 
-size_t
-ConsistentHash_ServerList_size(ConsistentHash_ServerList_t *servers)
-{
-    size_t size;
-    uint32_t i;
+/* lookups left till next sample, per thread */
+static CH_THREAD_LOCAL uint32_t hot_sample_countdown;
 
-    size = sizeof(*servers) +
-        TiredSet_size(servers->by_name) +
-        TiredSet_size(servers->by_handle) +
-        buf_size(servers->list);
-    for(i=0; i < servers->list.count; i++) {
-        size += ServerItem_size(servers->list.buf[i]);
+static void
+HotKeys_sample(CH_HotKeys_t *hot, uint32_t hash)
+{
+    uint32_t i, estimate = UINT32_MAX;
+    uint32_t min_count = UINT32_MAX, min_pos = 0;
+
+    for (i = 0; i < HOT_SKETCH_DEPTH; i++) {
+        uint32_t *cell = &hot->sketch[i][fmix_int32(hash, hot_sketch_mix[i]) & (HOT_SKETCH_WIDTH - 1)];
+        uint32_t count = relaxed_add(cell, 1);
+        if (count < estimate)
+            estimate = count;
     }
-    return size;
+    /* racing samplers may overwrite each other, that only loses a sample */
+    for (i = 0; i < HOT_CANDIDATES; i++) {
+        uint64_t candidate = relaxed_load(&hot->candidates[i]);
+        uint32_t count = (uint32_t)candidate;
+        if (count != 0 && (uint32_t)(candidate >> 32) == hash) {
+            relaxed_store(&hot->candidates[i], ((uint64_t)hash << 32) | estimate);
+            return;
+        }
+        if (count < min_count) {
+            min_count = count;
+            min_pos = i;
+        }
+    }
+    if (estimate > min_count)
+        relaxed_store(&hot->candidates[min_pos], ((uint64_t)hash << 32) | estimate);
 }
 
-static void
-ConsistentHash_ServerList_release(ConsistentHash_ServerList_t *servers)
+static inline void
+HotKeys_maybe_sample(CH_HotKeys_t *hot, uint32_t hash)
 {
-    int i;
-    if (servers->list.buf) {
-        for(i=0; i < servers->list.count; i++)
+    if (hot != NULL && hot_sample_countdown-- == 0) {
+        /* random gap averaging sample_rate (countdown g samples after g+1 lookups),
+         * so that periodic traffic is not aliased */
+        uint32_t rate = hot->sample_rate;
+        hot_sample_countdown = rate <= 1 ? 0 :
+            thread_random() % (rate <= UINT32_MAX / 2 ? 2 * rate - 1 : UINT32_MAX);
+        HotKeys_sample(hot, hash);
+    }
+}
+
+/* marked hot keys, open addressing table of atomically replaced entries */
+#define HOT_ENTRY_DELETED (1)
+typedef struct CH_hot_table {
+    uint32_t used;                          /* marked keys, lookups skip table when 0 */
+    uint64_t entries[CH_HOT_TABLE_SIZE];    /* hash << 32 | spread << 1 | mode, 0 is empty */
+    uint32_t turns[CH_HOT_TABLE_SIZE];      /* round robin positions */
+} CH_HotTable_t;
+
+#define hot_entry_hash(entry) ((uint32_t)((entry) >> 32))
+#define hot_entry_spread(entry) ((uint32_t)(entry) >> 1)
+#define hot_entry_mode(entry) ((CH_spread_e)((entry) & 1))
+#define hot_entry_live(entry) ((uint32_t)(entry) > HOT_ENTRY_DELETED)
+
+/* returns slot of hash or empty slot where probe stopped, -1 if neither */
+static int
+HotTable_find(CH_HotTable_t *table, uint32_t hash, uint64_t *out_entry)
+{
+    uint32_t i, pos = fmix_int32(hash, 0x9e3779b1) & (CH_HOT_TABLE_SIZE - 1);
+    for (i = 0; i < CH_HOT_TABLE_SIZE; i++) {
+        uint64_t entry = relaxed_load(&table->entries[pos]);
+        if (entry == 0 || (hot_entry_live(entry) && hot_entry_hash(entry) == hash)) {
+            *out_entry = entry;
+            return pos;
+        }
+        pos = (pos + 1) & (CH_HOT_TABLE_SIZE - 1);
+    }
+    return -1;
+}
+
+/* FAILOVER */
+
+/* replacement of point at index if its server fails */
+typedef struct CH_failover_entry {
+    uint32_t index;
+    Point_t  point;
+} CH_FailoverEntry_t;
+
+typedef struct CH_failover {
+    int     valid;   /* tables match continuum, nothing is patched yet */
+    int     patched; /* rebuild is pending */
+    struct {
+        uint32_t  capa;
+        uint32_t  count;
+        uint32_t *buf;
+    } start;         /* entries of server s are [start[s], start[s+1]) */
+    struct {
+        uint32_t  capa;
+        uint32_t  count;
+        CH_FailoverEntry_t *buf;
+    } entries;
+} CH_Failover_t;
+
+struct ConsistentHash {
+    CH_config_t    config;
+    ConsistentHash_ServerList_t servers;
+    uint32_t       alive_count;
+    uint32_t       visitable_count;
+    Continuum_t   *continuum;
+    CH_stats_t     stats;
+    CH_HotKeys_t  *hot_keys;
+    CH_HotTable_t  hot_table;
+    uint64_t       epoch;
+    struct ConsistentHash *previous;
+    CH_Failover_t  failover;
+    double         points_scale; /* applied by max_total_points */
+    /* dense arrays of ConsistentHash_lookup_view */
+    struct {
+        uint32_t      capa;
+        uint32_t      count;
+        uint8_t      *buf;
+    } view_alive;
+    struct {
+        uint32_t      capa;
+        uint32_t      count;
+        CH_handle_t  *buf;
+    } view_handles;
+};
+
+/**
+ * removing all points of server from sorted continuum, keys of its run of points
+ * between foreign points L and R go to the nearer of L and R.
+ * same is achieved in place by turning run's points into copies of L (value and server),
+ * so that lookup compares distances to L and R only, and order is kept.
+ * run crossing end of array turns into copies of L at the end and copies of R at the start.
+ */
+static void
+Failover_build(ConsistentHash_t *ring)
+{
+    CH_Failover_t *fo = &ring->failover;
+    Continuum_t *cont = ring->continuum;
+    Point_t *points = cont->points.buf;
+    uint32_t count = cont->points.count;
+    uint32_t servers = ring->servers.list.count;
+    uint32_t i, j, first, last, left, right, n;
+    uint32_t *start;
+
+    fo->valid = 0;
+    fo->patched = 0;
+    if (count == 0)
+        return;
+    /* run starts where previous point belongs to another server */
+    for (first = 0; first < count; first++)
+        if (points[first].server != points[(first + count - 1) % count].server)
+            break;
+    if (first == count) /* single server, its failure leaves nothing */
+        return;
+
+    ensure_capa(&ring->config, fo->start, servers + 1);
+    ensure_capa(&ring->config, fo->entries, count);
+    fo->start.count = servers + 1;
+    fo->entries.count = count;
+    start = fo->start.buf;
+    memset(start, 0, sizeof(uint32_t) * (servers + 1));
+    for (i = 0; i < count; i++)
+        start[points[i].server + 1]++;
+    for (i = 0; i < servers; i++)
+        start[i + 1] += start[i];
+
+    /* start[s] is used as fill cursor, and is restored afterwards */
+    for (n = 0, i = first; n < count; ) {
+        last = i;
+        while (n + 1 < count && points[(last + 1) % count].server == points[i].server) {
+            last = (last + 1) % count;
+            n++;
+        }
+        n++;
+        left = (i + count - 1) % count;
+        right = (last + 1) % count;
+        for (j = i; ; j = (j + 1) % count) {
+            CH_FailoverEntry_t *entry = &fo->entries.buf[start[points[j].server]++];
+            entry->index = j;
+            entry->point = j > left ? points[left] : points[right];
+            if (j == last)
+                break;
+        }
+        i = right;
+    }
+    for (i = servers; i > 0; i--)
+        start[i] = start[i - 1];
+    start[0] = 0;
+    fo->valid = 1;
+}
+
+static int
+Failover_apply(ConsistentHash_t *ring, uint32_t server)
+{
+    CH_Failover_t *fo = &ring->failover;
+    CH_FailoverEntry_t *entry, *end;
+    Point_t *points = ring->continuum->points.buf;
+
+    if (!fo->valid || server + 1 >= fo->start.count)
+        return 0;
+    entry = fo->entries.buf + fo->start.buf[server];
+    end = fo->entries.buf + fo->start.buf[server + 1];
+    for (; entry < end; entry++)
+        points[entry->index] = entry->point;
+    Continuum_fill_hash(ring->continuum);
+    /* other servers' replacements could refer to patched points */
+    fo->valid = 0;
+    fo->patched = 1;
+    return 1;
+}
+
+static void
+Failover_free(ConsistentHash_t *ring)
+{
+    array_clean(&ring->config, ring->failover.start);
+    array_clean(&ring->config, ring->failover.entries);
+    ring->failover.valid = 0;
+}
+
+#define DEFAULT_SERVERS_AMOUNT (8)
+ConsistentHash_ServerList_t *
+ConsistentHash_ServerList_new(ConsistentHash_t *ring)
+{
+    ConsistentHash_ServerList_t *servers;
+    do_calloc(&ring->config, &servers, 1);
+    servers->config = &ring->config;
+    do_calloc(&ring->config, &servers->list.buf, DEFAULT_SERVERS_AMOUNT);
+    servers->list.capa = DEFAULT_SERVERS_AMOUNT;
+    servers->by_name = SwissSet_new(&ring->config, ServerItem_name_as_handle,
+                                    name_hash, name_eq);
+    if (servers->config->use_handle == CH_USE_HANDLE) {
+        servers->by_handle = SwissSet_new(&ring->config, ServerItem_handle_as_handle,
+                                    ring->config.handle_hash, ring->config.handle_eq);
+    }
+    return servers;
+}
+
+size_t
+ConsistentHash_ServerList_size(ConsistentHash_ServerList_t *servers)
+{
+    size_t size;
+    uint32_t i;
+
+    size = sizeof(*servers) +
+        SwissSet_size(servers->by_name) +
+        SwissSet_size(servers->by_handle) +
+        buf_size(servers->list) +
+        buf_size(servers->carry);
+    for(i=0; i < servers->list.count; i++) {
+        size += ServerItem_size(servers->list.buf[i]);
+    }
+    return size;
+}
+
+static void
+ConsistentHash_ServerList_release(ConsistentHash_ServerList_t *servers)
+{
+    int i;
+    if (servers->list.buf) {
+        for(i=0; i < servers->list.count; i++)
             ServerItem_free(servers->config, servers->list.buf[i]);
         array_clean(servers->config, servers->list);
     }
-    TiredSet_free(servers->by_name);
-    TiredSet_free(servers->by_handle);
+    SwissSet_free(servers->by_name);
+    SwissSet_free(servers->by_handle);
     servers->by_name = NULL;
     servers->by_handle = NULL;
+    array_clean(servers->config, servers->carry);
+    servers->load_line = 0;
+    servers->load_error = 0;
 }
 
 void
@@ -1106,16 +2532,17 @@ ConsistentHash_ServerList_add(ConsistentHash_ServerList_t *servers,
     CH_ServerItem_t *server;
     server = ServerItem_new(servers->config, name, name_len,
                             weight, alive, handle);
+    server->index = servers->list.count;
     append_to(servers->config, servers->list, server);
-    if (TiredSet_add(servers->by_name, server) != server) {
+    if (SwissSet_add(servers->by_name, server) != server) {
         servers->list.count--;
         ServerItem_free(servers->config, server);
         return CH_NAME_EXISTS;
     }
     if (servers->config->use_handle == CH_USE_HANDLE &&
-            TiredSet_add(servers->by_handle, server) != server) {
+            SwissSet_add(servers->by_handle, server) != server) {
         servers->list.count--;
-        TiredSet_delete(servers->by_name, ServerItem_name_as_handle(server));
+        SwissSet_delete(servers->by_name, ServerItem_name_as_handle(server));
         ServerItem_free(servers->config, server);
         return CH_HANDLE_EXISTS;
     }
@@ -1246,6 +2673,11 @@ ConsistentHash_new(CH_config_t config)
     ring->config = config;
     ring->servers.config = &ring->config;
     ring->continuum = Continuum_new(&ring->config);
+    ring->points_scale = 1;
+    if (config.point_cache)
+        PointCache_ref(config.point_cache);
+    if (config.hot_keys_sample_rate)
+        ConsistentHash_track_hot_keys(ring, config.hot_keys_sample_rate);
     return ring;
 }
 
@@ -1255,223 +2687,1887 @@ ConsistentHash_free(ConsistentHash_t *ring)
     if (ring) {
         Continuum_free(ring->continuum);
         ConsistentHash_ServerList_release(&ring->servers);
+        do_free(&ring->config, &ring->hot_keys);
+        ConsistentHash_free(ring->previous);
+        Failover_free(ring);
+        array_clean(&ring->config, ring->view_alive);
+        array_clean(&ring->config, ring->view_handles);
+        ConsistentHash_PointCache_free(ring->config.point_cache);
         do_free(&ring->config, &ring);
     }
 }
 
-size_t
-ConsistentHash_size(ConsistentHash_t *ring)
+size_t
+ConsistentHash_size(ConsistentHash_t *ring)
+{
+    return sizeof(*ring) - sizeof(ring->servers) +
+        ConsistentHash_ServerList_size(&ring->servers) +
+        Continuum_size(ring->continuum) +
+        (ring->hot_keys ? sizeof(*ring->hot_keys) : 0) +
+        (ring->previous ? ConsistentHash_size(ring->previous) : 0) +
+        buf_size(ring->failover.start) + buf_size(ring->failover.entries) +
+        buf_size(ring->view_alive) + buf_size(ring->view_handles);
+}
+
+uint32_t
+ConsistentHash_replicas(ConsistentHash_t *ring)
+{
+    return ring->continuum->replicas_ready ? ring->continuum->replicas.count : 0;
+}
+
+uint32_t
+ConsistentHash_alive_count(ConsistentHash_t *ring)
+{
+    return ring->alive_count;
+}
+
+CH_use_handle_e
+ConsistentHash_use_handle(ConsistentHash_t *ring)
+{
+    return ring->config.use_handle;
+}
+
+void
+ConsistentHash_clean(ConsistentHash_t *ring)
+{
+    Continuum_clean(ring->continuum);
+    ConsistentHash_ServerList_release(&ring->servers);
+    ring->alive_count = 0;
+    ConsistentHash_retire_previous(ring);
+    Failover_free(ring);
+}
+
+void
+ConsistentHash_collect_stats(ConsistentHash_t *ring, int enable)
+{
+    ring->config.collect_stats = enable;
+}
+
+void
+ConsistentHash_stats(ConsistentHash_t *ring, CH_stats_t *stats)
+{
+    stats->lookups = stat_get(ring, lookups);
+    stats->probes = stat_get(ring, probes);
+    stats->collisions = stat_get(ring, collisions);
+    stats->rebuilds = stat_get(ring, rebuilds);
+    stats->rebuild_ns = stat_get(ring, rebuild_ns);
+    stats->last_rebuild_ns = stat_get(ring, last_rebuild_ns);
+    stats->points_generated = stat_get(ring, points_generated);
+    stats->points_reused = stat_get(ring, points_reused);
+}
+
+void
+ConsistentHash_points_budget(ConsistentHash_t *ring, uint32_t max_total_points, uint32_t min_points_per_server)
+{
+    ring->config.max_total_points = max_total_points;
+    ring->config.min_points_per_server = min_points_per_server;
+}
+
+CH_PointsStats_t
+ConsistentHash_points_stats(ConsistentHash_t *ring)
+{
+    CH_PointsStats_t stats = {0, 0, 1, 0, 0, 0};
+    ConsistentHash_ServerList_t *list = &ring->servers;
+    CH_ServerItem_t *server;
+    double expected_total = 0, error;
+    uint32_t i;
+
+    stats.points = ring->continuum->points.count;
+    stats.budget = ring->config.max_total_points;
+    stats.scale = ring->points_scale;
+    for (i = 0; i < list->list.count; i++) {
+        server = list->list.buf[i];
+        if (server_item_alive(server) == CH_DEAD || server->used_points == 0)
+            continue;
+        expected_total += (double)server->weight * server->adjust * server->ramp;
+        if (stats.min_points == 0 || server->used_points < stats.min_points)
+            stats.min_points = server->used_points;
+        if (server->used_points > stats.max_points)
+            stats.max_points = server->used_points;
+    }
+    if (stats.points == 0 || expected_total == 0)
+        return stats;
+    for (i = 0; i < list->list.count; i++) {
+        server = list->list.buf[i];
+        if (server_item_alive(server) == CH_DEAD || server->used_points == 0)
+            continue;
+        error = ((double)server->used_points / stats.points) /
+                ((double)server->weight * server->adjust * server->ramp / expected_total) - 1;
+        if (fabs(error) > stats.max_weight_error)
+            stats.max_weight_error = fabs(error);
+    }
+    return stats;
+}
+
+void
+ConsistentHash_stats_reset(ConsistentHash_t *ring)
+{
+    do_memzero(&ring->stats, 1);
+}
+
+void
+ConsistentHash_track_hot_keys(ConsistentHash_t *ring, uint32_t sample_rate)
+{
+    ring->config.hot_keys_sample_rate = sample_rate;
+    if (sample_rate == 0) {
+        do_free(&ring->config, &ring->hot_keys);
+        return;
+    }
+    if (ring->hot_keys == NULL)
+        do_calloc(&ring->config, &ring->hot_keys, 1);
+    ring->hot_keys->sample_rate = sample_rate;
+}
+
+void
+ConsistentHash_hot_keys_reset(ConsistentHash_t *ring)
+{
+    if (ring->hot_keys) {
+        memset(ring->hot_keys->sketch, 0, sizeof(ring->hot_keys->sketch));
+        memset(ring->hot_keys->candidates, 0, sizeof(ring->hot_keys->candidates));
+    }
+}
+
+uint32_t
+ConsistentHash_hot_keys(ConsistentHash_t *ring, CH_HotKey_t *out, uint32_t n)
+{
+    uint32_t i, j, found = 0;
+    CH_HotKey_t key;
+
+    if (ring->hot_keys == NULL || n == 0)
+        return 0;
+    for (i = 0; i < HOT_CANDIDATES; i++) {
+        uint64_t candidate = relaxed_load(&ring->hot_keys->candidates[i]);
+        if ((uint32_t)candidate == 0)
+            continue;
+        key.hash = (uint32_t)(candidate >> 32);
+        key.count = (uint64_t)(uint32_t)candidate * ring->hot_keys->sample_rate;
+        if (!Continuum_find_server(ring->continuum, key.hash, &key.server))
+            key.server = CH_NO_SERVER;
+        /* insertion into sorted top n */
+        if (found < n)
+            j = found++;
+        else if (out[n-1].count < key.count)
+            j = n - 1;
+        else
+            continue;
+        for (; j > 0 && out[j-1].count < key.count; j--)
+            out[j] = out[j-1];
+        out[j] = key;
+    }
+    return found;
+}
+
+static void
+sort_weights(uint32_t *weights, uint32_t count)
+{
+    if (count < 7) { /* insertion sort */
+        uint32_t i, j;
+        for(i = 1; i < count; i++) {
+            uint32_t cur = weights[i];
+            if (cur < weights[i-1]) {
+                weights[i] = weights[i-1];
+                j = i - 1;
+                while(j && cur < weights[j - 1]) {
+                    weights[j] = weights[j - 1];
+                    j--;
+                }
+                weights[j] = cur;
+            }
+        }
+    }
+    else { /* quick sort with respect to repetative items */
+        uint32_t *lesser, *equal, *more;
+        uint32_t one_third = count / 3;
+        uint32_t samples[4] = {weights[0], weights[one_third], weights[one_third*2], weights[count-1]};
+        uint32_t median, tmp;
+        uint32_t i = count;
+
+        sort_weights(samples, 4);
+        median = samples[2];
+
+        lesser = weights;
+        for(; i && *lesser < median; i--, lesser++) {}
+
+        equal = lesser;
+        for(; i && *equal == median; i--, equal++) {}
+
+        if (i) {
+            more = equal;
+            for(; i; i--, more++) {
+                if (*more < median) {
+                    tmp = *more;
+                    *more = *equal;
+                    *equal = *lesser;
+                    *lesser = tmp;
+                    lesser++;
+                    equal++;
+                }
+                else if (*more == median) {
+                    tmp = *more;
+                    *more = *equal;
+                    *equal = tmp;
+                }
+            }
+        }
+
+        sort_weights(weights, lesser - weights);
+        sort_weights(equal, count - (equal - weights));
+    }
+}
+
+/* points of server wanted by its weight, rebalance and ramp */
+static inline double
+server_wanted_points(ConsistentHash_t *ring, CH_ServerItem_t *server, uint32_t median)
+{
+    float part;
+    if (server_item_alive(server) == CH_DEAD)
+        return 0;
+    /* float, as it always was, so that, upgrade does not move points */
+    part = ((float)server->weight) / median;
+    return ring->config.points_per_server * part * server->adjust * server->ramp;
+}
+
+/* scale of points fitting continuum into config.max_total_points: servers kept at minimum
+ * take their points out of the budget, the rest is scaled into what is left.
+ * minimum is lowered to budget / servers, so that minimums alone fit the budget.
+ * scale only decreases from step to step, so that floored servers stay floored. */
+static double
+budget_scale(ConsistentHash_t *ring, uint32_t median, uint32_t *min_points_out)
+{
+    ConsistentHash_ServerList_t *list = &ring->servers;
+    double   wanted, total = 0, free, floored, scale, budget = ring->config.max_total_points;
+    uint32_t i, count = 0, last_count = 0, min_points;
+
+    for(i = 0; i < list->list.count; i++) {
+        wanted = server_wanted_points(ring, list->list.buf[i], median);
+        total += wanted;
+        count += wanted > 0;
+    }
+    min_points = ring->config.min_points_per_server ? ring->config.min_points_per_server : 1;
+    if (count > 0 && min_points > budget / count)
+        min_points = budget / count > 1 ? (uint32_t)(budget / count) : 1;
+    *min_points_out = min_points;
+    if (total <= budget)
+        return 1;
+    scale = budget / total;
+
+    for (;;) {
+        free = floored = 0;
+        count = 0;
+        for(i = 0; i < list->list.count; i++) {
+            wanted = server_wanted_points(ring, list->list.buf[i], median);
+            if (wanted == 0)
+                continue;
+            if ((uint32_t)(wanted * scale) < min_points) {
+                floored += wanted < min_points ? (uint32_t)wanted : min_points;
+                count++;
+            } else
+                free += wanted;
+        }
+        if (count == last_count || free == 0)
+            return scale;
+        if (floored >= budget) /* every server is at minimum */
+            return 0;
+        last_count = count;
+        scale = (budget - floored) / free;
+    }
+}
+
+static void
+ConsistentHash_update_continuum(ConsistentHash_t *ring)
+{
+    ConsistentHash_ServerList_t *list;
+    CH_ServerItem_t *server;
+    uint32_t i;
+    uint32_t median, used_points, reused, min_points;
+    CH_aliveness_e alive;
+    double   wanted, scale = 1;
+    struct {
+        uint32_t  capa;
+        uint32_t  count;
+        uint32_t *buf;
+    } weights = {0, 0, 0};
+    CH_RebuildInfo_t info = {0, 0, 0, 0, 0};
+    int timed = ring->config.collect_stats || ring->config.on_rebuild;
+    uint64_t started = timed ? clock_ns() : 0;
+
+    ring->alive_count = 0;
+    ring->visitable_count = 0;
+    list = &ring->servers;
+
+    for(i = 0; i < list->list.count; i++) {
+        server = list->list.buf[i];
+        if (server_item_alive(server) != CH_DEAD)
+            append_to(&ring->config, weights, server->weight);
+    }
+
+    Continuum_clean(ring->continuum);
+
+    if (weights.count > 0) {
+        sort_weights(weights.buf, weights.count);
+
+        median = weights.buf[weights.count / 2];
+        array_clean(&ring->config, weights);
+
+        min_points = ring->config.min_points_per_server ? ring->config.min_points_per_server : 1;
+        if (ring->config.max_total_points)
+            scale = budget_scale(ring, median, &min_points);
+
+        for(i = 0; i < list->list.count; i++) {
+            server = list->list.buf[i];
+            alive = server_item_alive(server);
+            wanted = server_wanted_points(ring, server, median);
+            used_points = wanted * scale;
+            /* scaling keeps minimum, but does not raise server above its own wish */
+            if (scale < 1 && used_points < min_points)
+                used_points = wanted < min_points ? (uint32_t)wanted : min_points;
+            /* server without points is never found, so that, iterator should not wait for it */
+            if (used_points > 0) {
+                ring->visitable_count++;
+                if (alive == CH_ALIVE)
+                    ring->alive_count++;
+            }
+            info.points_generated += ServerItem_set_used_points(&ring->config, server, used_points, &reused);
+            info.points_reused += reused;
+            Continuum_add_server(ring->continuum, i, ServerItem_points(server)->buf, used_points);
+        }
+        Continuum_sort(ring->continuum);
+    }
+
+    ring->points_scale = scale;
+
+    if (ring->config.failover_tables)
+        Failover_build(ring);
+    else
+        ring->failover.valid = ring->failover.patched = 0;
+
+    if (timed) {
+        info.duration_ns = clock_ns() - started;
+        info.points = ring->continuum->points.count;
+        info.alive = ring->alive_count;
+        stat_add(ring, rebuilds, 1);
+        stat_add(ring, rebuild_ns, info.duration_ns);
+        stat_add(ring, points_generated, info.points_generated);
+        stat_add(ring, points_reused, info.points_reused);
+        stat_set(ring, last_rebuild_ns, info.duration_ns);
+        if (ring->config.on_rebuild)
+            ring->config.on_rebuild(ring->config.ctx, ring, &info);
+    }
+}
+
+ConsistentHash_ServerList_t *
+ConsistentHash_ServerList_dup(ConsistentHash_t *ring)
+{
+    return ConsistentHash_ServerList_dup_from(ring, ring);
+}
+
+ConsistentHash_ServerList_t *
+ConsistentHash_ServerList_dup_from(ConsistentHash_t *ring, ConsistentHash_t *source)
+{
+    ConsistentHash_ServerList_t *list = ConsistentHash_ServerList_new(ring);
+    uint32_t i;
+    for(i = 0; i < source->servers.list.count; i++) {
+        CH_ServerItem_t *server = source->servers.list.buf[i];
+        if (ConsistentHash_ServerList_add(list, server->name->str, server->name->size,
+                server->weight, server->alive_as_configured, server->handle) == CH_ADD_OK)
+            ServerItem_copy_state(list->list.buf[list->list.count - 1], server);
+    }
+    return list;
+}
+
+static inline int
+load_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* takes next field of line, returns 0 if there is no more */
+static int
+load_field(const char **pos, const char *end, const char **field, size_t *field_len)
+{
+    const char *p = *pos;
+    while (p < end && load_is_space(*p)) p++;
+    if (p == end) return 0;
+    *field = p;
+    while (p < end && !load_is_space(*p)) p++;
+    *field_len = p - *field;
+    *pos = p;
+    return 1;
+}
+
+static int
+load_number(const char *str, size_t len, uint64_t max, uint64_t *out)
+{
+    uint64_t n = 0;
+    size_t i;
+    if (len == 0 || len > 20) return 0;
+    for (i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9') return 0;
+        if (n > (max - (str[i] - '0')) / 10) return 0;
+        n = n * 10 + (str[i] - '0');
+    }
+    *out = n;
+    return 1;
+}
+
+#define field_is(str, len, lit) ((len) == sizeof(lit) - 1 && memcmp((str), (lit), (len)) == 0)
+
+/* returns 0 if line is malformed */
+static int
+load_line(ConsistentHash_ServerList_t *list, const char *line, size_t len)
+{
+    const char *pos = line, *end = line + len;
+    const char *name, *field;
+    size_t name_len, field_len;
+    uint64_t weight, handle = 0;
+    CH_aliveness_e alive;
+
+    if (!load_field(&pos, end, &name, &name_len) || name[0] == '#')
+        return 1; /* empty line or comment */
+
+    if (!load_field(&pos, end, &field, &field_len) ||
+            !load_number(field, field_len, UINT32_MAX, &weight))
+        return 0;
+
+    if (!load_field(&pos, end, &field, &field_len))
+        return 0;
+    if (field_is(field, field_len, "alive"))
+        alive = CH_ALIVE;
+    else if (field_is(field, field_len, "dead"))
+        alive = CH_DEAD;
+    else if (field_is(field, field_len, "down"))
+        alive = CH_DOWN;
+    else
+        return 0;
+
+    if (load_field(&pos, end, &field, &field_len)) {
+        if (!load_number(field, field_len, UINT64_MAX, &handle))
+            return 0;
+    }
+    else if (list->config->use_handle == CH_USE_HANDLE) {
+        handle = ConsistentHash_Helper_parse_ipv4_with_port(name, name_len, 0);
+        if (handle == 0)
+            return 0;
+    }
+    if (load_field(&pos, end, &field, &field_len))
+        return 0;
+
+    return ConsistentHash_ServerList_add(list, name, name_len, (uint32_t)weight, alive, handle) != CH_HANDLE_EXISTS;
+}
+#undef field_is
+
+static void
+load_next_line(ConsistentHash_ServerList_t *list, const char *line, size_t len)
+{
+    list->load_line++;
+    if (!load_line(list, line, len))
+        list->load_error = list->load_line;
+}
+
+uint32_t
+ConsistentHash_ServerList_load(ConsistentHash_ServerList_t *list, const char *buf, size_t len)
+{
+    const char *end = buf + len;
+    const char *eol;
+
+    if (list->load_error)
+        return list->load_error;
+
+    if (len == 0) {
+        if (list->carry.count)
+            load_next_line(list, list->carry.buf, list->carry.count);
+        array_clean(list->config, list->carry);
+        return list->load_error;
+    }
+
+    if (list->carry.count) {
+        eol = memchr(buf, '\n', len);
+        if (eol == NULL)
+            eol = end;
+        ensure_capa(list->config, list->carry, list->carry.count + (eol - buf));
+        memcpy(list->carry.buf + list->carry.count, buf, eol - buf);
+        list->carry.count += eol - buf;
+        if (eol == end)
+            return 0;
+        load_next_line(list, list->carry.buf, list->carry.count);
+        list->carry.count = 0;
+        buf = eol + 1;
+    }
+
+    while (!list->load_error && buf < end) {
+        eol = memchr(buf, '\n', end - buf);
+        if (eol == NULL) {
+            ensure_capa(list->config, list->carry, end - buf);
+            memcpy(list->carry.buf, buf, end - buf);
+            list->carry.count = end - buf;
+            break;
+        }
+        load_next_line(list, buf, eol - buf);
+        buf = eol + 1;
+    }
+    return list->load_error;
+}
+
+static inline CH_ServerItem_t *
+find_by_name(ConsistentHash_ServerList_t *servers, const char *name, size_t name_len)
+{
+    CH_NameKey_t key = { name_len, name };
+    return SwissSet_get(servers->by_name, name_key_handle(&key));
+}
+
+/* whether some alive server keeps its points through exchange, otherwise ramping new ones
+ * from zero would leave ring without points till first ramp step */
+static int
+exchange_keeps_serving(ConsistentHash_ServerList_t *old_list, ConsistentHash_ServerList_t *new_list)
+{
+    uint32_t i;
+    for(i = 0; i < old_list->list.count; i++) {
+        CH_ServerItem_t *server = old_list->list.buf[i];
+        if (server->used_points > 0 && server_item_alive(server) == CH_ALIVE &&
+                SwissSet_get(new_list->by_name, ServerItem_name_as_handle(server)))
+            return 1;
+    }
+    return 0;
+}
+
+static void
+exchange_lists(ConsistentHash_t *ring, ConsistentHash_ServerList_t *list)
+{
+    ConsistentHash_ServerList_t tmp, *new_list;
+    uint32_t i;
+
+    tmp = ring->servers;
+    ring->servers = *list;
+    *list = tmp;
+    new_list = &ring->servers;
+
+    if (tmp.list.count) { /* copy generated points */
+        if (ring->config.ramp_steps && exchange_keeps_serving(&tmp, new_list)) {
+            /* new servers start cold, known ones get their state back below */
+            for(i = 0; i < new_list->list.count; i++) {
+                new_list->list.buf[i]->ramp = 0;
+                new_list->list.buf[i]->ramp_target = 1;
+                new_list->list.buf[i]->ramp_step = 1.0f / ring->config.ramp_steps;
+            }
+        }
+        for(i = 0; i < tmp.list.count; i++) {
+            CH_ServerItem_t *new_item;
+            new_item = SwissSet_get(new_list->by_name, ServerItem_name_as_handle(tmp.list.buf[i]));
+            if (new_item)
+                ServerItem_steal_points_and_alive(new_item, tmp.list.buf[i]);
+        }
+    }
+}
+
+static void keep_previous(ConsistentHash_t *ring);
+
+void
+ConsistentHash_exchange_server_list(ConsistentHash_t *ring, ConsistentHash_ServerList_t *list)
+{
+    keep_previous(ring);
+    exchange_lists(ring, list);
+    ConsistentHash_update_continuum(ring);
+}
+
+void
+ConsistentHash_apply(ConsistentHash_t *ring, ConsistentHash_ServerList_t *list,
+                     ConsistentHash_AliveByName_t *alive)
+{
+    uint32_t i;
+    CH_ServerItem_t *server;
+
+    if (list == NULL && alive == NULL) return;
+
+    if (list != NULL) {
+        keep_previous(ring);
+        exchange_lists(ring, list);
+    }
+
+    if (alive != NULL && ring->servers.by_name != NULL) {
+        for(i = 0; i < alive->list.count; i++) {
+            server = find_by_name(&ring->servers, alive->list.buf[i].name->str, alive->list.buf[i].name->size);
+            if (server != NULL) {
+                server->alive_as_updated = alive->list.buf[i].alive;
+            }
+        }
+    }
+
+    ConsistentHash_update_continuum(ring);
+}
+
+void
+ConsistentHash_refresh_alive_by_name(ConsistentHash_t *ring, ConsistentHash_AliveByName_t *list,
+                                   CH_aliveness_e default_alive)
+{
+    uint32_t i;
+    CH_ServerItem_t *server;
+    ConsistentHash_ServerList_t *servers = &ring->servers;
+
+    if (servers->list.count == 0) return;
+
+    for(i = 0; i < servers->list.count; i++) {
+        servers->list.buf[i]->alive_as_updated = default_alive;
+    }
+
+    if (list != NULL) {
+        for(i = 0; i < list->list.count; i++) {
+            server = find_by_name(servers, list->list.buf[i].name->str, list->list.buf[i].name->size);
+            if (server != NULL) {
+                server->alive_as_updated = list->list.buf[i].alive;
+            }
+        }
+    }
+
+    ConsistentHash_update_continuum(ring);
+}
+
+void
+ConsistentHash_refresh_alive_by_handle(ConsistentHash_t *ring, ConsistentHash_AliveByHandle_t *list,
+                                     CH_aliveness_e default_alive)
+{
+    uint32_t i;
+    CH_ServerItem_t *server;
+    ConsistentHash_ServerList_t *servers = &ring->servers;
+
+    if (servers->list.count == 0) return;
+
+    for(i = 0; i < servers->list.count; i++) {
+        servers->list.buf[i]->alive_as_updated = default_alive;
+    }
+
+    if (list != NULL) {
+        for(i = 0; i < list->list.count; i++) {
+            server = SwissSet_get(servers->by_handle, list->list.buf[i].handle);
+            if (server != NULL) {
+                server->alive_as_updated = list->list.buf[i].alive;
+            }
+        }
+    }
+
+    ConsistentHash_update_continuum(ring);
+}
+
+/* resulting aliveness of server is changed, returns 1 if continuum should be rebuilt */
+static int
+update_server_alive(ConsistentHash_t *ring, CH_ServerItem_t *server, CH_aliveness_e alive, uint32_t *changed)
+{
+    CH_aliveness_e was = server_item_alive(server);
+    CH_aliveness_e now;
+
+    server->alive_as_updated = alive;
+    now = server_item_alive(server);
+    if (was == now)
+        return 0;
+    (*changed)++;
+    if ((was == CH_DEAD) != (now == CH_DEAD))
+        return 1;
+    /* CH_ALIVE <=> CH_DOWN: points are the same, only counter is changed */
+    if (server->used_points == 0)
+        return 0;
+    if (was == CH_ALIVE)
+        ring->alive_count--;
+    else if (now == CH_ALIVE)
+        ring->alive_count++;
+    return 0;
+}
+
+int
+ConsistentHash_update_by_name(ConsistentHash_t *ring, const CH_NameStatus_t *statuses, size_t count,
+                              uint32_t *out_changed)
+{
+    size_t i;
+    uint32_t changed = 0;
+    int rebuild = 0;
+    CH_ServerItem_t *server;
+
+    if (ring->servers.by_name != NULL) {
+        for(i = 0; i < count; i++) {
+            server = find_by_name(&ring->servers, statuses[i].name, statuses[i].name_len);
+            if (server != NULL)
+                rebuild |= update_server_alive(ring, server, statuses[i].alive, &changed);
+        }
+    }
+    if (rebuild)
+        ConsistentHash_update_continuum(ring);
+    if (out_changed)
+        *out_changed = changed;
+    return rebuild;
+}
+
+int
+ConsistentHash_update_by_handle(ConsistentHash_t *ring, const CH_HandleStatus_t *statuses, size_t count,
+                                uint32_t *out_changed)
+{
+    size_t i;
+    uint32_t changed = 0;
+    int rebuild = 0;
+    CH_ServerItem_t *server;
+
+    if (ring->servers.by_handle != NULL) {
+        for(i = 0; i < count; i++) {
+            server = SwissSet_get(ring->servers.by_handle, statuses[i].handle);
+            if (server != NULL)
+                rebuild |= update_server_alive(ring, server, statuses[i].alive, &changed);
+        }
+    }
+    if (rebuild)
+        ConsistentHash_update_continuum(ring);
+    if (out_changed)
+        *out_changed = changed;
+    return rebuild;
+}
+
+/* HOT KEYS FAN-OUT */
+
+int
+ConsistentHash_mark_hot(ConsistentHash_t *ring, uint32_t hash, uint32_t spread, CH_spread_e mode)
+{
+    CH_HotTable_t *table = &ring->hot_table;
+    uint64_t entry;
+    int pos = HotTable_find(table, hash, &entry);
+
+    if (spread <= 1) {
+        if (pos >= 0 && entry != 0) {
+            relaxed_store(&table->entries[pos], (uint64_t)HOT_ENTRY_DELETED);
+            relaxed_add(&table->used, -1);
+        }
+        return 1;
+    }
+    if (spread > 0x7fffffff)
+        spread = 0x7fffffff;
+    if (pos < 0 || entry == 0) {
+        /* new key takes first deleted slot, or empty slot where probe stopped */
+        uint32_t i, free_pos = fmix_int32(hash, 0x9e3779b1) & (CH_HOT_TABLE_SIZE - 1);
+        for (i = 0; i < CH_HOT_TABLE_SIZE; i++) {
+            entry = relaxed_load(&table->entries[free_pos]);
+            if (!hot_entry_live(entry))
+                break;
+            free_pos = (free_pos + 1) & (CH_HOT_TABLE_SIZE - 1);
+        }
+        if (i == CH_HOT_TABLE_SIZE)
+            return 0;
+        pos = free_pos;
+        relaxed_add(&table->used, 1);
+    }
+    relaxed_store(&table->entries[pos], ((uint64_t)hash << 32) | (spread << 1) | (uint32_t)mode);
+    return 1;
+}
+
+void
+ConsistentHash_report_load(ConsistentHash_t *ring, uint32_t server, uint32_t load)
+{
+    if (server < ring->servers.list.count)
+        relaxed_store(&ring->servers.list.buf[server]->load, load);
+}
+
+/* REBALANCE */
+
+/* fraction of keys moved when adjust of every server goes part of the way to desired one:
+ * half the sum of share changes, as keys move only from shrunk servers to grown ones */
+static double
+rebalance_moved(ConsistentHash_ServerList_t *list, const float *desired, double part, double total_points)
+{
+    CH_ServerItem_t *server;
+    double new_total = 0, moved = 0, points;
+    uint32_t i;
+
+    for (i = 0; i < list->list.count; i++) {
+        server = list->list.buf[i];
+        new_total += server->used_points * (1 + (desired[i] / server->adjust - 1) * part);
+    }
+    if (new_total <= 0)
+        return 0;
+    for (i = 0; i < list->list.count; i++) {
+        server = list->list.buf[i];
+        points = server->used_points * (1 + (desired[i] / server->adjust - 1) * part);
+        moved += fabs(points / new_total - server->used_points / total_points);
+    }
+    return moved / 2;
+}
+
+double
+ConsistentHash_rebalance(ConsistentHash_t *ring, const double *loads, double max_movement)
+{
+    ConsistentHash_ServerList_t *list = &ring->servers;
+    CH_ServerItem_t *server;
+    double total_load = 0, total_weight = 0, total_points = 0;
+    double current = 0, wanted = 0, moved, part = 1;
+    float *desired;
+    uint32_t i;
+    int attempts;
+
+    if (list->list.count == 0)
+        return 0;
+
+    for (i = 0; i < list->list.count; i++) {
+        server = list->list.buf[i];
+        if (server_item_alive(server) != CH_DEAD)
+            total_points += server->used_points;
+        if (server_item_alive(server) == CH_ALIVE && loads[i] >= 0) {
+            total_load += loads[i];
+            total_weight += server->weight;
+        }
+    }
+    if (total_load <= 0 || total_weight <= 0 || total_points <= 0)
+        return 0;
+
+    do_malloc(&ring->config, &desired, list->list.count);
+    for (i = 0; i < list->list.count; i++) {
+        double expected, measured, adjust;
+        server = list->list.buf[i];
+        desired[i] = server->adjust;
+        if (server_item_alive(server) != CH_ALIVE || loads[i] < 0)
+            continue;
+        expected = server->weight / total_weight;
+        measured = loads[i] / total_load;
+        adjust = measured > 0 ? server->adjust * expected / measured : CH_MAX_ADJUST;
+        if (adjust < CH_MIN_ADJUST) adjust = CH_MIN_ADJUST;
+        if (adjust > CH_MAX_ADJUST) adjust = CH_MAX_ADJUST;
+        desired[i] = adjust;
+        current += (double)server->weight * server->ramp * server->adjust;
+    }
+    /* measured servers keep their total points, so that continuum does not grow from call to call;
+     * clamping breaks the total, so it is restored few times */
+    for (attempts = 0; attempts < 8; attempts++) {
+        for (i = 0, wanted = 0; i < list->list.count; i++) {
+            server = list->list.buf[i];
+            if (server_item_alive(server) == CH_ALIVE && loads[i] >= 0)
+                wanted += (double)server->weight * server->ramp * desired[i];
+        }
+        if (wanted <= 0 || fabs(wanted / current - 1) < 1e-4)
+            break;
+        for (i = 0; i < list->list.count; i++) {
+            server = list->list.buf[i];
+            if (server_item_alive(server) != CH_ALIVE || loads[i] < 0)
+                continue;
+            desired[i] *= current / wanted;
+            if (desired[i] < CH_MIN_ADJUST) desired[i] = CH_MIN_ADJUST;
+            if (desired[i] > CH_MAX_ADJUST) desired[i] = CH_MAX_ADJUST;
+        }
+    }
+
+    if (max_movement < 0)
+        max_movement = 0;
+    moved = rebalance_moved(list, desired, 1, total_points);
+    if (moved > max_movement) {
+        /* movement grows with part monotonically: largest part fitting into max_movement */
+        double low = 0, high = 1, tried;
+        for (attempts = 0; attempts < 30; attempts++) {
+            part = (low + high) / 2;
+            tried = rebalance_moved(list, desired, part, total_points);
+            if (tried > max_movement)
+                high = part;
+            else
+                low = part;
+        }
+        part = low;
+        moved = rebalance_moved(list, desired, part, total_points);
+    }
+    if (moved > 0) {
+        for (i = 0; i < list->list.count; i++) {
+            server = list->list.buf[i];
+            server->adjust += (desired[i] - server->adjust) * part;
+        }
+        ConsistentHash_update_continuum(ring);
+    }
+    do_free(&ring->config, &desired);
+    return moved;
+}
+
+double
+ConsistentHash_server_adjust(ConsistentHash_t *ring, uint32_t server)
+{
+    if (server >= ring->servers.list.count)
+        return 1;
+    return ring->servers.list.buf[server]->adjust;
+}
+
+void
+ConsistentHash_reset_adjust(ConsistentHash_t *ring)
+{
+    uint32_t i;
+    for (i = 0; i < ring->servers.list.count; i++)
+        ring->servers.list.buf[i]->adjust = 1;
+    ConsistentHash_update_continuum(ring);
+}
+
+/* RAMP */
+
+int
+ConsistentHash_ramp(ConsistentHash_t *ring, uint32_t server, double to, uint32_t steps)
+{
+    CH_ServerItem_t *item;
+
+    if (server >= ring->servers.list.count)
+        return 0;
+    if (to < 0) to = 0;
+    if (to > 1) to = 1;
+    item = ring->servers.list.buf[server];
+    item->ramp_target = to;
+    if (steps == 0 || item->ramp == (float)to) {
+        item->ramp_step = 0;
+        if (item->ramp != (float)to) {
+            item->ramp = to;
+            ConsistentHash_update_continuum(ring);
+        }
+    } else {
+        item->ramp_step = (to - item->ramp) / steps;
+    }
+    return 1;
+}
+
+uint32_t
+ConsistentHash_ramp_step(ConsistentHash_t *ring)
+{
+    ConsistentHash_ServerList_t *list = &ring->servers;
+    CH_ServerItem_t *server;
+    uint32_t i, stepped = 0, ramping = 0;
+
+    for (i = 0; i < list->list.count; i++) {
+        server = list->list.buf[i];
+        if (server->ramp_step == 0)
+            continue;
+        stepped++;
+        server->ramp += server->ramp_step;
+        if (server->ramp_step > 0 ? server->ramp >= server->ramp_target - 1e-6f
+                                  : server->ramp <= server->ramp_target + 1e-6f) {
+            server->ramp = server->ramp_target;
+            server->ramp_step = 0;
+        } else
+            ramping++;
+    }
+    if (stepped)
+        ConsistentHash_update_continuum(ring);
+    return ramping;
+}
+
+double
+ConsistentHash_server_ramp(ConsistentHash_t *ring, uint32_t server)
+{
+    if (server >= ring->servers.list.count)
+        return 1;
+    return ring->servers.list.buf[server]->ramp;
+}
+
+/* MIGRATION */
+
+/* moves current continuum to previous generation, ring gets an empty one to be rebuilt */
+static void
+keep_previous(ConsistentHash_t *ring)
+{
+    ConsistentHash_t *previous;
+    ConsistentHash_ServerList_t *list;
+    CH_ServerItem_t *server, *copy;
+    CH_config_t config;
+    Continuum_t *cont;
+    uint32_t i;
+
+    ring->epoch++;
+    if (!ring->config.keep_previous)
+        return;
+    ConsistentHash_retire_previous(ring);
+    if (ring->servers.list.count == 0)
+        return;
+
+    config = ring->config;
+    config.keep_previous = 0;
+    config.collect_stats = 0;
+    config.hot_keys_sample_rate = 0;
+    config.on_rebuild = NULL;
+    previous = ConsistentHash_new(config);
+
+    /* points are not needed, names and aliveness are enough for lookups */
+    list = ConsistentHash_ServerList_new(previous);
+    for (i = 0; i < ring->servers.list.count; i++) {
+        server = ring->servers.list.buf[i];
+        ConsistentHash_ServerList_add(list, server->name->str, server->name->size,
+                server->weight, server->alive_as_configured, server->handle);
+        copy = list->list.buf[i];
+        copy->alive_as_updated = server->alive_as_updated;
+        copy->used_points = server->used_points;
+    }
+    previous->servers = *list;
+    do_free(&previous->config, &list);
+
+    cont = previous->continuum;
+    previous->continuum = ring->continuum;
+    previous->continuum->config = &previous->config;
+    ring->continuum = cont;
+    ring->continuum->config = &ring->config;
+
+    previous->alive_count = ring->alive_count;
+    previous->visitable_count = ring->visitable_count;
+    previous->epoch = ring->epoch - 1;
+    ring->previous = previous;
+}
+
+uint64_t
+ConsistentHash_epoch(ConsistentHash_t *ring)
+{
+    return ring->epoch;
+}
+
+ConsistentHash_t *
+ConsistentHash_previous(ConsistentHash_t *ring)
+{
+    return ring->previous;
+}
+
+void
+ConsistentHash_retire_previous(ConsistentHash_t *ring)
+{
+    ConsistentHash_free(ring->previous);
+    ring->previous = NULL;
+}
+
+/* server owning point of hash, if it is alive; CH_NO_SERVER otherwise */
+static inline uint32_t
+first_alive_at(ConsistentHash_t *ring, uint32_t hash)
+{
+    uint32_t server;
+    if (ring->alive_count == 0 || !Continuum_find_server(ring->continuum, hash, &server) ||
+            server_item_alive(ring->servers.list.buf[server]) != CH_ALIVE)
+        return CH_NO_SERVER;
+    return server;
+}
+
+static uint32_t
+first_by_iterator(ConsistentHash_t *ring, const char *key, size_t key_len)
+{
+    ConsistentHash_Iterator_t iter = ConsistentHash_Iterator_init_value(ring);
+    uint32_t server;
+    ConsistentHash_Iterator_init(&iter, key, key_len);
+    server = ConsistentHash_Iterator_next_index(&iter);
+    ConsistentHash_Iterator_release(&iter);
+    return server;
+}
+
+static uint32_t lookup_first_hashed(ConsistentHash_t *ring, const char *key, size_t key_len,
+                                    const uint32_t *first_hash);
+
+uint32_t
+ConsistentHash_lookup_migrating(ConsistentHash_t *ring, const char *key, size_t key_len, uint32_t *out_previous)
+{
+    ConsistentHash_t *previous = ring->previous;
+    uint32_t hash, server, old = CH_NO_SERVER;
+    uint64_t entry = 0;
+    CH_Name_t *name, *old_name;
+
+    hash = ring->config.item_hash(ring->config.ctx, key, key_len, ITERATOR_SEED);
+    if (relaxed_load(&ring->hot_table.used) != 0 &&
+            HotTable_find(&ring->hot_table, hash, &entry) >= 0 && hot_entry_live(entry))
+        server = lookup_first_hashed(ring, key, key_len, &hash);
+    else if ((server = first_alive_at(ring, hash)) != CH_NO_SERVER) {
+        stat_add(ring, lookups, 1);
+        stat_add(ring, probes, 1);
+        HotKeys_maybe_sample(ring->hot_keys, hash);
+    } else
+        server = first_by_iterator(ring, key, key_len);
+
+    if (previous != NULL) {
+        old = first_alive_at(previous, hash);
+        if (old == CH_NO_SERVER)
+            old = first_by_iterator(previous, key, key_len);
+        if (old != CH_NO_SERVER && server != CH_NO_SERVER) {
+            name = ring->servers.list.buf[server]->name;
+            old_name = previous->servers.list.buf[old]->name;
+            if (name->size == old_name->size && memcmp(name->str, old_name->str, name->size) == 0)
+                old = CH_NO_SERVER;
+        }
+    }
+    if (out_previous)
+        *out_previous = old;
+    return server;
+}
+
+/* FAILOVER */
+
+int
+ConsistentHash_fail_server(ConsistentHash_t *ring, uint32_t server)
+{
+    CH_ServerItem_t *item;
+    CH_aliveness_e was;
+
+    if (server >= ring->servers.list.count)
+        return -1;
+    item = ring->servers.list.buf[server];
+    was = server_item_alive(item);
+    item->alive_as_updated = CH_DEAD;
+    if (was == CH_DEAD)
+        return 0;
+    if (item->used_points == 0 || !Failover_apply(ring, server)) {
+        ConsistentHash_update_continuum(ring);
+        return 0;
+    }
+    ring->visitable_count--;
+    if (was == CH_ALIVE)
+        ring->alive_count--;
+    return 1;
+}
+
+int
+ConsistentHash_rebuild_pending(ConsistentHash_t *ring)
+{
+    return ring->failover.patched;
+}
+
+void
+ConsistentHash_rebuild(ConsistentHash_t *ring)
+{
+    ConsistentHash_update_continuum(ring);
+}
+
+/* LOOKUP KERNELS */
+
+ConsistentHash_LookupView_t
+ConsistentHash_lookup_view(ConsistentHash_t *ring)
+{
+    ConsistentHash_LookupView_t view;
+    ConsistentHash_ServerList_t *list = &ring->servers;
+    Continuum_t *cont = ring->continuum;
+    uint32_t i, count = list->list.count;
+
+    if (cont->points.count && !cont->sorted)
+        Continuum_sort(cont);
+    ensure_capa(&ring->config, ring->view_alive, count + 1);
+    for (i = 0; i < count; i++)
+        ring->view_alive.buf[i] = server_item_alive(list->list.buf[i]) == CH_ALIVE;
+    ring->view_alive.count = count;
+    if (ring->config.use_handle == CH_USE_HANDLE) {
+        ensure_capa(&ring->config, ring->view_handles, count + 1);
+        for (i = 0; i < count; i++)
+            ring->view_handles.buf[i] = list->list.buf[i]->handle;
+        ring->view_handles.count = count;
+    }
+
+    view.points = cont->points.buf;
+    view.index = cont->hash;
+    if (cont->replicas_ready) {
+        const CH_Replica_t *replica = Continuum_replica(cont);
+        view.points = replica->points;
+        view.index = replica->hash;
+    }
+    view.alive = ring->view_alive.buf;
+    view.handles = ring->config.use_handle == CH_USE_HANDLE ? ring->view_handles.buf : NULL;
+    view.ctx = ring->config.ctx;
+    view.points_count = cont->points.count;
+    view.servers = count;
+    view.alive_count = ring->alive_count;
+    view.visitable_count = ring->visitable_count;
+    return view;
+}
+
+/* SHARED MEMORY */
+
+#define CH_SHM_MAGIC  (0x48534843) /* "CHSH" */
+#define CH_SHM_LAYOUT (1)
+#define CH_SHM_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+typedef struct CH_shm_control {
+    uint32_t magic;
+    uint32_t layout;
+    uint64_t generation;  /* 0 - nothing is published yet */
+} CH_ShmControl_t;
+
+typedef struct CH_shm_header {
+    uint32_t magic;
+    uint32_t layout;
+    uint64_t generation;
+    uint64_t size;
+    uint32_t item_hash_check;
+    uint32_t use_handle;
+    uint32_t servers;
+    uint32_t alive_count;
+    uint32_t visitable_count;
+    uint32_t points;
+    uint64_t servers_off;
+    uint64_t names_off;
+    uint64_t points_off;
+    uint64_t hash_off;
+} CH_ShmHeader_t;
+
+typedef struct CH_shm_server {
+    CH_handle_t handle;
+    uint32_t    name_off;
+    uint32_t    name_len;
+    uint32_t    alive;    /* resulting aliveness at publish time */
+    uint32_t    reserved;
+} CH_ShmServer_t;
+
+struct CH_shared {
+    CH_config_t            config;
+    char                  *name;
+    const CH_ShmControl_t *control;
+    const CH_ShmHeader_t  *header;
+    size_t                 control_size;    /* as mapped */
+    size_t                 header_size;
+    uint64_t               generation;
+};
+
+/* readers and publisher should hash keys the same way */
+static uint32_t
+shm_item_hash_check(CH_config_t *config)
+{
+    return config->item_hash(config->ctx, "consistent.h", 12, ITERATOR_SEED) ^
+        config->item_hash(config->ctx, "", 0, 1);
+}
+
+#ifdef CH_HAVE_SHM
+
+#if defined(__GNUC__)
+#define shm_load_generation(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define shm_store_generation(ptr, v) __atomic_store_n((ptr), (v), __ATOMIC_RELEASE)
+#else
+#define shm_load_generation(ptr) (*(volatile uint64_t*)(ptr))
+#define shm_store_generation(ptr, v) (*(volatile uint64_t*)(ptr) = (v))
+#endif
+
+static void
+shm_segment_name(char *buf, size_t size, const char *name, uint64_t generation)
+{
+    snprintf(buf, size, "%s.%llu", name, (unsigned long long)generation);
+}
+
+/* maps *size bytes of segment, or whole segment if it is not created (then sets *size) */
+static void *
+shm_map(const char *name, int writable, size_t *psize, int create)
+{
+    int fd, flags = writable ? O_RDWR : O_RDONLY;
+    struct stat st;
+    size_t size = *psize;
+    void *ptr;
+
+    if (create)
+        flags |= O_CREAT | (create > 1 ? O_EXCL : 0);
+    fd = shm_open(name, flags, 0600);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0)
+        goto fail;
+    if (create && (size_t)st.st_size < size && ftruncate(fd, size) < 0)
+        goto fail;
+    if (!create) {
+        size = st.st_size;
+        if (size < sizeof(CH_ShmControl_t)) {
+            errno = EINVAL;
+            goto fail;
+        }
+    }
+    ptr = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return NULL;
+    *psize = size;
+    return ptr;
+fail:
+    close(fd);
+    return NULL;
+}
+
+CH_shm_result_e
+ConsistentHash_publish(ConsistentHash_t *ring, const char *name)
+{
+    ConsistentHash_ServerList_t *list = &ring->servers;
+    Continuum_t *cont = ring->continuum;
+    CH_ShmControl_t *control;
+    CH_ShmHeader_t header, *seg;
+    CH_ShmServer_t *servers;
+    uint64_t names_size = 0, previous;
+    size_t control_size = sizeof(CH_ShmControl_t), seg_size;
+    char seg_name[256];
+    uint32_t i;
+    char *names;
+
+    control = shm_map(name, 1, &control_size, 1);
+    if (control == NULL)
+        return CH_SHM_SYSTEM;
+    if (control->magic == 0) {
+        control->magic = CH_SHM_MAGIC;
+        control->layout = CH_SHM_LAYOUT;
+    } else if (control->magic != CH_SHM_MAGIC || control->layout != CH_SHM_LAYOUT) {
+        munmap(control, control_size);
+        return CH_SHM_BAD_LAYOUT;
+    }
+    if (cont->points.count && !cont->sorted)
+        Continuum_sort(cont);
+
+    for (i = 0; i < list->list.count; i++)
+        names_size += list->list.buf[i]->name->size;
+    memset(&header, 0, sizeof(header));
+    header.magic = CH_SHM_MAGIC;
+    header.layout = CH_SHM_LAYOUT;
+    header.generation = previous = control->generation;
+    header.generation++;
+    header.item_hash_check = shm_item_hash_check(&ring->config);
+    header.use_handle = ring->config.use_handle;
+    header.servers = list->list.count;
+    header.alive_count = ring->alive_count;
+    header.visitable_count = ring->visitable_count;
+    header.points = cont->points.count;
+    header.servers_off = CH_SHM_ALIGN(sizeof(header));
+    header.names_off = header.servers_off + sizeof(CH_ShmServer_t) * header.servers;
+    header.points_off = CH_SHM_ALIGN(header.names_off + names_size);
+    header.hash_off = header.points_off + sizeof(Point_t) * header.points;
+    header.size = header.hash_off + sizeof(cont->hash);
+
+    shm_segment_name(seg_name, sizeof(seg_name), name, header.generation);
+    shm_unlink(seg_name); /* left by crashed publisher */
+    seg_size = header.size;
+    seg = shm_map(seg_name, 1, &seg_size, 2);
+    if (seg == NULL) {
+        munmap(control, control_size);
+        return CH_SHM_SYSTEM;
+    }
+    *seg = header;
+    servers = (CH_ShmServer_t*)((char*)seg + header.servers_off);
+    names = (char*)seg + header.names_off;
+    for (i = 0, names_size = 0; i < header.servers; i++) {
+        CH_ServerItem_t *server = list->list.buf[i];
+        servers[i].handle = server->handle;
+        servers[i].name_off = names_size;
+        servers[i].name_len = server->name->size;
+        servers[i].alive = server->used_points ? server_item_alive(server) : CH_DEAD;
+        memcpy(names + names_size, server->name->str, server->name->size);
+        names_size += server->name->size;
+    }
+    memcpy((char*)seg + header.points_off, cont->points.buf, sizeof(Point_t) * header.points);
+    memcpy((char*)seg + header.hash_off, cont->hash, sizeof(cont->hash));
+    munmap(seg, seg_size);
+
+    /* release: readers seeing new generation see complete segment */
+    shm_store_generation(&control->generation, header.generation);
+    munmap(control, control_size);
+    if (previous) {
+        /* readers which mapped it keep their mapping */
+        shm_segment_name(seg_name, sizeof(seg_name), name, previous);
+        shm_unlink(seg_name);
+    }
+    return CH_SHM_OK;
+}
+
+CH_shm_result_e
+ConsistentHash_unpublish(const char *name)
+{
+    size_t control_size = 0;
+    const CH_ShmControl_t *control = shm_map(name, 0, &control_size, 0);
+    char seg_name[256];
+
+    if (control == NULL)
+        return errno == ENOENT ? CH_SHM_NOT_PUBLISHED : CH_SHM_SYSTEM;
+    if (control->generation) {
+        shm_segment_name(seg_name, sizeof(seg_name), name, control->generation);
+        shm_unlink(seg_name);
+    }
+    munmap((void*)control, control_size);
+    shm_unlink(name);
+    return CH_SHM_OK;
+}
+
+static inline int
+shm_range_fits(uint64_t off, uint64_t len, uint64_t size)
+{
+    return off <= size && len <= size - off;
+}
+
+/* every offset of segment stays inside header->size, so that lookups need no checks */
+static int
+shm_header_valid(const CH_ShmHeader_t *header)
+{
+    const CH_ShmServer_t *servers;
+    const uint32_t *hash;
+    uint64_t names_size;
+    uint32_t i;
+
+    if (header->size < sizeof(CH_ShmHeader_t) ||
+            header->alive_count > header->servers || header->visitable_count > header->servers ||
+            !shm_range_fits(header->servers_off, sizeof(CH_ShmServer_t) * (uint64_t)header->servers, header->size) ||
+            !shm_range_fits(header->names_off, 0, header->size) ||
+            !shm_range_fits(header->points_off, sizeof(Point_t) * (uint64_t)header->points, header->size) ||
+            !shm_range_fits(header->hash_off, sizeof(uint32_t) * (uint64_t)FASTHASH_SIZE, header->size) ||
+            header->servers_off % 8 || header->points_off % 8 || header->hash_off % 4)
+        return 0;
+    servers = (const CH_ShmServer_t*)((const char*)header + header->servers_off);
+    names_size = header->size - header->names_off;
+    for (i = 0; i < header->servers; i++)
+        if (!shm_range_fits(servers[i].name_off, servers[i].name_len, names_size))
+            return 0;
+    hash = (const uint32_t*)((const char*)header + header->hash_off);
+    for (i = 0; i < FASTHASH_SIZE; i++)
+        if (hash[i] > header->points || (i > 0 && hash[i] < hash[i-1]))
+            return 0;
+    return 1;
+}
+
+static CH_shm_result_e
+shared_map_generation(ConsistentHash_Shared_t *shared, uint64_t generation)
+{
+    const CH_ShmHeader_t *header;
+    size_t size = 0;
+    char seg_name[256];
+
+    shm_segment_name(seg_name, sizeof(seg_name), shared->name, generation);
+    header = shm_map(seg_name, 0, &size, 0);
+    if (header == NULL)
+        return CH_SHM_SYSTEM;
+    if (size < sizeof(CH_ShmHeader_t) || header->magic != CH_SHM_MAGIC ||
+            header->layout != CH_SHM_LAYOUT || header->generation != generation ||
+            header->size > size || !shm_header_valid(header)) {
+        munmap((void*)header, size);
+        return CH_SHM_BAD_LAYOUT;
+    }
+    if (header->item_hash_check != shm_item_hash_check(&shared->config)) {
+        munmap((void*)header, size);
+        return CH_SHM_HASH_MISMATCH;
+    }
+    if (shared->header)
+        munmap((void*)shared->header, shared->header_size);
+    shared->header = header;
+    shared->header_size = size;
+    shared->generation = generation;
+    return CH_SHM_OK;
+}
+
+CH_shm_result_e
+ConsistentHash_attach(const char *name, CH_config_t config, ConsistentHash_Shared_t **out)
+{
+    ConsistentHash_Shared_t *shared;
+    CH_shm_result_e result;
+    uint64_t generation;
+    size_t len = strlen(name);
+    int attempts;
+
+    *out = NULL;
+    config_set_defaults(&config);
+    do_calloc(&config, &shared, 1);
+    shared->config = config;
+    do_malloc(&config, &shared->name, len + 1);
+    memcpy(shared->name, name, len + 1);
+
+    shared->control = shm_map(name, 0, &shared->control_size, 0);
+    if (shared->control == NULL) {
+        result = errno == ENOENT ? CH_SHM_NOT_PUBLISHED : CH_SHM_SYSTEM;
+        goto fail;
+    }
+    if (shared->control->magic != CH_SHM_MAGIC || shared->control->layout != CH_SHM_LAYOUT) {
+        result = CH_SHM_BAD_LAYOUT;
+        goto fail;
+    }
+    /* segment could be unlinked by publisher between reading generation and opening it */
+    for (attempts = 0; attempts < 16; attempts++) {
+        generation = shm_load_generation(&shared->control->generation);
+        if (generation == 0) {
+            result = CH_SHM_NOT_PUBLISHED;
+            goto fail;
+        }
+        result = shared_map_generation(shared, generation);
+        if (result != CH_SHM_SYSTEM || errno != ENOENT)
+            break;
+    }
+    if (result != CH_SHM_OK)
+        goto fail;
+    *out = shared;
+    return CH_SHM_OK;
+fail:
+    ConsistentHash_detach(shared);
+    return result;
+}
+
+void
+ConsistentHash_detach(ConsistentHash_Shared_t *shared)
+{
+    if (shared) {
+        if (shared->header)
+            munmap((void*)shared->header, shared->header_size);
+        if (shared->control)
+            munmap((void*)shared->control, shared->control_size);
+        do_free(&shared->config, &shared->name);
+        do_free(&shared->config, &shared);
+    }
+}
+
+int
+ConsistentHash_Shared_refresh(ConsistentHash_Shared_t *shared)
+{
+    uint64_t generation = shm_load_generation(&shared->control->generation);
+    if (generation == shared->generation)
+        return 0;
+    return shared_map_generation(shared, generation) == CH_SHM_OK ? 1 : -1;
+}
+
+#else /* CH_HAVE_SHM */
+
+CH_shm_result_e
+ConsistentHash_publish(__unused__ ConsistentHash_t *ring, __unused__ const char *name)
 {
-    return sizeof(*ring) - sizeof(ring->servers) +
-        ConsistentHash_ServerList_size(&ring->servers) +
-        Continuum_size(ring->continuum);
+    return CH_SHM_UNSUPPORTED;
 }
 
-uint32_t
-ConsistentHash_alive_count(ConsistentHash_t *ring)
+CH_shm_result_e
+ConsistentHash_unpublish(__unused__ const char *name)
 {
-    return ring->alive_count;
+    return CH_SHM_UNSUPPORTED;
 }
 
-CH_use_handle_e
-ConsistentHash_use_handle(ConsistentHash_t *ring)
+CH_shm_result_e
+ConsistentHash_attach(__unused__ const char *name, __unused__ CH_config_t config, ConsistentHash_Shared_t **out)
 {
-    return ring->config.use_handle;
+    *out = NULL;
+    return CH_SHM_UNSUPPORTED;
 }
 
 void
-ConsistentHash_clean(ConsistentHash_t *ring)
+ConsistentHash_detach(__unused__ ConsistentHash_Shared_t *shared)
 {
-    Continuum_clean(ring->continuum);
-    ConsistentHash_ServerList_release(&ring->servers);
-    ring->alive_count = 0;
 }
 
-static void
-sort_weights(uint32_t *weights, uint32_t count)
+int
+ConsistentHash_Shared_refresh(__unused__ ConsistentHash_Shared_t *shared)
 {
-    if (count < 7) { /* insertion sort */
-        uint32_t i, j;
-        for(i = 1; i < count; i++) {
-            uint32_t cur = weights[i];
-            if (cur < weights[i-1]) {
-                weights[i] = weights[i-1];
-                j = i - 1;
-                while(j && cur < weights[j - 1]) {
-                    weights[j] = weights[j - 1];
-                    j--;
-                }
-                weights[j] = cur;
-            }
-        }
-    }
-    else { /* quick sort with respect to repetative items */
-        uint32_t *lesser, *equal, *more;
-        uint32_t one_third = count / 3;
-        uint32_t samples[4] = {weights[0], weights[one_third], weights[one_third*2], weights[count-1]};
-        uint32_t median, tmp;
-        uint32_t i = count;
+    return -1;
+}
 
-        sort_weights(samples, 4);
-        median = samples[2];
+#endif /* CH_HAVE_SHM */
 
-        lesser = weights;
-        for(; i && *lesser < median; i--, lesser++) {}
+uint64_t
+ConsistentHash_Shared_generation(ConsistentHash_Shared_t *shared)
+{
+    return shared->generation;
+}
 
-        equal = lesser;
-        for(; i && *equal == median; i--, equal++) {}
+uint32_t
+ConsistentHash_Shared_servers_count(ConsistentHash_Shared_t *shared)
+{
+    return shared->header ? shared->header->servers : 0;
+}
 
-        if (i) {
-            more = equal;
-            for(; i; i--, more++) {
-                if (*more < median) {
-                    tmp = *more;
-                    *more = *equal;
-                    *equal = *lesser;
-                    *lesser = tmp;
-                    lesser++;
-                    equal++;
-                }
-                else if (*more == median) {
-                    tmp = *more;
-                    *more = *equal;
-                    *equal = tmp;
-                }
-            }
-        }
+static inline const CH_ShmServer_t *
+shared_servers(const CH_ShmHeader_t *header)
+{
+    return (const CH_ShmServer_t*)((const char*)header + header->servers_off);
+}
 
-        sort_weights(weights, lesser - weights);
-        sort_weights(equal, count - (equal - weights));
+ConsistentHash_IteratorName_t
+ConsistentHash_Shared_server_name(ConsistentHash_Shared_t *shared, uint32_t server)
+{
+    ConsistentHash_IteratorName_t result = {0, NULL};
+    const CH_ShmHeader_t *header = shared->header;
+    if (header && server < header->servers) {
+        const CH_ShmServer_t *item = shared_servers(header) + server;
+        result.size = item->name_len;
+        result.name = (const char*)header + header->names_off + item->name_off;
     }
+    return result;
 }
 
-static void
-ConsistentHash_update_continuum(ConsistentHash_t *ring)
+ConsistentHash_IteratorHandle_t
+ConsistentHash_Shared_server_handle(ConsistentHash_Shared_t *shared, uint32_t server)
 {
-    ConsistentHash_ServerList_t *list;
-    CH_ServerItem_t *server;
-    uint32_t i;
-    uint32_t median, used_points;
-    CH_aliveness_e alive;
-    float    part;
-    struct {
-        uint32_t  capa;
-        uint32_t  count;
-        uint32_t *buf;
-    } weights = {0, 0, 0};
+    ConsistentHash_IteratorHandle_t result = {0, 0};
+    const CH_ShmHeader_t *header = shared->header;
+    if (header && server < header->servers && header->use_handle == CH_USE_HANDLE) {
+        result.handle = shared_servers(header)[server].handle;
+        result.found = 1;
+    }
+    return result;
+}
 
-    ring->alive_count = 0;
-    ring->visitable_count = 0;
-    list = &ring->servers;
+/* same walk as ConsistentHash_Iterator_next_server, over published snapshot */
+uint32_t
+ConsistentHash_Shared_lookup(ConsistentHash_Shared_t *shared, const char *key, size_t key_len, uint32_t *out, uint32_t n)
+{
+    const CH_ShmHeader_t *header;
+    const CH_ShmServer_t *servers;
+    const Point_t *points;
+    const uint32_t *hash;
+    uint32_t smallbuf[32], *visited_bits = smallbuf;
+    uint32_t seed = ITERATOR_SEED, found = 0, visited = 0, server;
+
+    if (shared->control)
+        ConsistentHash_Shared_refresh(shared);
+    header = shared->header;
+    if (header == NULL || header->points == 0)
+        return 0;
+    servers = shared_servers(header);
+    points = (const Point_t*)((const char*)header + header->points_off);
+    hash = (const uint32_t*)((const char*)header + header->hash_off);
 
-    for(i = 0; i < list->list.count; i++) {
-        server = list->list.buf[i];
-        alive = server_item_alive(server);
-        if (alive == CH_ALIVE)
-            ring->alive_count++;
-        if (alive != CH_DEAD) {
-            append_to(&ring->config, weights, server->weight);
-            ring->visitable_count++;
-        }
+    if (header->servers > sizeof(smallbuf) * 8)
+        do_calloc(&shared->config, &visited_bits, (header->servers + 31) / 32);
+    else
+        memset(smallbuf, 0, sizeof(smallbuf));
+
+    while (found < n && found < header->alive_count && visited < header->visitable_count) {
+        server = CH_points_find_server(points, header->points, hash,
+                shared->config.item_hash(shared->config.ctx, key, key_len, seed));
+        seed--;
+        if (server >= header->servers)
+            break;
+        if (visited_bits[server / 32] & (1u << (server % 32)))
+            continue;
+        visited_bits[server / 32] |= 1u << (server % 32);
+        visited++;
+        if (servers[server].alive == CH_ALIVE)
+            out[found++] = server;
     }
 
-    Continuum_clean(ring->continuum);
+    if (visited_bits != smallbuf)
+        do_free(&shared->config, &visited_bits);
+    return found;
+}
 
-    if (weights.count > 0) {
-        sort_weights(weights.buf, weights.count);
+/* ANALYSIS */
 
-        median = weights.buf[weights.count / 2];
-        array_clean(&ring->config, weights);
+uint32_t
+ConsistentHash_servers_count(ConsistentHash_t *ring)
+{
+    return ring->servers.list.count;
+}
 
-        for(i = 0; i < list->list.count; i++) {
-            server = list->list.buf[i];
-            alive = server_item_alive(server);
-            if (alive != CH_DEAD) {
-                part = ((float)server->weight) / median;
-                used_points = ring->config.points_per_server * part;
-            }
-            else
-                used_points = 0;
-            ServerItem_set_used_points(&ring->config, server, used_points);
-            Continuum_add_server(ring->continuum, i, server->points.buf, used_points);
-        }
-        Continuum_sort(ring->continuum);
+ConsistentHash_IteratorName_t
+ConsistentHash_server_name(ConsistentHash_t *ring, uint32_t server)
+{
+    ConsistentHash_IteratorName_t name = {0, NULL};
+    if (server < ring->servers.list.count) {
+        name.name = ring->servers.list.buf[server]->name->str;
+        name.size = ring->servers.list.buf[server]->name->size;
     }
+    return name;
 }
 
-void
-ConsistentHash_exchange_server_list(ConsistentHash_t *ring, ConsistentHash_ServerList_t *list)
+ConsistentHash_IteratorHandle_t
+ConsistentHash_server_handle(ConsistentHash_t *ring, uint32_t server)
 {
-    ConsistentHash_ServerList_t tmp, *new_list;
-    uint32_t i;
+    ConsistentHash_IteratorHandle_t handle = {0, 0};
+    if (ring->config.use_handle != CH_DONOT_USE_HANDLE && server < ring->servers.list.count) {
+        handle.handle = ring->servers.list.buf[server]->handle;
+        handle.found = 1;
+    }
+    return handle;
+}
 
-    tmp = ring->servers;
-    ring->servers = *list;
-    *list = tmp;
-    new_list = &ring->servers;
+CH_aliveness_e
+ConsistentHash_server_alive(ConsistentHash_t *ring, uint32_t server)
+{
+    if (server >= ring->servers.list.count)
+        return CH_DEAD;
+    return server_item_alive(ring->servers.list.buf[server]);
+}
 
-    if (tmp.list.count) { /* copy generated points */
-        for(i = 0; i < tmp.list.count; i++) {
-            CH_ServerItem_t *new_item;
-            new_item = TiredSet_get(new_list->by_name, ServerItem_name_as_handle(tmp.list.buf[i]));
-            if (new_item)
-                ServerItem_steal_points_and_alive(new_item, tmp.list.buf[i]);
-        }
-    }
+uint32_t
+ConsistentHash_server_index(ConsistentHash_t *ring, const char *name, size_t name_len)
+{
+    CH_ServerItem_t *server = NULL;
+    if (ring->servers.by_name != NULL)
+        server = find_by_name(&ring->servers, name, name_len);
+    return server ? server->index : CH_NO_SERVER;
+}
 
-    ConsistentHash_update_continuum(ring);
+uint32_t
+ConsistentHash_server_index_by_handle(ConsistentHash_t *ring, CH_handle_t handle)
+{
+    CH_ServerItem_t *server = NULL;
+    if (ring->servers.by_handle != NULL)
+        server = SwissSet_get(ring->servers.by_handle, handle);
+    return server ? server->index : CH_NO_SERVER;
 }
 
-void
-ConsistentHash_refresh_alive_by_name(ConsistentHash_t *ring, ConsistentHash_AliveByName_t *list,
-                                   CH_aliveness_e default_alive)
+CH_OwnershipStats_t
+ConsistentHash_ownership(ConsistentHash_t *ring, double *out_fractions)
 {
+    CH_OwnershipStats_t stats = {0, 0, 0, 0};
+    ConsistentHash_ServerList_t *list = &ring->servers;
+    ArcCursor_t cursor;
+    uint64_t *arcs = NULL;
+    uint64_t alive_keys = 0, alive_weight = 0;
+    double ratio, sum = 0, sum_sq = 0;
     uint32_t i;
-    CH_ServerItem_t *server;
-    ConsistentHash_ServerList_t *servers = &ring->servers;
 
-    if (servers->list.count == 0) return;
+    if (out_fractions)
+        do_memzero(out_fractions, list->list.count);
+    if (list->list.count == 0)
+        return stats;
 
-    for(i = 0; i < servers->list.count; i++) {
-        servers->list.buf[i]->alive_as_updated = default_alive;
+    do_calloc(&ring->config, &arcs, list->list.count);
+    ArcCursor_init(&cursor, ring->continuum);
+    while (ArcCursor_next(&cursor)) {
+        arcs[cursor.server] += (uint64_t)cursor.end - cursor.start + 1;
     }
 
-    if (list != NULL) {
-        for(i = 0; i < list->list.count; i++) {
-            server = TiredSet_get(servers->by_name, (CH_handle_t)(uintptr_t)list->list.buf[i].name);
-            if (server != NULL) {
-                server->alive_as_updated = list->list.buf[i].alive;
-            }
+    for (i = 0; i < list->list.count; i++) {
+        if (server_item_alive(list->list.buf[i]) == CH_ALIVE) {
+            alive_keys += arcs[i];
+            alive_weight += list->list.buf[i]->weight;
         }
     }
 
-    ConsistentHash_update_continuum(ring);
+    for (i = 0; alive_keys && alive_weight && i < list->list.count; i++) {
+        CH_ServerItem_t *server = list->list.buf[i];
+        double fraction;
+        if (server_item_alive(server) != CH_ALIVE)
+            continue;
+        fraction = (double)arcs[i] / alive_keys;
+        if (out_fractions)
+            out_fractions[i] = fraction;
+        ratio = fraction * alive_weight / server->weight;
+        if (stats.servers == 0 || ratio > stats.max_ratio)
+            stats.max_ratio = ratio;
+        if (stats.servers == 0 || ratio < stats.min_ratio)
+            stats.min_ratio = ratio;
+        sum += ratio;
+        sum_sq += ratio * ratio;
+        stats.servers++;
+    }
+    if (stats.servers) {
+        double mean = sum / stats.servers;
+        double variance = sum_sq / stats.servers - mean * mean;
+        stats.stddev = variance > 0 ? sqrt(variance) : 0;
+    }
+
+    do_free(&ring->config, &arcs);
+    return stats;
 }
 
-void
-ConsistentHash_refresh_alive_by_handle(ConsistentHash_t *ring, ConsistentHash_AliveByHandle_t *list,
-                                     CH_aliveness_e default_alive)
+uint32_t
+ConsistentHash_key_hash(ConsistentHash_t *ring, const char *key, size_t key_len)
 {
-    uint32_t i;
-    CH_ServerItem_t *server;
-    ConsistentHash_ServerList_t *servers = &ring->servers;
+    return ring->config.item_hash(ring->config.ctx, key, key_len, ITERATOR_SEED);
+}
 
-    if (servers->list.count == 0) return;
+struct CH_ring_diff {
+    CH_config_t *config;
+    struct {
+        uint32_t        capa;
+        uint32_t        count;
+        CH_RangeMove_t *buf;
+    } ranges;
+    uint64_t  moved;
+    uint32_t  old_count;
+    uint32_t  new_count;
+    uint64_t *moved_from;
+    uint64_t *moved_to;
+};
 
-    for(i = 0; i < servers->list.count; i++) {
-        servers->list.buf[i]->alive_as_updated = default_alive;
+static inline int
+diff_same_server(ConsistentHash_t *old_ring, uint32_t old_server,
+                 ConsistentHash_t *new_ring, uint32_t new_server)
+{
+    if (old_server == CH_NO_SERVER || new_server == CH_NO_SERVER)
+        return old_server == new_server;
+    return name_eq(NULL,
+            name_key_handle(&old_ring->servers.list.buf[old_server]->key),
+            name_key_handle(&new_ring->servers.list.buf[new_server]->key));
+}
+
+static void
+Diff_add_range(ConsistentHash_Diff_t *diff, uint32_t start, uint32_t end,
+               uint32_t old_server, uint32_t new_server)
+{
+    uint64_t keys = (uint64_t)end - start + 1;
+    CH_RangeMove_t *last = diff->ranges.count ? diff->ranges.buf + diff->ranges.count - 1 : NULL;
+
+    if (last && last->end + 1 == start &&
+            last->old_server == old_server && last->new_server == new_server) {
+        last->end = end;
+    } else {
+        CH_RangeMove_t range = { start, end, old_server, new_server };
+        append_to(diff->config, diff->ranges, range);
     }
+    diff->moved += keys;
+    if (old_server != CH_NO_SERVER)
+        diff->moved_from[old_server] += keys;
+    if (new_server != CH_NO_SERVER)
+        diff->moved_to[new_server] += keys;
+}
 
-    if (list != NULL) {
-        for(i = 0; i < list->list.count; i++) {
-            server = TiredSet_get(servers->by_handle, list->list.buf[i].handle);
-            if (server != NULL) {
-                server->alive_as_updated = list->list.buf[i].alive;
-            }
-        }
+ConsistentHash_Diff_t *
+ConsistentHash_diff(ConsistentHash_t *old_ring, ConsistentHash_t *new_ring)
+{
+    ConsistentHash_Diff_t *diff;
+    ArcCursor_t old_arc, new_arc;
+    int old_more, new_more;
+    uint64_t pos = 0;
+
+    do_calloc(&old_ring->config, &diff, 1);
+    diff->config = &old_ring->config;
+    diff->old_count = old_ring->servers.list.count;
+    diff->new_count = new_ring->servers.list.count;
+    do_calloc(diff->config, &diff->moved_from, diff->old_count + 1);
+    do_calloc(diff->config, &diff->moved_to, diff->new_count + 1);
+
+    ArcCursor_init(&old_arc, old_ring->continuum);
+    ArcCursor_init(&new_arc, new_ring->continuum);
+    old_more = ArcCursor_next(&old_arc);
+    new_more = ArcCursor_next(&new_arc);
+    if (!old_more && !new_more)
+        return diff;
+
+    /* empty ring is a one arc without server */
+    if (!old_more) {
+        old_arc.start = 0; old_arc.end = KEYS_END - 1; old_arc.server = CH_NO_SERVER;
+    }
+    if (!new_more) {
+        new_arc.start = 0; new_arc.end = KEYS_END - 1; new_arc.server = CH_NO_SERVER;
     }
 
-    ConsistentHash_update_continuum(ring);
+    while (pos < KEYS_END) {
+        uint32_t end = old_arc.end < new_arc.end ? old_arc.end : new_arc.end;
+        if (!diff_same_server(old_ring, old_arc.server, new_ring, new_arc.server))
+            Diff_add_range(diff, (uint32_t)pos, end, old_arc.server, new_arc.server);
+        pos = (uint64_t)end + 1;
+        if (old_arc.end == end && old_more)
+            old_more = ArcCursor_next(&old_arc);
+        if (new_arc.end == end && new_more)
+            new_more = ArcCursor_next(&new_arc);
+    }
+    return diff;
+}
+
+uint32_t
+ConsistentHash_Diff_count(ConsistentHash_Diff_t *diff)
+{
+    return diff->ranges.count;
+}
+
+const CH_RangeMove_t *
+ConsistentHash_Diff_ranges(ConsistentHash_Diff_t *diff)
+{
+    return diff->ranges.buf;
+}
+
+double
+ConsistentHash_Diff_moved(ConsistentHash_Diff_t *diff)
+{
+    return (double)diff->moved / KEYS_END;
+}
+
+double
+ConsistentHash_Diff_moved_from(ConsistentHash_Diff_t *diff, uint32_t old_server)
+{
+    return old_server < diff->old_count ? (double)diff->moved_from[old_server] / KEYS_END : 0;
+}
+
+double
+ConsistentHash_Diff_moved_to(ConsistentHash_Diff_t *diff, uint32_t new_server)
+{
+    return new_server < diff->new_count ? (double)diff->moved_to[new_server] / KEYS_END : 0;
+}
+
+size_t
+ConsistentHash_Diff_size(ConsistentHash_Diff_t *diff)
+{
+    return sizeof(*diff) + buf_size(diff->ranges) +
+        (diff->old_count + diff->new_count + 2) * sizeof(uint64_t);
+}
+
+void
+ConsistentHash_Diff_free(ConsistentHash_Diff_t *diff)
+{
+    if (diff) {
+        array_clean(diff->config, diff->ranges);
+        do_free(diff->config, &diff->moved_from);
+        do_free(diff->config, &diff->moved_to);
+        do_free(diff->config, &diff);
+    }
 }
 
 /* ITERATOR */
@@ -1526,8 +4622,9 @@ ConsistentHash_Iterator_init(ConsistentHash_Iterator_t *iterator, const char *na
     do_memzero(iterator, 1);
     iterator->ring = ring;
     iterator->name = CH_Name_new(&ring->config, name, name_len);
-    iterator->seed = ~5;
+    iterator->seed = ITERATOR_SEED;
     CH_Iterator_ensure_bitmap(iterator, ring->servers.list.count);
+    stat_add(ring, lookups, 1);
 }
 
 ConsistentHash_Iterator_t *
@@ -1564,8 +4661,9 @@ ConsistentHash_Iterator_reinit(ConsistentHash_Iterator_t *iterator, const char *
     do_memzero(iterator, 1);
     iterator->ring = ring;
     iterator->name = CH_Name_new(&ring->config, name, name_len);
-    iterator->seed = ~5;
+    iterator->seed = ITERATOR_SEED;
     CH_Iterator_ensure_bitmap(iterator, ring->servers.list.count);
+    stat_add(ring, lookups, 1);
 }
 
 void
@@ -1577,41 +4675,71 @@ ConsistentHash_Iterator_free(ConsistentHash_Iterator_t *iterator)
     }
 }
 
+/* first_hash, if set, is item hash of the first probe computed already by caller */
 static uint32_t
-ConsistentHash_Iterator_next_server(ConsistentHash_Iterator_t *iterator)
+CH_Iterator_next_hashed(ConsistentHash_Iterator_t *iterator, const uint32_t *first_hash)
 {
     uint32_t hash, server;
     CH_aliveness_e alive;
     ConsistentHash_t *ring = iterator->ring;
     ConsistentHash_ServerList_t *list = &ring->servers;
     CH_Name_t *name = iterator->name;
+    uint32_t probes = 0, collisions = 0;
 
     if (ring->alive_count <= iterator->found) {
         return (uint32_t)-1;
     }
 
+    server = (uint32_t)-1;
     while (iterator->visited < ring->visitable_count) {
-        hash = ring->config.item_hash(ring->config.ctx, name->str, name->size, iterator->seed);
-        if (!Continuum_find_server(ring->continuum, hash, &server))
-            return (uint32_t)-1;
+        if (first_hash != NULL && iterator->seed == (uint32_t)ITERATOR_SEED)
+            hash = *first_hash;
+        else
+            hash = ring->config.item_hash(ring->config.ctx, name->str, name->size, iterator->seed);
+        probes++;
+        if (!Continuum_find_server(ring->continuum, hash, &server)) {
+            server = (uint32_t)-1;
+            break;
+        }
+        if (iterator->seed == (uint32_t)ITERATOR_SEED)
+            HotKeys_maybe_sample(ring->hot_keys, hash);
         iterator->seed--;
 
         if (!CH_Iterator_bitmap_get(iterator, server)) {
             CH_Iterator_bitmap_set(iterator, server);
             iterator->visited++;
 
-            if (server > list->list.count)
-                return (uint32_t)-1;
+            if (server > list->list.count) {
+                server = (uint32_t)-1;
+                break;
+            }
 
             alive = server_item_alive(list->list.buf[server]);
             if (alive == CH_ALIVE) {
                 iterator->found++;
-                return server;
+                break;
             }
         }
+        else
+            collisions++;
+        server = (uint32_t)-1;
     }
 
-    return (uint32_t)-1;
+    stat_add(ring, probes, probes);
+    stat_add(ring, collisions, collisions);
+    return server;
+}
+
+static uint32_t
+ConsistentHash_Iterator_next_server(ConsistentHash_Iterator_t *iterator)
+{
+    return CH_Iterator_next_hashed(iterator, NULL);
+}
+
+uint32_t
+ConsistentHash_Iterator_next_index(ConsistentHash_Iterator_t *iterator)
+{
+    return ConsistentHash_Iterator_next_server(iterator);
 }
 
 /**
@@ -1652,4 +4780,76 @@ ConsistentHash_Iterator_next_handle(ConsistentHash_Iterator_t *iterator) {
     return handle;
 }
 
+uint32_t
+ConsistentHash_lookup_first(ConsistentHash_t *ring, const char *key, size_t key_len)
+{
+    uint32_t hash;
+    if (relaxed_load(&ring->hot_table.used) == 0)
+        return lookup_first_hashed(ring, key, key_len, NULL);
+    /* the same hash is looked up in hot table and is the first probe of iterator */
+    hash = ConsistentHash_key_hash(ring, key, key_len);
+    return lookup_first_hashed(ring, key, key_len, &hash);
+}
+
+/* first_hash is ConsistentHash_key_hash of key, hot table is consulted only if it is given */
+static uint32_t
+lookup_first_hashed(ConsistentHash_t *ring, const char *key, size_t key_len, const uint32_t *first_hash)
+{
+    ConsistentHash_Iterator_t iter = ConsistentHash_Iterator_init_value(ring);
+    uint64_t entry = 0;
+    uint32_t spread = 0, pick, other, need, i, server, chosen = CH_NO_SERVER, alternative = CH_NO_SERVER;
+    int pos = -1;
+
+    if (first_hash != NULL) {
+        pos = HotTable_find(&ring->hot_table, *first_hash, &entry);
+        if (pos >= 0 && hot_entry_live(entry)) {
+            spread = hot_entry_spread(entry);
+            /* spreading wider than alive servers would pile the rest onto one of them */
+            if (spread > ring->alive_count)
+                spread = ring->alive_count;
+        }
+    }
+
+    ConsistentHash_Iterator_init(&iter, key, key_len);
+    if (spread <= 1) {
+        chosen = CH_Iterator_next_hashed(&iter, first_hash);
+        ConsistentHash_Iterator_release(&iter);
+        return chosen;
+    }
+
+    if (hot_entry_mode(entry) == CH_SPREAD_ROUND_ROBIN) {
+        pick = other = relaxed_add(&ring->hot_table.turns[pos], 1) % spread;
+    } else {
+        uint32_t r = thread_random();
+        pick = r % spread;
+        other = (pick + 1 + (r >> 16) % (spread - 1)) % spread;
+    }
+
+    for (;;) {
+        need = pick > other ? pick : other;
+        for (i = 0; i <= need; i++) {
+            server = CH_Iterator_next_hashed(&iter, first_hash);
+            if (server == CH_NO_SERVER)
+                break;
+            if (i == pick)
+                chosen = server;
+            if (i == other)
+                alternative = server;
+        }
+        if (i > need || i == 0)
+            break;
+        /* servers updated down since rebuild are still in alive_count: spread over found ones */
+        pick %= i;
+        other %= i;
+        ConsistentHash_Iterator_reinit(&iter, key, key_len);
+    }
+    ConsistentHash_Iterator_release(&iter);
+
+    if (alternative != chosen &&
+            relaxed_load(&ring->servers.list.buf[alternative]->load) <
+            relaxed_load(&ring->servers.list.buf[chosen]->load))
+        chosen = alternative;
+    return chosen;
+}
+
 #endif
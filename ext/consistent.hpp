@@ -0,0 +1,407 @@
+/* vim: set sts=4 sw=4 expandtab: */
+/*
+ * C++ wrapper of consistent.h. Implementation is still compiled once from C:
+ *
+ *   // consistent.c
+ *   #define CONSISTENT_IMPLEMENTATION
+ *   #include "consistent.h"
+ *
+ * Needs C++17, std::span is used with C++20.
+ *
+ *   consistent::Ring<> ring;
+ *   consistent::ServerList list = ring.new_list();
+ *   list.add("10.0.0.1:11211");
+ *   list.add("10.0.0.2:11211", 200);
+ *   ring.exchange(std::move(list));
+ *
+ *   uint32_t servers[3];
+ *   uint32_t n = ring.lookup(key, servers);      // indexes, ring.name(servers[0]) is the node
+ *
+ * Ring is for a single thread. Threads share immutable snapshots instead:
+ *
+ *   consistent::SharedSnapshot<> shared(consistent::Snapshot<>(std::move(ring)));
+ *   // readers
+ *   auto snapshot = shared.load();
+ *   snapshot->lookup(key, servers);
+ *   // writer
+ *   consistent::Ring<> next = shared.load()->copy();
+ *   next.update("10.0.0.2:11211", CH_DOWN);
+ *   shared.store(consistent::Snapshot<>(std::move(next)));
+ */
+#ifndef CONSISTENT_HPP
+#define CONSISTENT_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#if __cplusplus > 201703L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "consistent.h"
+
+namespace consistent {
+
+#if defined(__cpp_lib_span)
+template <class T>
+using span = std::span<T>;
+#else
+/* enough of std::span for lookups before C++20 */
+template <class T>
+class span {
+public:
+    constexpr span() noexcept = default;
+    constexpr span(T *data, size_t size) noexcept : data_(data), size_(size) {}
+    template <size_t N>
+    constexpr span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+    template <class Container, class = std::enable_if_t<
+        std::is_convertible_v<decltype(std::declval<Container&>().data()), T*>>>
+    constexpr span(Container &container) noexcept : data_(container.data()), size_(container.size()) {}
+    template <class U, class = std::enable_if_t<std::is_convertible_v<U(*)[], T(*)[]>>>
+    constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T &operator[](size_t i) const noexcept { return data_[i]; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+
+private:
+    T     *data_ = nullptr;
+    size_t size_ = 0;
+};
+#endif
+
+/* hashers are stateless callables: uint32_t (const char *item, size_t len, uint32_t seed) */
+struct Murmur3 {
+    uint32_t operator()(const char *item, size_t len, uint32_t seed) const noexcept {
+        return CH_murmur3_32(item, len, seed);
+    }
+};
+
+namespace detail {
+
+template <class Hasher>
+uint32_t item_hash(void *, const char *item, size_t len, uint32_t seed) noexcept {
+    return Hasher{}(item, len, seed);
+}
+
+inline uint32_t clamp_count(size_t size) noexcept {
+    return size > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(size);
+}
+
+} // namespace detail
+
+/**
+ * Lookup kernel specialised for Hasher and handle mode, see CONSISTENT_DEFINE_LOOKUP.
+ * Hasher should give the same values as ring's item_hash.
+ *
+ *   using Lookup = consistent::Lookup<consistent::Murmur3>;
+ *   ConsistentHash_LookupView_t view = ConsistentHash_lookup_view(ring);
+ *   uint32_t servers[3];
+ *   uint32_t n = Lookup::find(view, key, servers, 3);
+ *
+ * visited is a bitmap of CH_LOOKUP_VISITED_WORDS(view.servers) words for views larger than
+ * CH_LOOKUP_STACK_BITS servers, it is allocated for every call if not given.
+ */
+template <class Hasher, bool UseHandle = false>
+struct Lookup {
+    using value_type = std::conditional_t<UseHandle, CH_handle_t, uint32_t>;
+
+    static uint32_t find(const ConsistentHash_LookupView_t &v, std::string_view key,
+                         value_type *out, uint32_t n, uint64_t *visited = nullptr) noexcept {
+        const ConsistentHash_LookupView_t *view = &v;
+        auto hash = [](void *, const char *item, size_t len, uint32_t seed) noexcept {
+            return Hasher{}(item, len, seed);
+        };
+        if constexpr (UseHandle)
+            CH_LOOKUP_BODY(hash, view, key.data(), key.size(), n, visited, CH_LOOKUP_EMIT_HANDLE);
+        else
+            CH_LOOKUP_BODY(hash, view, key.data(), key.size(), n, visited, CH_LOOKUP_EMIT_INDEX);
+    }
+
+    /* first server, CH_NO_SERVER (or 0 handle) if there is no alive one */
+    static value_type first(const ConsistentHash_LookupView_t &view, std::string_view key) noexcept {
+        value_type server{};
+        if (find(view, key, &server, 1) == 1)
+            return server;
+        return UseHandle ? value_type(0) : value_type(CH_NO_SERVER);
+    }
+};
+
+/**
+ * Alive servers for a key one by one, in the order of lookups. Lives on stack, does not allocate
+ * for views of up to CH_LOOKUP_STACK_BITS servers or with visited bitmap given (see Lookup).
+ * Key, view and visited are borrowed, view is valid until its ring is changed.
+ */
+template <class Hasher = Murmur3>
+class Iterator {
+public:
+    Iterator(const ConsistentHash_LookupView_t &view, std::string_view key,
+             uint64_t *visited = nullptr) noexcept
+        : view_(&view), key_(key) {
+        if (!CH_lookup_state_init(&state_, view_, visited))
+            view_ = &empty_;
+    }
+    Iterator(const Iterator &) = delete;
+    Iterator &operator=(const Iterator &) = delete;
+    ~Iterator() { CH_lookup_state_done(&state_); }
+
+    /* next server index, CH_NO_SERVER when there are no more */
+    uint32_t next() noexcept {
+        while (CH_lookup_state_more(&state_, view_)) {
+            uint32_t server = CH_points_find_server(view_->points, view_->points_count, view_->index,
+                                                    Hasher{}(key_.data(), key_.size(), state_.seed));
+            state_.seed--;
+            if (CH_lookup_state_visit(&state_, view_, server))
+                return server;
+        }
+        return CH_NO_SERVER;
+    }
+
+private:
+    static constexpr ConsistentHash_LookupView_t empty_{};  /* no points, when bitmap is not allocated */
+    const ConsistentHash_LookupView_t *view_;
+    std::string_view                   key_;
+    CH_LookupState_t                   state_;
+};
+
+/* description of servers to exchange into the ring which made the list */
+class ServerList {
+public:
+    ServerList() noexcept = default;
+    explicit ServerList(ConsistentHash_ServerList_t *list) noexcept : list_(list) {}
+    ServerList(ServerList &&other) noexcept : list_(std::exchange(other.list_, nullptr)) {}
+    ServerList &operator=(ServerList &&other) noexcept {
+        if (this != &other) {
+            reset();
+            list_ = std::exchange(other.list_, nullptr);
+        }
+        return *this;
+    }
+    ServerList(const ServerList &) = delete;
+    ServerList &operator=(const ServerList &) = delete;
+    ~ServerList() { reset(); }
+
+    /* see ConsistentHash_ServerList_add, name is copied */
+    CH_add_result_e add(std::string_view name, uint32_t weight = 100,
+                        CH_aliveness_e alive = CH_ALIVE, CH_handle_t handle = 0) noexcept {
+        return ConsistentHash_ServerList_add(list_, name.data(), name.size(), weight, alive, handle);
+    }
+
+    /* see ConsistentHash_ServerList_load, empty text finishes last line */
+    uint32_t load(std::string_view text) noexcept {
+        return ConsistentHash_ServerList_load(list_, text.data(), text.size());
+    }
+
+    size_t memsize() const noexcept { return list_ ? ConsistentHash_ServerList_size(list_) : 0; }
+    ConsistentHash_ServerList_t *get() const noexcept { return list_; }
+    explicit operator bool() const noexcept { return list_ != nullptr; }
+
+    void reset() noexcept {
+        ConsistentHash_ServerList_free(list_);
+        list_ = nullptr;
+    }
+
+private:
+    ConsistentHash_ServerList_t *list_ = nullptr;
+};
+
+/**
+ * Owner of ConsistentHash_t with item hash set to Hasher.
+ * Lookups go through a lookup view cached by the ring: it is taken again on the first lookup
+ * after a change made through Ring methods or non-const get(). They do not allocate,
+ * but do not feed stats and hot keys either (use C API through get() for them).
+ * Not thread safe, even lookups update the cached view; see Snapshot.
+ */
+template <class Hasher = Murmur3>
+class Ring {
+public:
+    using hasher = Hasher;
+
+    /* servers are told by name, unlike zeroed CH_config_t which means handles */
+    static CH_config_t default_config() noexcept {
+        CH_config_t config{};
+        config.use_handle = CH_DONOT_USE_HANDLE;
+        return config;
+    }
+
+    explicit Ring(CH_config_t config = default_config()) {
+        config.item_hash = &detail::item_hash<Hasher>;
+        config_ = config;
+        ring_ = ConsistentHash_new(config);
+    }
+    Ring(Ring &&other) noexcept
+        : ring_(std::exchange(other.ring_, nullptr)), config_(other.config_),
+          view_(other.view_), dirty_(std::exchange(other.dirty_, true)) {}
+    Ring &operator=(Ring &&other) noexcept {
+        if (this != &other) {
+            ConsistentHash_free(ring_);
+            ring_ = std::exchange(other.ring_, nullptr);
+            config_ = other.config_;
+            view_ = other.view_;
+            dirty_ = std::exchange(other.dirty_, true);
+        }
+        return *this;
+    }
+    Ring(const Ring &) = delete;
+    Ring &operator=(const Ring &) = delete;
+    ~Ring() { ConsistentHash_free(ring_); }
+
+    /* empty list for exchange */
+    ServerList new_list() const { return ServerList(ConsistentHash_ServerList_new(ring_)); }
+    /* current servers as configured, to change and exchange back */
+    ServerList servers() const { return ServerList(ConsistentHash_ServerList_dup(ring_)); }
+
+    /* replaces servers, see ConsistentHash_exchange_server_list */
+    void exchange(ServerList list) noexcept {
+        ConsistentHash_exchange_server_list(ring_, list.get());
+        dirty_ = true;
+    }
+
+    /* returns true if continuum is rebuilt, see ConsistentHash_update_by_name */
+    bool update(std::string_view name, CH_aliveness_e alive) noexcept {
+        CH_NameStatus_t status = { name.data(), name.size(), alive };
+        return update(span<const CH_NameStatus_t>(&status, 1));
+    }
+    bool update(span<const CH_NameStatus_t> statuses) noexcept {
+        dirty_ = true;
+        return ConsistentHash_update_by_name(ring_, statuses.data(), statuses.size(), nullptr) != 0;
+    }
+
+    /* see ConsistentHash_fail_server */
+    int fail(uint32_t server) noexcept {
+        dirty_ = true;
+        return ConsistentHash_fail_server(ring_, server);
+    }
+
+    /* new ring with the same config and servers, keeping their aliveness, rebalance and ramp progress.
+     * failure patched by fail() is rebuilt in the copy, see ConsistentHash_fail_server */
+    Ring copy() const {
+        Ring ring(config_);
+        ring.exchange(ServerList(ConsistentHash_ServerList_dup_from(ring.ring_, ring_)));
+        return ring;
+    }
+
+    /* fills out with up to out.size() servers for key, returns their number */
+    uint32_t lookup(std::string_view key, span<uint32_t> out) const noexcept {
+        return Lookup<Hasher>::find(view(), key, out.data(), detail::clamp_count(out.size()));
+    }
+    /* same with handles, for ring with CH_USE_HANDLE (returns 0 otherwise) */
+    uint32_t lookup(std::string_view key, span<CH_handle_t> out) const noexcept {
+        const ConsistentHash_LookupView_t &v = view();
+        if (v.handles == nullptr)
+            return 0;
+        return Lookup<Hasher, true>::find(v, key, out.data(), detail::clamp_count(out.size()));
+    }
+    /* CH_NO_SERVER if there is no alive server */
+    uint32_t first(std::string_view key) const noexcept { return Lookup<Hasher>::first(view(), key); }
+    /* iterator is valid until the ring is changed */
+    Iterator<Hasher> iterate(std::string_view key) const noexcept { return Iterator<Hasher>(view(), key); }
+
+    /* empty for unknown index */
+    std::string_view name(uint32_t server) const noexcept {
+        ConsistentHash_IteratorName_t name = ConsistentHash_server_name(ring_, server);
+        return name.name ? std::string_view(name.name, name.size) : std::string_view();
+    }
+    CH_handle_t handle(uint32_t server) const noexcept {
+        return ConsistentHash_server_handle(ring_, server).handle;
+    }
+    CH_aliveness_e alive(uint32_t server) const noexcept { return ConsistentHash_server_alive(ring_, server); }
+    uint32_t size() const noexcept { return ConsistentHash_servers_count(ring_); }
+    uint32_t alive_count() const noexcept { return ConsistentHash_alive_count(ring_); }
+    size_t memsize() const noexcept { return ConsistentHash_size(ring_); }
+
+    const ConsistentHash_LookupView_t &view() const noexcept {
+        if (dirty_) {
+            view_ = ConsistentHash_lookup_view(ring_);
+            dirty_ = false;
+        }
+        return view_;
+    }
+
+    /* rest of C API, ring is assumed to be changed */
+    ConsistentHash_t *get() noexcept {
+        dirty_ = true;
+        return ring_;
+    }
+
+private:
+    ConsistentHash_t                    *ring_ = nullptr;
+    CH_config_t                          config_;
+    mutable ConsistentHash_LookupView_t  view_{};
+    mutable bool                         dirty_ = true;
+};
+
+/**
+ * Ring which is not changed anymore, so that any number of threads could look up at once.
+ * Its lookup view is taken on construction.
+ */
+template <class Hasher = Murmur3>
+class Snapshot {
+public:
+    explicit Snapshot(Ring<Hasher> ring) noexcept : ring_(std::move(ring)) { ring_.view(); }
+    Snapshot(Snapshot &&) noexcept = default;
+    Snapshot &operator=(Snapshot &&) noexcept = default;
+
+    uint32_t lookup(std::string_view key, span<uint32_t> out) const noexcept { return ring_.lookup(key, out); }
+    uint32_t lookup(std::string_view key, span<CH_handle_t> out) const noexcept { return ring_.lookup(key, out); }
+    uint32_t first(std::string_view key) const noexcept { return ring_.first(key); }
+    Iterator<Hasher> iterate(std::string_view key) const noexcept { return ring_.iterate(key); }
+
+    const Ring<Hasher> &ring() const noexcept { return ring_; }
+    /* mutable copy to prepare the next snapshot */
+    Ring<Hasher> copy() const { return ring_.copy(); }
+
+private:
+    Ring<Hasher> ring_;
+};
+
+/**
+ * Current snapshot for many threads: readers load() it and keep the pointer as long as they
+ * need a stable layout, writer store()s the next one. Old snapshot is freed by its last reader.
+ */
+template <class Hasher = Murmur3>
+class SharedSnapshot {
+public:
+    using pointer = std::shared_ptr<const Snapshot<Hasher>>;
+
+    SharedSnapshot() noexcept = default;
+    explicit SharedSnapshot(Snapshot<Hasher> snapshot) { store(std::move(snapshot)); }
+    SharedSnapshot(const SharedSnapshot &) = delete;
+    SharedSnapshot &operator=(const SharedSnapshot &) = delete;
+
+    /* null before first store */
+    pointer load() const noexcept {
+#if defined(__cpp_lib_atomic_shared_ptr)
+        return current_.load(std::memory_order_acquire);
+#else
+        return std::atomic_load_explicit(&current_, std::memory_order_acquire);
+#endif
+    }
+
+    void store(pointer snapshot) noexcept {
+#if defined(__cpp_lib_atomic_shared_ptr)
+        current_.store(std::move(snapshot), std::memory_order_release);
+#else
+        std::atomic_store_explicit(&current_, std::move(snapshot), std::memory_order_release);
+#endif
+    }
+    void store(Snapshot<Hasher> snapshot) { store(std::make_shared<const Snapshot<Hasher>>(std::move(snapshot))); }
+
+private:
+#if defined(__cpp_lib_atomic_shared_ptr)
+    std::atomic<pointer> current_;
+#else
+    pointer              current_;
+#endif
+};
+
+} // namespace consistent
+
+#endif
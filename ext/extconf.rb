@@ -1,5 +1,8 @@
 require 'mkmf'
 find_header("consistent.h")
+have_func("rb_interned_str", "ruby.h")
+# shm_open lives in librt on older glibc
+have_library("rt", "shm_open")
 extension_name = "consistent_ring"
 dir_config(extension_name)
 create_makefile(extension_name)
\ No newline at end of file
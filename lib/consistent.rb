@@ -2,8 +2,27 @@ require "consistent/version"
 require "consistent_ring"
 
 class Consistent
+  # Points of nodes shared by rings over overlapping node lists, so that every node's points
+  # are hashed and stored once (rings still keep own continuum):
+  #   cache = Consistent::PointCache.new
+  #   memcached = Consistent::Ring.new(hosts, point_cache: cache)
+  #   redis = Consistent::Ring.new(hosts, point_cache: cache)
+  PointCache = ConsistentPointCache
+
+  # Read only view of a ring published into shared memory by Ring#publish, so that forked
+  # workers map one copy of the layout instead of building own rings:
+  #   ring.publish("/memcached")                                   # in master, after every change
+  #   shared = Consistent::SharedRing.new("/memcached")            # in worker
+  #   shared.get(token)                                            # newest published layout
+  # item_hash: should be the same ring is created with (:murmur by default).
+  # #get(token), #get(token, n), #get(token, :all) work as Ring#get does.
+  # Consistent::SharedRing.unpublish(name) removes published ring.
+  SharedRing = ConsistentSharedRing
+
   class Ring
 
+    LOAD_CHUNK = 64 * 1024
+
     STATUSES = {
       dead: 0,
       alive: 1,
@@ -11,11 +30,43 @@ class Consistent
       default: 1 << 30
     }.freeze
 
-    def initialize(nodes = [])
-      @ring = ConsistentRing.new
-      @_add = []
-      @_update = []
-      @_replace = []
+    # Packs "ip:port" into Integer the same way handle mode does
+    def self.handle(endpoint)
+      ip, port = endpoint.split(":")
+      ip.split(".").inject(0){ |acc, octet| (acc << 8) | octet.to_i } << 16 | port.to_i
+    end
+
+    # Unpacks handle made from "ip:port" back to String
+    def self.endpoint(handle)
+      ip = handle >> 16
+      "#{ip >> 24 & 255}.#{ip >> 16 & 255}.#{ip >> 8 & 255}.#{ip & 255}:#{handle & 0xffff}"
+    end
+
+    # points_per_server: points of a node with weight 100, fewer points mean less memory
+    #   but worse balance (see #ownership and #memsize)
+    # points_hash: :md5 or :murmur (cheaper), hash used to place node points
+    # item_hash: :murmur or :md5, hash of tokens passed to #get
+    # stats: true enables counters returned by #stats
+    # hot_keys: N tracks heaviest keys sampling 1 of N lookups, see #hot_keys
+    # use_handle: true makes #get return Integer handles instead of names.
+    #   Handle is taken from node's :handle or packed from "ip:port" node name.
+    # ramp_steps: N makes nodes added later start cold and reach full weight
+    #   in N calls of #ramp_step! (unless no alive node is kept, then they start at full weight)
+    # keep_previous: true keeps layout replaced by the last change of nodes, see #get_with_previous
+    # failover: true precomputes instant failure of any node, see #fail!
+    # point_cache: Consistent::PointCache to take node points from
+    # max_total_points: N scales points of all nodes down (keeping weight ratios) to fit continuum
+    #   into N points, min_points_per_server: M keeps at least M points of every node then
+    #   (and the rest is scaled into what is left; M is lowered to N / nodes if M * nodes does not fit,
+    #   so continuum exceeds N only with more nodes than N)
+    def initialize(nodes = [], points_per_server: 500, points_hash: :md5, item_hash: :murmur,
+                   stats: false, hot_keys: nil, use_handle: false, ramp_steps: nil, keep_previous: false,
+                   failover: false, point_cache: nil, max_total_points: nil, min_points_per_server: nil)
+      @ring = ConsistentRing.new(points_per_server, points_hash, item_hash, use_handle, ramp_steps,
+                                 keep_previous, failover, point_cache)
+      @ring.points_budget(max_total_points, min_points_per_server)  if max_total_points
+      @ring.collect_stats(true)  if stats
+      @ring.track_hot_keys(hot_keys)  if hot_keys
 
       if nodes.any?
         add(nodes)
@@ -23,6 +74,26 @@ class Consistent
       end
     end
 
+    # Owner of token and its owner before the last change of nodes, if that was another node:
+    #   new_node, old_node = ring.get_with_previous(token)
+    # old_node is nil if owner is the same or previous layout is retired (or not kept,
+    # see keep_previous: option), so that reads could fall back to it until new node is warm.
+    # new_node is the one #get returns, so that hot keys marked with #mark_hot are spread as well.
+    def get_with_previous(token)
+      raise "token can't be nil"  unless token
+      @ring.get_with_previous(token)
+    end
+
+    # Number of changes of nodes applied to the ring
+    def epoch
+      @ring.epoch
+    end
+
+    # Forgets previous layout, returns false if there was none
+    def retire_previous!
+      @ring.retire_previous
+    end
+
     def get(token, cnt = nil)
       raise "token can't be nil"  unless token
       
@@ -32,7 +103,7 @@ class Consistent
         if cnt
           @ring.get(token, cnt, nil)
         else
-          @ring.get(token, 1, nil).first
+          @ring.get_first(token)
         end
       end
     end
@@ -73,58 +144,207 @@ class Consistent
       refresh!
     end
 
+    # Applies statuses at once. Ring is rebuilt only if some node becomes
+    # dead or stops being dead, returns whether it was rebuilt.
     def update!(node)
-      update(node)
+      case node
+      when Array
+        @ring.update_nodes(node)
+      when Hash
+        @ring.update_nodes([node])
+      else
+        raise "Not valid node"
+      end
+    end
+
+    # Replaces nodes with ones read from IO or file at path, one node per line:
+    #   name weight status [handle]
+    # status is alive, dead or down, lines starting with # are skipped.
+    # Text is parsed inside of extension by chunks, no Ruby objects per node are made.
+    def load_nodes(source)
+      if source.respond_to?(:read)
+        load_from(source)
+      else
+        File.open(source, "rb"){ |file| load_from(file) }
+      end
+    end
+
+    def load_nodes!(source)
+      load_nodes(source)
       refresh!
     end
 
-    def refresh!
-      @ring.add(@_add) && @_add.clear  if @_add.any?
-      @ring.update(@_update) && @_update.clear  if @_update.any?
-      @ring.add(@_replace) && @_replace.clear  if @_replace.any?
+    # Exact share of keys every node gets as a first choice,
+    # plus balance summary relative to node weights:
+    #   { nodes: { "server1" => 0.34, ... }, max_ratio: 1.04, min_ratio: 0.97, stddev: 0.03 }
+    def ownership
+      @ring.ownership
     end
 
-    private
+    # Exact key movement from this ring to other one (nodes are matched by name):
+    #   { ranges: [[start, end, old_node, new_node], ...], moved: 0.2,
+    #     moved_from: { "server1" => 0.1, ... }, moved_to: { "server4" => 0.2 } }
+    # start and end are inclusive positions in key space, see #key_hash
+    def diff(other)
+      @ring.diff(other.ring)
+    end
 
-    def add_one(node)
-      @_add << prepare_add(node)
+    # Position of token in key space, the one #diff ranges are about
+    def key_hash(token)
+      @ring.key_hash(token)
     end
 
-    def update_one(node)
-      @_update << prepare_update(node)
+    # Lookup and rebuild counters (zeros unless ring was created with stats: true):
+    #   { lookups:, probes:, collisions:, rebuilds:, rebuild_seconds:, last_rebuild_seconds:,
+    #     points_generated:, points_reused:, memsize:,
+    # and continuum size as of last rebuild (see max_total_points: option):
+    #     points:, points_budget:, points_scale:, min_points:, max_points:, max_weight_error: }
+    # max_weight_error is max deviation of node's share of points from its weight share.
+    def stats
+      @ring.stats
     end
 
-    def replace_one(node)
-      @_replace << prepare_replace(node)
+    # Heaviest keys seen by #get since creation or #reset_hot_keys (needs hot_keys: option):
+    #   [[key_hash, estimated_lookups, node], ...]
+    # key_hash is the one #key_hash returns, node is primary owner of the key.
+    # At most 32 keys are tracked, so that larger n returns them all.
+    def hot_keys(n = 10)
+      @ring.hot_keys(n)
+    end
+
+    def reset_hot_keys
+      @ring.reset_hot_keys
+    end
+
+    # Spreads #get of hot key among its first `spread` nodes:
+    #   mode: :round_robin - take them in turn
+    #   mode: :least_loaded - take less loaded of two random ones, see #report_load
+    # key could be a token or its #key_hash (as #hot_keys returns).
+    # Returns false if there are too many hot keys already.
+    def mark_hot(key, spread: 3, mode: :round_robin)
+      @ring.mark_hot(key, spread, mode)
+    end
+
+    def unmark_hot(key)
+      @ring.mark_hot(key, 1, nil)
+    end
+
+    # Any load metric of node (requests in flight, for example) used by :least_loaded spread.
+    # node is name, or handle for ring made with use_handle: true
+    def report_load(node, load)
+      @ring.report_load(node, load)
+    end
+
+    # Moves keys from overloaded alive nodes to underloaded ones, given measured load per node:
+    #   ring.rebalance!("a:11211" => 1200, "b:11211" => 800)
+    #   ring.rebalance!({ "a:11211" => 1200, "b:11211" => 800 }, max_movement: 0.1)
+    # Points of every node are scaled towards its weight share of load, keeping total points
+    # of measured nodes, but no more than max_movement fraction of keys moves per call,
+    # so call it periodically.
+    # Nodes missing in loads keep their points. Returns estimated fraction of keys moved.
+    def rebalance!(loads = nil, max_movement: 0.05, **rest)
+      # braceless loads with String keys are taken by Ruby as keyword arguments
+      loads = (loads || {}).merge(rest)
+      @ring.rebalance(loads, max_movement)
+    end
+
+    # Forgets all corrections made by #rebalance!
+    def reset_balance!
+      @ring.reset_balance
+    end
+
+    # Warms node up to its full weight in `steps` calls of #ramp_step!
+    # (nodes added to ring made with ramp_steps: option start cold by themselves).
+    # Every step moves only a small slice of keys. Returns false for unknown node.
+    def ramp_up(node, steps: 10)
+      @ring.ramp(node, 1, steps)
+    end
+
+    # Drains node down to no keys in `steps` calls of #ramp_step!, so that it could be removed.
+    def ramp_down(node, steps: 10)
+      @ring.ramp(node, 0, steps)
+    end
+
+    # Marks node dead right away. For ring made with failover: true first failure after rebuild
+    # only patches points of the node and returns true; call #rebuild! later (from background
+    # thread, for example). Patched routing is the same as rebuild gives only if losing the node
+    # keeps median weight (e.g. equal weights) and points budget scale, otherwise #rebuild! moves
+    # some keys once more. Without failover: ring is rebuilt at once and false is returned.
+    # Returns nil for unknown node.
+    def fail!(node)
+      @ring.fail_node(node)
+    end
+
+    # Is there a failure applied by #fail! without rebuild
+    def rebuild_pending?
+      @ring.rebuild_pending?
+    end
+
+    def rebuild!
+      @ring.rebuild
+    end
+
+    # Makes one step of every ramping node, call it by timer to ramp over a duration.
+    # Returns number of nodes still ramping.
+    def ramp_step!
+      @ring.ramp_step
     end
 
-    def prepare_add(node)
-      node[:status] ||= :alive
-      prepare(node)
+    # Writes current layout into shared memory segment name ("/something"),
+    # Consistent::SharedRing readers switch to it on their next lookup.
+    # There should be one publishing process for a name.
+    def publish(name)
+      @ring.publish(name)
+      self
     end
 
-    def prepare_update(node)
-      node[:status] ||= :default
-      node = prepare(node)
-      node.delete "weight"
-      node
+    # Bytes used by the ring
+    def memsize
+      @ring.memsize
     end
 
-    def prepare_replace(node)
-      node[:status] ||= :alive
-      prepare(node)
+    # Applies all pending changes with a single rebuild.
+    # Returns false if there was nothing to apply.
+    def refresh!
+      @ring.refresh
+    end
+
+    def pending?
+      @ring.pending?
+    end
+
+    def use_handle?
+      @ring.use_handle?
+    end
+
+    protected
+
+    attr_reader :ring
+
+    private
+
+    # changes are staged inside of extension, so that refresh! does not
+    # need to walk through Ruby objects again
+    def add_one(node)
+      @ring.add_node(name(node), node[:weight], node[:status], node[:handle])
+    end
+
+    def update_one(node)
+      @ring.update_node(name(node), node[:status])
+    end
+
+    def replace_one(node)
+      @ring.replace_node(name(node), node[:weight], node[:status], node[:handle])
     end
 
-    def prepare(node)
-      valid_node = {
-        "node"   => node[:node] || raise("You should declare node name"),
-        "weight" => node[:weight].to_i || 100,
-        "status" => status(node)
-      }
+    def load_from(io)
+      chunk = String.new(capacity: LOAD_CHUNK)
+      @ring.load_chunk(chunk) while io.read(LOAD_CHUNK, chunk)
+      @ring.load_chunk(nil)
     end
 
-    def status(node)
-      STATUSES[node[:status]] || raise("Bad status")
+    def name(node)
+      node[:node] || raise("You should declare node name")
     end
   end
 end
@@ -9,6 +9,7 @@ describe Consistent::Ring do
                      { node: "a3", weight: 100, status: :alive } ] }
   let(:alive_nodes){ nodes.select{ |n| n[:status] == :alive }}
   let(:ring){ Consistent::Ring.new nodes }
+  let(:keys){ Array.new(1000){ |i| "key#{i}" } }
 
   describe "new" do
     it "should create empty ring" do
@@ -68,6 +69,23 @@ describe Consistent::Ring do
     it "should return only alive" do
       ring.get("", :all).sort.must_equal alive_nodes.map{ |n| n[:node] }.sort
     end
+
+    it "should return same frozen node string every time" do
+      node = ring.get("key")
+      node.frozen?.must_equal true
+      ring.get("key").must_be_same_as node
+      ring.get("key", 2).must_include node
+    end
+
+    it "should not allocate on single node lookup" do
+      token = "key"
+      allocated = 2.times.map do
+        before = GC.stat(:total_allocated_objects)
+        1000.times{ ring.get(token) }
+        GC.stat(:total_allocated_objects) - before
+      end
+      allocated.last.must_be :<, 10
+    end
   end
 
   describe "update" do
@@ -87,6 +105,55 @@ describe Consistent::Ring do
       ring.update! node: "second", status: :dead
       ring.get("", :all).size.must_equal 0
     end
+
+    it "should not rebuild ring when node is only down" do
+      ring = Consistent::Ring.new nodes, stats: true
+      ring.update!(node: "second", status: :down).must_equal false
+      ring.get("", :all).must_equal ["theverylast"]
+      ring.update!([{ node: "second", status: :alive }, { node: "unknown", status: :dead }]).must_equal false
+      ring.get("", :all).size.must_equal 2
+      ring.update!(node: "second", status: :dead).must_equal true
+      ring.stats[:rebuilds].must_equal 2
+    end
+
+    it "should apply pending changes with update!" do
+      ring.add node: "a1"
+      ring.update!(node: "second", status: :dead).must_equal true
+      ring.get("", :all).sort.must_equal ["a1", "theverylast"]
+    end
+  end
+
+  describe "refresh" do
+    it "should apply add, update and replace with one rebuild" do
+      ring = Consistent::Ring.new nodes, stats: true
+      ring.add node: "a1"
+      ring.update node: "second", status: :down
+      ring.pending?.must_equal true
+      ring.refresh!.must_equal true
+      ring.pending?.must_equal false
+      ring.stats[:rebuilds].must_equal 2
+      ring.get("", :all).sort.must_equal ["a1", "theverylast"]
+    end
+
+    it "should not rebuild without changes" do
+      ring = Consistent::Ring.new nodes, stats: true
+      ring.refresh!.must_equal false
+      ring.stats[:rebuilds].must_equal 1
+    end
+
+    it "should keep previously added nodes" do
+      ring.add! node: "a1"
+      ring.add! node: "a2"
+      ring.get("", :all).sort.must_equal ["a1", "a2", "second", "theverylast"]
+    end
+
+    it "should accept statuses as symbols" do
+      ring.update! node: "second", status: :down
+      ring.get("", :all).must_equal ["theverylast"]
+      ring.update! node: "second", status: :default
+      ring.get("", :all).size.must_equal 2
+      proc{ ring.update! node: "second", status: :zombie }.must_raise ArgumentError
+    end
   end
 
   describe "replace" do
@@ -102,4 +169,535 @@ describe Consistent::Ring do
       ring.get("", :all).sort.must_equal new_nodes.map{ |n| n[:node] }.sort
     end
   end
-end
\ No newline at end of file
+
+  describe "ownership" do
+    it "should split whole key space between alive nodes" do
+      ownership = ring.ownership
+      ownership[:nodes].values.inject(:+).must_be_close_to 1.0
+      ownership[:nodes]["dead"].must_equal 0.0
+      alive_nodes.each{ |n| ownership[:nodes][n[:node]].must_be :>, 0.3 }
+    end
+
+    it "should report balance stats" do
+      ownership = ring.ownership
+      ownership[:max_ratio].must_be :>=, 1.0
+      ownership[:min_ratio].must_be :<=, 1.0
+      ownership[:stddev].must_be :>=, 0.0
+    end
+
+    it "should key nodes by names get returns" do
+      names = ring.ownership[:nodes].keys
+      names.each{ |name| name.frozen?.must_equal true }
+      ring.get("", :all).each{ |name| names.find{ |n| n == name }.must_be_same_as name }
+    end
+  end
+
+  describe "diff" do
+    let(:other){ Consistent::Ring.new(nodes + [{ node: "newbie", weight: 100, status: :alive }]) }
+
+    it "should be empty for same nodes" do
+      diff = ring.diff(Consistent::Ring.new(nodes))
+      diff[:ranges].must_equal []
+      diff[:moved].must_equal 0.0
+    end
+
+    it "should move keys only to added node" do
+      diff = ring.diff(other)
+      diff[:moved_to].keys.must_equal ["newbie"]
+      diff[:moved].must_be_close_to diff[:moved_from].values.inject(:+)
+      diff[:ranges].each{ |_, _, _, new_node| new_node.must_equal "newbie" }
+      diff[:moved_to].keys.first.must_be_same_as other.get("", :all).find{ |n| n == "newbie" }
+    end
+
+    it "should point to keys which change their node" do
+      diff = ring.diff(other)
+      moved = (1..300).map{ |i| "key#{i}" }.select{ |key| ring.get(key) != other.get(key) }
+      moved.wont_be_empty
+      moved.each do |key|
+        hash = ring.key_hash(key)
+        diff[:ranges].any?{ |from, to, _, _| (from..to).cover?(hash) }.must_equal true
+      end
+    end
+  end
+
+  describe "stats" do
+    it "should be zeros by default" do
+      ring.get("key")
+      ring.stats[:lookups].must_equal 0
+      ring.stats[:rebuilds].must_equal 0
+    end
+
+    it "should count lookups and rebuilds" do
+      ring = Consistent::Ring.new nodes, stats: true
+      ring.get("key")
+      ring.get("key", :all)
+      stats = ring.stats
+      stats[:lookups].must_equal 2
+      stats[:probes].must_be :>=, 3
+      stats[:rebuilds].must_equal 1
+      stats[:points_generated].must_be :>, 0
+      stats[:last_rebuild_seconds].must_be :>, 0
+    end
+
+    it "should reuse points of known nodes" do
+      ring = Consistent::Ring.new nodes, stats: true
+      generated = ring.stats[:points_generated]
+      ring.update! node: "second", status: :dead
+      ring.stats[:points_generated].must_equal generated
+      ring.stats[:points_reused].must_be :>, 0
+    end
+  end
+
+  describe "use_handle" do
+    let(:endpoints){ ["10.0.0.1:11211", "10.0.0.2:11211", "10.0.0.3:11212"] }
+    let(:ring){ Consistent::Ring.new endpoints.map{ |e| { node: e } }, use_handle: true }
+
+    it "should return handles packed from ip:port" do
+      handles = endpoints.map{ |e| Consistent::Ring.handle(e) }
+      handles.must_include ring.get("key")
+      ring.get("key", :all).sort.must_equal handles.sort
+      Consistent::Ring.endpoint(handles.last).must_equal "10.0.0.3:11212"
+    end
+
+    it "should pick same nodes as name ring" do
+      names = Consistent::Ring.new endpoints.map{ |e| { node: e } }
+      (1..100).each do |i|
+        Consistent::Ring.endpoint(ring.get("key#{i}")).must_equal names.get("key#{i}")
+      end
+    end
+
+    it "should use given handles" do
+      ring = Consistent::Ring.new [{ node: "first", handle: 1 }, { node: "second", handle: 2 }], use_handle: true
+      ring.get("key", :all).sort.must_equal [1, 2]
+      ring.update! node: "first", status: :dead
+      ring.get("key", :all).must_equal [2]
+    end
+
+    it "should reject nodes without handle" do
+      proc{ Consistent::Ring.new [{ node: "first" }], use_handle: true }.must_raise ArgumentError
+      proc{ Consistent::Ring.new [{ node: "a", handle: 1 }, { node: "b", handle: 1 }], use_handle: true }.must_raise ArgumentError
+    end
+  end
+
+  describe "config" do
+    it "should use less memory with fewer points" do
+      small = Consistent::Ring.new nodes, points_per_server: 40
+      big = Consistent::Ring.new nodes, points_per_server: 1000
+      small.memsize.must_be :<, big.memsize
+    end
+
+    it "should report memsize to ObjectSpace" do
+      require 'objspace'
+      ObjectSpace.memsize_of(ring.instance_variable_get(:@ring)).must_be :>=, ring.memsize
+    end
+
+    it "should find same nodes with same config only" do
+      murmur = Consistent::Ring.new nodes, points_hash: :murmur
+      same = Consistent::Ring.new nodes, points_hash: :murmur
+      keys = (1..100).map{ |i| "key#{i}" }
+      keys.map{ |k| murmur.get(k) }.must_equal keys.map{ |k| same.get(k) }
+      keys.map{ |k| murmur.get(k) }.wont_equal keys.map{ |k| ring.get(k) }
+    end
+
+    it "should hash items with md5" do
+      md5 = Consistent::Ring.new nodes, item_hash: :md5
+      md5.key_hash("key").wont_equal ring.key_hash("key")
+      proc{ md5.diff(ring) }.must_raise ArgumentError
+    end
+
+    it "should reject bad options" do
+      proc{ Consistent::Ring.new nodes, points_hash: :sha1 }.must_raise ArgumentError
+      proc{ Consistent::Ring.new nodes, points_per_server: 0 }.must_raise ArgumentError
+    end
+  end
+
+  describe "load_nodes" do
+    let(:text){ "# name weight status\nsecond 100 alive\n\ntheverylast\t100 alive\r\ndead 100 dead\n" }
+
+    it "should replace nodes with ones from IO" do
+      ring = Consistent::Ring.new new_nodes
+      ring.load_nodes(StringIO.new(text))
+      ring.get("", :all).size.must_equal 3
+      ring.refresh!
+      ring.get("", :all).sort.must_equal ["second", "theverylast"]
+    end
+
+    it "should find same nodes as ring made of hashes" do
+      loaded = Consistent::Ring.new
+      loaded.load_nodes!(StringIO.new(text))
+      (1..100).each{ |i| loaded.get("key#{i}").must_equal ring.get("key#{i}") }
+    end
+
+    it "should load file by chunks" do
+      require 'tempfile'
+      Tempfile.create("nodes") do |file|
+        file.write((1..3000).map{ |i| "node#{i} #{100 + i % 3} alive" }.join("\n"))
+        file.flush
+        ring = Consistent::Ring.new
+        ring.load_nodes!(file.path)
+        ring.get("", :all).size.must_equal 3000
+      end
+    end
+
+    it "should take handles" do
+      ring = Consistent::Ring.new use_handle: true
+      ring.load_nodes!(StringIO.new("10.0.0.1:11211 100 alive\ncache 100 alive 7\n"))
+      ring.get("", :all).sort.must_equal [7, Consistent::Ring.handle("10.0.0.1:11211")]
+    end
+
+    it "should reject bad lines" do
+      e = proc{ ring.load_nodes(StringIO.new("a1 100 alive\na2 100 zombie\n")) }.must_raise ArgumentError
+      e.message.must_match(/line 2/)
+      ring.pending?.must_equal false
+    end
+  end
+
+  describe "hot_keys" do
+    it "should be empty without tracking" do
+      ring.get("key")
+      ring.hot_keys.must_equal []
+    end
+
+    it "should find heaviest key with its node" do
+      ring = Consistent::Ring.new nodes, hot_keys: 4
+      20_000.times{ |i| ring.get(i % 3 == 0 ? "celebrity" : "key#{i}") }
+      hash, count, node = ring.hot_keys(3).first
+      hash.must_equal ring.key_hash("celebrity")
+      count.must_be :>, 3000
+      node.must_equal ring.get("celebrity")
+      ring.reset_hot_keys
+      ring.hot_keys.must_equal []
+    end
+
+    it "should estimate counts without bias" do
+      ring = Consistent::Ring.new nodes, hot_keys: 1
+      1000.times{ ring.get("celebrity") }
+      ring.hot_keys(1).first[1].must_be :>=, 990 # countdown left by other rings of this thread
+      ring.hot_keys(1).first[1].must_be :<=, 1000
+
+      ring = Consistent::Ring.new nodes, hot_keys: 4
+      40_000.times{ ring.get("celebrity") }
+      ring.hot_keys(1).first[1].must_be_within_delta 40_000, 2000
+    end
+
+    it "should return no more than tracked candidates" do
+      ring = Consistent::Ring.new nodes, hot_keys: 1
+      100.times{ |i| ring.get("key#{i}") }
+      ring.hot_keys(2**32 - 1).size.must_equal 32
+    end
+  end
+
+  describe "mark_hot" do
+    let(:ring){ Consistent::Ring.new new_nodes }
+
+    it "should spread hot key round robin" do
+      first = ring.get("celebrity")
+      ring.mark_hot("celebrity", spread: 2).must_equal true
+      picked = Array.new(4){ ring.get("celebrity") }
+      picked.tally.values.must_equal [2, 2]
+      picked.sort.must_equal ring.get("celebrity", 2).flat_map{ |n| [n, n] }.sort
+      picked.must_include first
+      ring.unmark_hot("celebrity")
+      Array.new(4){ ring.get("celebrity") }.uniq.must_equal [first]
+    end
+
+    it "should spread evenly when spread exceeds nodes" do
+      ring.mark_hot("celebrity", spread: 10)
+      Array.new(900){ ring.get("celebrity") }.tally.values.must_equal [300, 300, 300]
+      ring.update!(node: "a1", status: :down)
+      Array.new(600){ ring.get("celebrity") }.tally.values.must_equal [300, 300]
+    end
+
+    it "should prefer less loaded node" do
+      first = ring.get("celebrity")
+      ring.mark_hot(ring.key_hash("celebrity"), spread: 3, mode: :least_loaded)
+      ring.report_load(first, 100).must_equal true
+      Array.new(50){ ring.get("celebrity") }.wont_include first
+      ring.report_load("unknown", 1).must_equal false
+    end
+  end
+
+  describe "rebalance!" do
+    let(:ring){ Consistent::Ring.new new_nodes }
+
+    it "should move bounded share of keys from overloaded node" do
+      before = ring.ownership[:nodes]
+      keys = Array.new(2000){ |i| "key#{i}" }
+      owners = keys.map{ |k| ring.get(k) }
+      loads = before.merge("a1" => before["a1"] * 3)
+      moved = ring.rebalance!(loads, max_movement: 0.1)
+      moved.must_be :>, 0.0
+      moved.must_be :<=, 0.1
+      ring.ownership[:nodes]["a1"].must_be :<, before["a1"]
+      changed = keys.zip(owners).count{ |k, o| ring.get(k) != o }
+      (changed / 2000.0).must_be :<, 0.15
+      # overloaded node does not receive keys
+      keys.zip(owners).each{ |k, o| ring.get(k).wont_equal "a1" if o != "a1" }
+    end
+
+    it "should not move keys of balanced ring" do
+      ring.rebalance!(ring.ownership[:nodes]).must_be :<, 0.01
+    end
+
+    it "should keep continuum size" do
+      ring = Consistent::Ring.new Array.new(5){ |i| { node: "s#{i}" } }, stats: true
+      points = ring.stats[:points]
+      loads = { "s0" => 5000, "s1" => 100, "s2" => 100, "s3" => 100, "s4" => 100 }
+      10.times do
+        before = ring.ownership[:nodes]
+        moved = ring.rebalance!(loads)
+        after = ring.ownership[:nodes]
+        moved.must_be_close_to before.sum{ |n, share| (after[n] - share).abs } / 2, 0.01
+        ring.stats[:points].must_be_within_delta points, points * 0.02
+      end
+    end
+
+    it "should take braceless loads" do
+      ring.rebalance!("a1" => 10, "a2" => 1, "a3" => 1).must_be :>, 0.0
+      ring.rebalance!("a1" => 10, "a2" => 1, "a3" => 1, max_movement: 0.2).must_be :>, 0.05
+    end
+
+    it "should restore points" do
+      owners = keys.first(200).map{ |k| ring.get(k) }
+      ring.rebalance!({ "a1" => 10, "a2" => 1, "a3" => 1 }, max_movement: 0.3)
+      ring.reset_balance!
+      keys.first(200).map{ |k| ring.get(k) }.must_equal owners
+    end
+  end
+
+  describe "ramp" do
+
+    it "should warm up added node step by step" do
+      ring = Consistent::Ring.new new_nodes, ramp_steps: 4
+      owners = keys.map{ |k| ring.get(k) }
+      ring.add!(node: "a4")
+      keys.map{ |k| ring.get(k) }.must_equal owners
+      ring.get("", :all).wont_include "a4"
+      shares = Array.new(4) do |i|
+        ring.ramp_step!.must_equal(i < 3 ? 1 : 0)
+        keys.count{ |k| ring.get(k) == "a4" }
+      end
+      shares.must_equal shares.sort
+      shares.first.must_be :>, 0
+      shares.first.must_be :<, shares.last
+    end
+
+    it "should not ramp when whole fleet is replaced" do
+      ring = Consistent::Ring.new [{ node: "a" }, { node: "b" }], ramp_steps: 5
+      ring.replace!([{ node: "c" }, { node: "d" }])
+      ring.get("x").wont_be_nil
+      ring.get("x", :all).sort.must_equal ["c", "d"]
+      ring.ramp_step!.must_equal 0
+    end
+
+    it "should drain node before removal" do
+      ring = Consistent::Ring.new new_nodes
+      ring.ramp_down("a1", steps: 2).must_equal true
+      ring.ramp_down("unknown").must_equal false
+      ring.ramp_step!.must_equal 1
+      keys.count{ |k| ring.get(k) == "a1" }.must_be :>, 0
+      ring.ramp_step!.must_equal 0
+      keys.map{ |k| ring.get(k) }.wont_include "a1"
+      ring.get("", :all).sort.must_equal ["a2", "a3"]
+      ring.ramp_up("a1", steps: 1)
+      ring.ramp_step!
+      ring.get("", :all).sort.must_equal ["a1", "a2", "a3"]
+    end
+  end
+
+  describe "get_with_previous" do
+    let(:ring){ Consistent::Ring.new new_nodes, keep_previous: true }
+
+    it "should return previous owner of moved keys" do
+      owners = keys.map{ |k| ring.get(k) }
+      epoch = ring.epoch
+      ring.add!(node: "a4")
+      ring.epoch.must_equal epoch + 1
+      moved = 0
+      keys.zip(owners).each do |k, owner|
+        now, before = ring.get_with_previous(k)
+        now.must_equal ring.get(k)
+        if now == owner
+          before.must_be_nil
+        else
+          now.must_equal "a4"
+          before.must_equal owner
+          moved += 1
+        end
+      end
+      moved.must_be :>, 0
+      ring.retire_previous!.must_equal true
+      keys.map{ |k| ring.get_with_previous(k).last }.compact.must_be_empty
+      ring.retire_previous!.must_equal false
+    end
+
+    it "should spread marked hot key as get does" do
+      ring.add!(node: "a4")
+      ring.mark_hot "k", spread: 3
+      nodes = ring.get("k", 3)
+      Array.new(6){ ring.get_with_previous("k").first }.must_equal nodes.rotate(1) * 2
+      Array.new(3){ ring.get("k") }.must_equal nodes.rotate(1)
+    end
+
+    it "should not keep previous layout by default" do
+      ring = Consistent::Ring.new new_nodes
+      ring.add!(node: "a4")
+      keys.map{ |k| ring.get_with_previous(k).last }.compact.must_be_empty
+    end
+  end
+
+  describe "fail!" do
+    let(:nodes){ Array.new(5){ |i| { node: "n#{i}" } } }
+
+    it "should route as rebuilt ring right after failure" do
+      ring = Consistent::Ring.new nodes, failover: true
+      ring.fail!("n2").must_equal true
+      ring.rebuild_pending?.must_equal true
+      patched = keys.map{ |k| ring.get(k) }
+      patched.wont_include "n2"
+      ring.rebuild!
+      ring.rebuild_pending?.must_equal false
+      keys.map{ |k| ring.get(k) }.must_equal patched
+    end
+
+    it "should rebuild on second failure or without tables" do
+      ring = Consistent::Ring.new nodes, failover: true
+      ring.fail!("n1").must_equal true
+      ring.fail!("n3").must_equal false
+      ring.rebuild_pending?.must_equal false
+      ring.get("", :all).sort.must_equal ["n0", "n2", "n4"]
+      ring.fail!("unknown").must_be_nil
+      Consistent::Ring.new(nodes).fail!("n1").must_equal false
+    end
+  end
+
+  describe "point_cache" do
+    let(:cache){ Consistent::PointCache.new }
+    let(:hosts){ Array.new(10){ |i| { node: "h#{i}" } } }
+
+    it "should share points of same nodes" do
+      first = Consistent::Ring.new hosts.first(6), point_cache: cache, stats: true
+      second = Consistent::Ring.new hosts.last(6), point_cache: cache, stats: true
+      cache.size.must_equal 10
+      cache.memsize.must_be :>, 0
+      second.stats[:points_reused].must_be :>, 0
+      plain = Consistent::Ring.new hosts.last(6)
+      Array.new(500){ |i| "key#{i}" }.each{ |k| second.get(k).must_equal plain.get(k) }
+    end
+
+    it "should not mix points of different hashes" do
+      murmur = Consistent::Ring.new hosts, point_cache: cache, points_hash: :murmur
+      md5 = Consistent::Ring.new hosts, point_cache: cache, points_hash: :md5
+      cache.size.must_equal 20
+      md5.get("key").must_equal Consistent::Ring.new(hosts).get("key")
+      murmur.replace!(hosts.first(2))
+      cache.size.must_equal 12
+    end
+  end
+
+  describe "max_total_points" do
+    let(:nodes){ Array.new(20){ |i| { node: "n#{i}", weight: i == 0 ? 2000 : 100 } } }
+
+    it "should fit continuum into budget keeping weight ratios" do
+      ring = Consistent::Ring.new nodes, points_per_server: 160, max_total_points: 2000
+      stats = ring.stats
+      stats[:points].must_be :<=, 2000
+      stats[:points_budget].must_equal 2000
+      stats[:points_scale].must_be :<, 1.0
+      stats[:max_weight_error].must_be :<, 0.1
+      ring.ownership[:nodes]["n0"].must_be :>, 0.4
+    end
+
+    it "should keep minimum points per node" do
+      ring = Consistent::Ring.new nodes, points_per_server: 160, max_total_points: 500, min_points_per_server: 20
+      stats = ring.stats
+      stats[:min_points].must_equal 20
+      stats[:points].must_be :<=, 500
+      stats[:points].must_be :>, 450
+      stats[:max_weight_error].must_be :>, 0.1
+    end
+
+    it "should lower minimum points exceeding budget" do
+      ring = Consistent::Ring.new nodes, points_per_server: 160, max_total_points: 300, min_points_per_server: 20
+      stats = ring.stats
+      stats[:points].must_be :<=, 300
+      stats[:min_points].must_equal 15
+    end
+
+    it "should keep budget with many nodes at minimum" do
+      many = Array.new(100){ |i| { node: "n#{i}" } }
+      ring = Consistent::Ring.new many, points_per_server: 160, max_total_points: 300, min_points_per_server: 5
+      stats = ring.stats
+      stats[:points].must_be :<=, 300
+      stats[:min_points].must_equal 3
+      ring.ownership[:nodes].values.min.must_be :>, 0
+    end
+
+    it "should not scale ring without budget" do
+      stats = Consistent::Ring.new(nodes, points_per_server: 160).stats
+      stats[:points_budget].must_be_nil
+      stats[:points_scale].must_equal 1.0
+      stats[:points].must_equal 160 * 19 + 3200
+    end
+  end
+
+  describe "shared memory" do
+    let(:shm){ "/consistent_spec_#{Process.pid}" }
+    let(:nodes){ Array.new(8){ |i| { node: "n#{i}", status: i == 3 ? :down : :alive } } }
+    let(:keys){ Array.new(300){ |i| "key#{i}" } }
+
+    after { Consistent::SharedRing.unpublish(shm) }
+
+    it "should route as published ring" do
+      ring = Consistent::Ring.new(nodes).publish(shm)
+      shared = Consistent::SharedRing.new(shm)
+      shared.size.must_equal 8
+      keys.each do |k|
+        shared.get(k).must_equal ring.get(k)
+        shared.get(k, 3).must_equal ring.get(k, 3)
+      end
+      shared.get("key", :all).sort.must_equal ring.get("key", :all).sort
+      proc{ shared.get("key", :some) }.must_raise TypeError
+    end
+
+    it "should pick up new versions" do
+      ring = Consistent::Ring.new(nodes).publish(shm)
+      shared = Consistent::SharedRing.new(shm)
+      shared.generation.must_equal 1
+      ring.update!(node: "n0", status: :dead)
+      ring.publish(shm)
+      keys.each{ |k| shared.get(k).must_equal ring.get(k) }
+      shared.generation.must_equal 2
+      shared.refresh.must_equal false
+    end
+
+    it "should be read by forked workers" do
+      ring = Consistent::Ring.new(nodes).publish(shm)
+      reader, writer = IO.pipe
+      pid = fork do
+        reader.close
+        writer.write Consistent::SharedRing.new(shm).get("token", 2).join(",")
+        exit!(0)
+      end
+      writer.close
+      Process.wait(pid)
+      reader.read.must_equal ring.get("token", 2).join(",")
+    end
+
+    it "should check item_hash and publication" do
+      Consistent::Ring.new(nodes).publish(shm)
+      proc{ Consistent::SharedRing.new(shm, :md5) }.must_raise ArgumentError
+      Consistent::SharedRing.unpublish(shm).must_equal true
+      Consistent::SharedRing.unpublish(shm).must_equal false
+      proc{ Consistent::SharedRing.new(shm) }.must_raise ArgumentError
+    end
+
+    it "should reject segment with tables outside of it" do
+      Consistent::Ring.new(nodes).publish(shm)
+      segment = "/dev/shm#{shm}.1"
+      skip "no /dev/shm" unless File.exist?(segment)
+      File.open(segment, "r+b"){ |f| f.seek(48); f.write([1 << 40].pack("Q")) }  # servers_off
+      proc{ Consistent::SharedRing.new(shm) }.must_raise RuntimeError
+    end
+  end
+end